@@ -0,0 +1,386 @@
+/**
+ * A pool of cached blocks under a memory limit, protected by a single mutex.
+ * Frames are found through a hash table keyed by (file, block number), and
+ * the clock hand sweeps a list of all frames looking for ones to replace.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "common/bufferPool.h"
+
+struct BufferPool {
+    pthread_mutex_t lock;         /* Protects everything below */
+    size_t memoryLimit;           /* Bytes of block data we try to stay under */
+    size_t memoryUsed;            /* Bytes of block data currently allocated */
+
+    PoolFrame **frames;           /* Every frame, published or not */
+    size_t nrFrames;
+    size_t maxFrames;             /* Allocated size of the frames array */
+    size_t clockHand;             /* Next frame to consider for replacement */
+
+    PoolFrame **buckets;          /* Hash table of published frames */
+    size_t bucketMask;            /* Number of buckets - 1, a power of two */
+
+    uint64_t *generations;        /* Per bucket, bumped whenever a block hashing there is invalidated */
+    uint64_t fileGeneration;      /* Bumped whenever all of a file's blocks are invalidated */
+};
+
+static bool replaceFrame(BufferPool *pool);
+static void removeFrame(BufferPool *pool, PoolFrame *frame);
+static void unpublishFrame(BufferPool *pool, PoolFrame *frame);
+
+
+static inline bool sameFile(const PoolFile *a, const PoolFile *b)
+{
+    return a->pipeline == b->pipeline && a->device == b->device && a->inode == b->inode;
+}
+
+
+/* Which hash bucket holds the block. */
+static inline size_t bucketOf(BufferPool *pool, const PoolFile *file, size_t blockNr)
+{
+    uint64_t key = (uint64_t)(uintptr_t)file->pipeline ^ file->device * 0xD6E8FEB86659FD93ull ^ file->inode
+                 ^ (blockNr * 0x9E3779B97F4A7C15ull);
+    return (key ^ key >> 29) * 0xBF58476D1CE4E5B9ull >> 32 & pool->bucketMask;
+}
+
+
+/*
+ * Find a published frame. Must hold the lock.
+ */
+static PoolFrame *findFrame(BufferPool *pool, const PoolFile *file, size_t blockNr)
+{
+    for (PoolFrame *frame = pool->buckets[bucketOf(pool, file, blockNr)]; frame != NULL; frame = frame->nextInBucket)
+        if (frame->blockNr == blockNr && sameFile(&frame->file, file))
+            return frame;
+
+    return NULL;
+}
+
+
+/**
+ * Identify a file by its device and inode, so all handles open on it share its blocks.
+ * If we can't stat the file, give it an identity of its own so nothing else shares it.
+ */
+PoolFile bufferPoolFile(const void *pipeline, const char *path, const void *handle)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return (PoolFile){.pipeline = handle};
+
+    return (PoolFile){.pipeline = pipeline, .device = (uint64_t)st.st_dev, .inode = (uint64_t)st.st_ino};
+}
+
+
+/**
+ * Find a cached block and pin it so it won't be replaced while we use it.
+ */
+PoolFrame *bufferPoolPin(BufferPool *pool, const PoolFile *file, size_t blockNr)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    PoolFrame *frame = findFrame(pool, file, blockNr);
+    if (frame != NULL)
+    {
+        frame->pins++;
+        frame->referenced = true;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return frame;
+}
+
+
+/**
+ * Stop using a frame. If it was replaced by a newer version while we used it, nobody else can find it, so release it.
+ */
+void bufferPoolUnpin(BufferPool *pool, PoolFrame *frame)
+{
+    pthread_mutex_lock(&pool->lock);
+    frame->pins--;
+    if (frame->pins == 0 && !frame->published)
+        removeFrame(pool, frame);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Get a pinned frame to hold a new block, replacing other blocks if needed to stay under the limit.
+ * The frame can't be found until it is published.
+ */
+PoolFrame *bufferPoolAllocate(BufferPool *pool, const PoolFile *file, size_t blockNr, size_t size)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    /* Make room, giving up if everything is pinned. */
+    while (pool->memoryUsed + size > pool->memoryLimit && replaceFrame(pool))
+        ;
+
+    /* Create the frame and add it to the list for the clock hand to find. */
+    PoolFrame *frame = malloc(sizeof(PoolFrame));
+    *frame = (PoolFrame){.data = malloc(size), .file = *file, .blockNr = blockNr, .size = size, .pins = 1};
+    if (pool->nrFrames == pool->maxFrames)
+    {
+        pool->maxFrames = sizeMax(2 * pool->maxFrames, 16);
+        pool->frames = realloc(pool->frames, pool->maxFrames * sizeof(PoolFrame *));
+    }
+    frame->index = pool->nrFrames++;
+    pool->frames[frame->index] = frame;
+    pool->memoryUsed += size;
+
+    pthread_mutex_unlock(&pool->lock);
+    return frame;
+}
+
+
+/*
+ * Put a frame in the hash table. Must hold the lock.
+ */
+static void publishFrame(BufferPool *pool, PoolFrame *frame, size_t actual)
+{
+    frame->actual = actual;
+    frame->published = true;
+    size_t bucket = bucketOf(pool, &frame->file, frame->blockNr);
+    frame->nextInBucket = pool->buckets[bucket];
+    pool->buckets[bucket] = frame;
+}
+
+
+/*
+ * The generation of a block, which changes whenever the block is invalidated. Must hold the lock.
+ */
+static inline uint64_t generationOf(BufferPool *pool, const PoolFile *file, size_t blockNr)
+{
+    return pool->fileGeneration + pool->generations[bucketOf(pool, file, blockNr)];
+}
+
+
+/**
+ * Note the generation of a block before reading it from the file, to be passed to bufferPoolPublish.
+ */
+uint64_t bufferPoolGeneration(BufferPool *pool, const PoolFile *file, size_t blockNr)
+{
+    pthread_mutex_lock(&pool->lock);
+    uint64_t generation = generationOf(pool, file, blockNr);
+    pthread_mutex_unlock(&pool->lock);
+    return generation;
+}
+
+
+/**
+ * Make a frame filled from the file visible to others. It remains pinned.
+ * If someone published the block while we were reading it, theirs may be newer, so we keep theirs
+ * and ours stays unpublished until we unpin it. Likewise if the block was invalidated since we
+ * started reading, since we may have read it before it was overwritten.
+ */
+void bufferPoolPublish(BufferPool *pool, PoolFrame *frame, size_t actual, uint64_t generation)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    frame->actual = actual;
+    if (generation == generationOf(pool, &frame->file, frame->blockNr) && findFrame(pool, &frame->file, frame->blockNr) == NULL)
+        publishFrame(pool, frame, actual);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Make a frame holding newly written data visible to others, replacing any older version of the block.
+ */
+void bufferPoolReplace(BufferPool *pool, PoolFrame *frame, size_t actual)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    PoolFrame *older = findFrame(pool, &frame->file, frame->blockNr);
+    if (older != NULL)
+        unpublishFrame(pool, older);
+    publishFrame(pool, frame, actual);
+    pool->generations[bucketOf(pool, &frame->file, frame->blockNr)]++;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Throw away a frame which couldn't be filled.
+ */
+void bufferPoolDiscard(BufferPool *pool, PoolFrame *frame)
+{
+    pthread_mutex_lock(&pool->lock);
+    removeFrame(pool, frame);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Give an unpublished frame a new identity, so its memory can be reused for another block.
+ */
+void bufferPoolRename(BufferPool *pool, PoolFrame *frame, const PoolFile *file, size_t blockNr)
+{
+    pthread_mutex_lock(&pool->lock);
+    frame->file = *file;
+    frame->blockNr = blockNr;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Report how much block data the pool holds, which may be over the limit while everything is pinned.
+ */
+size_t bufferPoolMemoryUsed(BufferPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    size_t memoryUsed = pool->memoryUsed;
+    pthread_mutex_unlock(&pool->lock);
+    return memoryUsed;
+}
+
+
+/**
+ * Drop a range of a file's blocks, typically because they were overwritten.
+ */
+void bufferPoolForget(BufferPool *pool, const PoolFile *file, size_t firstBlock, size_t lastBlock)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    for (size_t blockNr = firstBlock; blockNr <= lastBlock; blockNr++)
+    {
+        PoolFrame *frame = findFrame(pool, file, blockNr);
+        if (frame != NULL)
+            unpublishFrame(pool, frame);
+        pool->generations[bucketOf(pool, file, blockNr)]++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Drop all of a file's blocks, typically because the file was truncated.
+ */
+void bufferPoolForgetFile(BufferPool *pool, const PoolFile *file)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    /* Scan backwards, since removing a frame moves the last frame into its place. */
+    for (size_t idx = pool->nrFrames; idx > 0; idx--)
+        if (pool->frames[idx-1]->published && sameFile(&pool->frames[idx-1]->file, file))
+            unpublishFrame(pool, pool->frames[idx-1]);
+    pool->fileGeneration++;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Make a published frame impossible to find. If nobody is using it, release it now,
+ * otherwise it is released when the last user unpins it. Must hold the lock.
+ */
+static void unpublishFrame(BufferPool *pool, PoolFrame *frame)
+{
+    if (frame->pins == 0)
+    {
+        removeFrame(pool, frame);
+        return;
+    }
+
+    PoolFrame **link = &pool->buckets[bucketOf(pool, &frame->file, frame->blockNr)];
+    while (*link != frame)
+        link = &(*link)->nextInBucket;
+    *link = frame->nextInBucket;
+    frame->published = false;
+}
+
+
+/*
+ * Use the CLOCK algorithm to find an unpinned frame and remove it. Must hold the lock.
+ *   @returns - false if every frame is pinned.
+ */
+static bool replaceFrame(BufferPool *pool)
+{
+    /* Two trips around the clock are enough to clear every reference bit. */
+    for (size_t count = 0; count < 2 * pool->nrFrames; count++)
+    {
+        if (pool->clockHand >= pool->nrFrames)
+            pool->clockHand = 0;
+        PoolFrame *frame = pool->frames[pool->clockHand++];
+
+        if (frame->pins > 0)
+            continue;
+        if (frame->referenced)
+            frame->referenced = false;
+        else
+        {
+            removeFrame(pool, frame);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Remove a frame from the hash table and the list of frames, and release its memory. Must hold the lock.
+ */
+static void removeFrame(BufferPool *pool, PoolFrame *frame)
+{
+    /* Unlink it from its hash chain */
+    if (frame->published)
+    {
+        PoolFrame **link = &pool->buckets[bucketOf(pool, &frame->file, frame->blockNr)];
+        while (*link != frame)
+            link = &(*link)->nextInBucket;
+        *link = frame->nextInBucket;
+    }
+
+    /* Move the last frame into its place in the list. */
+    PoolFrame *last = pool->frames[--pool->nrFrames];
+    pool->frames[frame->index] = last;
+    last->index = frame->index;
+
+    pool->memoryUsed -= frame->size;
+    free(frame->data);
+    free(frame);
+}
+
+
+/**
+ * Create a pool which tries to keep its cached blocks within memoryLimit bytes.
+ */
+BufferPool *bufferPoolNew(size_t memoryLimit)
+{
+    BufferPool *pool = malloc(sizeof(BufferPool));
+    *pool = (BufferPool){.memoryLimit = memoryLimit};
+    pthread_mutex_init(&pool->lock, NULL);
+
+    /* Size the hash table assuming 4K blocks, but not too small. */
+    size_t nrBuckets = 64;
+    while (nrBuckets < memoryLimit / 4096 * 2)
+        nrBuckets *= 2;
+    pool->bucketMask = nrBuckets - 1;
+    pool->buckets = calloc(nrBuckets, sizeof(PoolFrame *));
+    pool->generations = calloc(nrBuckets, sizeof(uint64_t));
+
+    return pool;
+}
+
+
+/**
+ * Release the pool and all its blocks. Nothing may be using it.
+ */
+void bufferPoolFree(BufferPool *pool)
+{
+    for (size_t idx = 0; idx < pool->nrFrames; idx++)
+    {
+        free(pool->frames[idx]->data);
+        free(pool->frames[idx]);
+    }
+    free(pool->frames);
+    free(pool->buckets);
+    free(pool->generations);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,84 @@
+/**
+ * A pool of cached blocks kept under a memory limit, which may be shared by many open files
+ * and threads. Blocks are identified by (file, block number), where the file is the pipeline
+ * reading it plus the file's device and inode, so every handle open on the same file through
+ * the same pipeline sees the same blocks.
+ *
+ * A frame is pinned while in use, and unpinned frames are replaced using the CLOCK algorithm,
+ * so blocks which are used often stay in memory while blocks of idle files are given up.
+ * Allocation never fails or waits. If every frame is pinned, the pool goes over its limit
+ * rather than deadlock, and comes back under it as frames are unpinned and replaced.
+ * So the limit holds as long as users pin frames only while using them. Buffered, for one,
+ * lets go of clean blocks between requests, and keeps only dirty blocks and its read-ahead
+ * or write-behind ring pinned.
+ *
+ * Only published frames can be found. A frame which is being filled or modified stays unpublished.
+ * A block read from the file is published only if nobody else published it first, while newly
+ * written data replaces any older version. Someone still using an older version keeps it until
+ * they unpin it, but nobody else will find it.
+ *
+ * A reader notes the block's generation before reading it. If the block was forgotten or replaced
+ * while the read was going on, the read may have seen the data from before the write, so the
+ * frame isn't published. Generations are kept per hash bucket, so now and then a block is left
+ * unpublished because of a write to another block, which costs a read but never returns stale data.
+ */
+#ifndef COMMON_BUFFERPOOL_H
+#define COMMON_BUFFERPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "common/filter.h"
+
+typedef struct BufferPool BufferPool;
+
+/* Identifies a file's blocks: the pipeline which reads them and the file itself. */
+typedef struct PoolFile {
+    const void *pipeline;
+    uint64_t device;
+    uint64_t inode;
+} PoolFile;
+
+typedef struct PoolFrame {
+    Byte *data;                   /* The cached block */
+    size_t actual;                /* Bytes in the block, less than full only at end of file */
+
+    /* Managed by the pool */
+    PoolFile file;
+    size_t blockNr;
+    size_t size;                  /* Bytes allocated for the block */
+    size_t pins;                  /* Number of users, can't be replaced unless zero */
+    bool referenced;              /* Used since the clock hand last passed by? */
+    bool published;               /* Can the block be found in the hash table? */
+    size_t index;                 /* Where the frame is in the pool's list of frames */
+    struct PoolFrame *nextInBucket;
+} PoolFrame;
+
+BufferPool *bufferPoolNew(size_t memoryLimit);
+void bufferPoolFree(BufferPool *pool);
+
+/* Identify a file just opened through a pipeline. If the file can't be identified, its blocks are private to the handle. */
+PoolFile bufferPoolFile(const void *pipeline, const char *path, const void *handle);
+
+/* Find a cached block and pin it, or NULL if it isn't cached. */
+PoolFrame *bufferPoolPin(BufferPool *pool, const PoolFile *file, size_t blockNr);
+void bufferPoolUnpin(BufferPool *pool, PoolFrame *frame);
+
+/* Get a pinned frame to fill, then either publish it so it can be found, or discard it. */
+PoolFrame *bufferPoolAllocate(BufferPool *pool, const PoolFile *file, size_t blockNr, size_t size);
+uint64_t bufferPoolGeneration(BufferPool *pool, const PoolFile *file, size_t blockNr);
+void bufferPoolPublish(BufferPool *pool, PoolFrame *frame, size_t actual, uint64_t generation);
+void bufferPoolReplace(BufferPool *pool, PoolFrame *frame, size_t actual);
+void bufferPoolDiscard(BufferPool *pool, PoolFrame *frame);
+
+/* Reuse an unpublished frame for a different block. */
+void bufferPoolRename(BufferPool *pool, PoolFrame *frame, const PoolFile *file, size_t blockNr);
+
+/* How many bytes of block data the pool is holding, pinned or not. */
+size_t bufferPoolMemoryUsed(BufferPool *pool);
+
+/* Drop cached blocks, either a range of them or all blocks of a file. */
+void bufferPoolForget(BufferPool *pool, const PoolFile *file, size_t firstBlock, size_t lastBlock);
+void bufferPoolForgetFile(BufferPool *pool, const PoolFile *file);
+
+#endif /* COMMON_BUFFERPOOL_H */
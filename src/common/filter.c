@@ -11,6 +11,10 @@
         ? this->next->next##Event \
         : this->next)
 
+/* Statistics are off unless enabled. */
+bool filterStatsEnabled = false;
+__thread uint64_t filterChildNs = 0;
+
 
 void *filterInit(void *thisVoid, FilterInterface *iface, void *next)
 {
@@ -29,6 +33,13 @@ void *filterInit(void *thisVoid, FilterInterface *iface, void *next)
     this->nextSeek = getNext(Seek, this);
     this->nextDelete = getNext(Delete, this);
 
+    /* Vectors go to the same filter as a plain Read or Write, but only if it knows how to handle them. */
+    this->nextReadv = (this->nextRead != NULL && this->nextRead->iface->fnReadv != NULL)? this->nextRead: NULL;
+    this->nextWritev = (this->nextWrite != NULL && this->nextWrite->iface->fnWritev != NULL)? this->nextWrite: NULL;
+    this->nextPread = (this->nextRead != NULL && this->nextRead->iface->fnPread != NULL)? this->nextRead: NULL;
+    this->nextPwrite = (this->nextWrite != NULL && this->nextWrite->iface->fnPwrite != NULL)? this->nextWrite: NULL;
+    this->nextBorrow = (this->nextRead != NULL && this->nextRead->iface->fnBorrow != NULL)? this->nextRead: NULL;
+
     /* Each filter must provide a "Size" routine in its interface. */
     assert(this->iface->fnBlockSize != NULL);
 
@@ -39,6 +39,25 @@
  *
  * When the record size is 1 byte, a seek to FILE_END_POSITION will always point to EOF
  * and return the number of bytes stored in the file.
+ *
+ * The "Readv" and "Writev" events carry a vector of blocks in a single request. Each entry
+ * of the vector holds a multiple of the block size, except the final entry which may be partial.
+ * A filter which doesn't handle the vectored events receives them as a sequence of
+ * "Read" or "Write" events, one per entry.
+ *
+ * The "Pread" and "Pwrite" events read or write at an explicit position, saving the separate "Seek"
+ * event. The position must be a block boundary. A filter which doesn't handle the positional events
+ * receives them as a "Seek" followed by a "Read" or "Write". Either way, the sequential position
+ * is unspecified afterwards, so mixing positional and sequential requests needs an explicit "Seek".
+ *
+ * The "Borrow" and "Return" events let a filter read without copying. Rather than filling
+ * the caller's buffer, "Borrow" lends out a pointer to the filter's own copy of the next data,
+ * and the caller gives it back with "Return" before making any other request.
+ * If the next filter doesn't lend out its buffers, "Borrow" becomes a "Read" into the caller's buffer.
+ *
+ * When statistics are enabled, each event is counted against the filter which handles it,
+ * along with the bytes it transfers and the time spent in that filter. Time spent in later
+ * filters is subtracted out, so each filter's time is its own.
  */
 
 #ifndef COMMON_FILTER_H
@@ -47,8 +66,10 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "iostack_error.h"
+#include "iostack.h"
 
 #define BEGIN do {
 #define END   } while (0)
@@ -77,6 +98,13 @@ typedef struct Filter {
     struct Filter *nextBlockSize;
     struct Filter *nextSeek;
     struct Filter *nextDelete;
+    struct Filter *nextReadv;       /* NULL if the next reader doesn't handle vectors */
+    struct Filter *nextWritev;      /* NULL if the next writer doesn't handle vectors */
+    struct Filter *nextPread;       /* NULL if the next reader doesn't handle positional reads */
+    struct Filter *nextPwrite;      /* NULL if the next writer doesn't handle positional writes */
+    struct Filter *nextBorrow;      /* NULL if the next reader doesn't lend out its buffers */
+
+    FileStats stats;                /* Events handled by this filter, if statistics are enabled */
 } Filter;
 
 /***********************************************************************************************************************************
@@ -92,8 +120,15 @@ typedef size_t (*FilterSize)(void *this, size_t size);
 typedef off_t (*FilterSeek)(void *this, off_t position, Error *error);
 typedef size_t (*FilterBlockSize)(void *this, size_t size, Error *error);
 typedef size_t (*FilterDelete)(void *this, char *path, Error *error);
+typedef size_t (*FilterReadv)(void *this, const struct iovec *iov, size_t iovCnt, Error *error);
+typedef size_t (*FilterWritev)(void *this, const struct iovec *iov, size_t iovCnt, Error *error);
+typedef size_t (*FilterPread)(void *this, Byte *buf, size_t size, off_t offset, Error *error);
+typedef size_t (*FilterPwrite)(void *this, const Byte *buf, size_t size, off_t offset, Error *error);
+typedef size_t (*FilterBorrow)(void *this, Byte **buf, size_t size, Error *error);
+typedef void (*FilterReturn)(void *this, Byte *buf, Error *error);
 
 typedef struct FilterInterface {
+    const char *name;
     FilterOpen fnOpen;
     FilterWrite fnWrite;
     FilterClose fnClose;
@@ -103,11 +138,21 @@ typedef struct FilterInterface {
     FilterBlockSize fnBlockSize;
     FilterSeek fnSeek;
     FilterDelete fnDelete;
+    FilterReadv fnReadv;
+    FilterWritev fnWritev;
+    FilterPread fnPread;
+    FilterPwrite fnPwrite;
+    FilterBorrow fnBorrow;
+    FilterReturn fnReturn;
 } FilterInterface;
 
 /* Initialize the generic parts of a filter */
 void *filterInit(void *thisVoid, FilterInterface *iface, void *next);
 
+/* Statistics are gathered only while enabled. */
+extern bool filterStatsEnabled;
+extern __thread uint64_t filterChildNs;  /* Time spent in later filters by the current event */
+
 /* Some possibly helpful stubs. */
 void badSeek(Filter *this, size_t position, Error *error);
 
@@ -68,6 +68,290 @@ size_t passThroughReadAll(void *thisVoid, Byte *buf, size_t size, Error *error)
 }
 
 
+/**
+ * Send a vector of blocks to the next filter which reads. If it doesn't handle vectors,
+ * read the entries one at a time, stopping at the first one which comes up short.
+ */
+size_t passThroughReadv(void *thisVoid, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    Filter *this = (Filter *)thisVoid;
+    if (this->nextReadv != NULL && !filterStatsEnabled)
+        return this->nextReadv->iface->fnReadv(this->nextReadv, iov, iovCnt, error);
+    else if (this->nextReadv != NULL)
+    {
+        StatsTimer timer; statsBegin(&timer);
+        size_t actual = this->nextReadv->iface->fnReadv(this->nextReadv, iov, iovCnt, error);
+        statsEnd(this->nextReadv, &timer, actual, 0);
+        return actual;
+    }
+
+    size_t totalSize = 0;
+    for (size_t idx = 0; idx < iovCnt && errorIsOK(*error); idx++)
+    {
+        size_t actualSize = passThroughReadAll(this, iov[idx].iov_base, iov[idx].iov_len, error);
+        totalSize += actualSize;
+        if (actualSize < iov[idx].iov_len)
+            break;
+    }
+
+    /* As with a plain read, a partial read followed by EOF is OK. */
+    if (errorIsEOF(*error) && totalSize > 0)
+        *error = errorOK;
+
+    return totalSize;
+}
+
+
+/**
+ * Send a vector of blocks to the next filter which writes. If it doesn't handle vectors,
+ * write the entries one at a time.
+ */
+size_t passThroughWritev(void *thisVoid, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    Filter *this = (Filter *)thisVoid;
+    if (this->nextWritev != NULL && !filterStatsEnabled)
+        return this->nextWritev->iface->fnWritev(this->nextWritev, iov, iovCnt, error);
+    else if (this->nextWritev != NULL)
+    {
+        StatsTimer timer; statsBegin(&timer);
+        size_t actual = this->nextWritev->iface->fnWritev(this->nextWritev, iov, iovCnt, error);
+        statsEnd(this->nextWritev, &timer, 0, actual);
+        return actual;
+    }
+
+    size_t totalSize = 0;
+    for (size_t idx = 0; idx < iovCnt && errorIsOK(*error); idx++)
+        totalSize += passThroughWriteAll(this, iov[idx].iov_base, iov[idx].iov_len, error);
+
+    return totalSize;
+}
+
+
+/**
+ * Read from an explicit position. If the next filter which reads doesn't handle positional reads,
+ * seek there and do a regular read.
+ */
+size_t passThroughPread(void *thisVoid, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    Filter *this = (Filter *)thisVoid;
+    if (this->nextPread != NULL && !filterStatsEnabled)
+        return this->nextPread->iface->fnPread(this->nextPread, buf, size, offset, error);
+    else if (this->nextPread != NULL)
+    {
+        StatsTimer timer; statsBegin(&timer);
+        size_t actual = this->nextPread->iface->fnPread(this->nextPread, buf, size, offset, error);
+        statsEnd(this->nextPread, &timer, actual, 0);
+        return actual;
+    }
+
+    passThroughSeek(this, offset, error);
+    return passThroughRead(this, buf, size, error);
+}
+
+
+/**
+ * Write to an explicit position. If the next filter which writes doesn't handle positional writes,
+ * seek there and do a regular write.
+ */
+size_t passThroughPwrite(void *thisVoid, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    Filter *this = (Filter *)thisVoid;
+    if (this->nextPwrite != NULL && !filterStatsEnabled)
+        return this->nextPwrite->iface->fnPwrite(this->nextPwrite, buf, size, offset, error);
+    else if (this->nextPwrite != NULL)
+    {
+        StatsTimer timer; statsBegin(&timer);
+        size_t actual = this->nextPwrite->iface->fnPwrite(this->nextPwrite, buf, size, offset, error);
+        statsEnd(this->nextPwrite, &timer, 0, actual);
+        return actual;
+    }
+
+    passThroughSeek(this, offset, error);
+    return passThroughWrite(this, buf, size, error);
+}
+
+
+/**
+ * Borrow up to size bytes of the next data from the next filter which reads.
+ * On entry, *buf points to our own buffer, which we read into if the next filter can't lend out its buffers.
+ * On exit, *buf points to the data. If it isn't our own buffer, it must be given back with passThroughReturn.
+ */
+size_t passThroughBorrow(void *thisVoid, Byte **buf, size_t size, Error *error)
+{
+    Filter *this = (Filter *)thisVoid;
+    if (this->nextBorrow != NULL && !filterStatsEnabled)
+        return this->nextBorrow->iface->fnBorrow(this->nextBorrow, buf, size, error);
+    else if (this->nextBorrow != NULL)
+    {
+        StatsTimer timer; statsBegin(&timer);
+        size_t actual = this->nextBorrow->iface->fnBorrow(this->nextBorrow, buf, size, error);
+        statsEnd(this->nextBorrow, &timer, actual, 0);
+        return actual;
+    }
+
+    return passThroughRead(this, *buf, size, error);
+}
+
+
+/**
+ * Give back a buffer we borrowed from the next filter.
+ */
+void passThroughReturn(void *thisVoid, Byte *buf, Error *error)
+{
+    Filter *this = (Filter *)thisVoid;
+    if (this->nextBorrow != NULL)
+        this->nextBorrow->iface->fnReturn(this->nextBorrow, buf, error);
+}
+
+
+/**
+ * Borrow all size bytes (fewer only at EOF). If the lender can't provide them in one piece,
+ * give back what we borrowed and gather the data into our own buffer instead.
+ */
+size_t passThroughBorrowAll(void *this, Byte **buf, size_t size, Error *error)
+{
+    if (size == 0 || isError(*error))
+        return 0;
+
+    /* Try to borrow it all at once. */
+    Byte *ownBuf = *buf;
+    size_t actual = passThroughBorrow(this, buf, size, error);
+    if (isError(*error) || actual == size)
+        return actual;
+
+    /* Otherwise, copy the first piece into our own buffer and read the rest. */
+    if (*buf != ownBuf)
+    {
+        memcpy(ownBuf, *buf, actual);
+        passThroughReturn(this, *buf, error);
+        *buf = ownBuf;
+    }
+    actual += passThroughReadAll(this, ownBuf + actual, size - actual, error);
+
+    /* If we got some data, then hitting EOF is OK. We'll get another eof next read. */
+    if (errorIsEOF(*error) && actual > 0)
+        *error = errorOK;
+
+    return actual;
+}
+
+
+/**
+ * Helper to repeatedly write at a position until all the data is written (or error).
+ */
+size_t passThroughPwriteAll(void *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    size_t totalSize = 0;
+    while (size > 0 && errorIsOK(*error))
+    {
+        size_t actualSize = passThroughPwrite(this, buf, size, offset, error);
+        buf += actualSize;
+        size -= actualSize;
+        offset += actualSize;
+        totalSize += actualSize;
+    }
+
+    return totalSize;
+}
+
+
+/**
+ * Helper to repeatedly read at a position until all the data is read, eof, or error.
+ */
+size_t passThroughPreadAll(void *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    size_t totalSize = 0;
+    while (size > 0 && errorIsOK(*error))
+    {
+        size_t actualSize = passThroughPread(this, buf, size, offset, error);
+        buf += actualSize;
+        size -= actualSize;
+        offset += actualSize;
+        totalSize += actualSize;
+    }
+
+    /* If last read had eof, but we were able to read some data, then all is OK. We'll get another eof next read. */
+    if (errorIsEOF(*error) && totalSize > 0)
+        *error = errorOK;
+
+    return totalSize;
+}
+
+
+/*
+ * Helper to find the vector entry containing a byte offset.
+ * Returns the entry index and sets *offset to the position within that entry.
+ */
+static size_t iovSkip(const struct iovec *iov, size_t iovCnt, size_t *offset)
+{
+    size_t idx;
+    for (idx = 0; idx < iovCnt && *offset >= iov[idx].iov_len; idx++)
+        *offset -= iov[idx].iov_len;
+    return idx;
+}
+
+
+/**
+ * Helper to repeatedly write a vector until all the data is written (or error).
+ * After a short write, we finish the interrupted entry on its own, then continue with the rest of the vector.
+ */
+size_t passThroughWritevAll(void *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    size_t totalSize = 0;
+    while (iovCnt > 0 && errorIsOK(*error))
+    {
+        /* Write as much of the vector as we can. */
+        size_t offset = passThroughWritev(this, iov, iovCnt, error);
+        totalSize += offset;
+
+        /* Skip over the entries we've completed */
+        size_t idx = iovSkip(iov, iovCnt, &offset);
+        iov += idx; iovCnt -= idx;
+
+        /* Finish the partial entry, if any. */
+        if (offset > 0 && iovCnt > 0)
+        {
+            totalSize += passThroughWriteAll(this, (Byte *)iov->iov_base + offset, iov->iov_len - offset, error);
+            iov++; iovCnt--;
+        }
+    }
+
+    return totalSize;
+}
+
+
+/**
+ * Helper to repeatedly read a vector until all the data is read, eof, or error.
+ */
+size_t passThroughReadvAll(void *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    size_t totalSize = 0;
+    while (iovCnt > 0 && errorIsOK(*error))
+    {
+        /* Read as much of the vector as we can. */
+        size_t offset = passThroughReadv(this, iov, iovCnt, error);
+        totalSize += offset;
+
+        /* Skip over the entries we've filled */
+        size_t idx = iovSkip(iov, iovCnt, &offset);
+        iov += idx; iovCnt -= idx;
+
+        /* Fill in the partial entry, if any. */
+        if (offset > 0 && iovCnt > 0)
+        {
+            totalSize += passThroughReadAll(this, (Byte *)iov->iov_base + offset, iov->iov_len - offset, error);
+            iov++; iovCnt--;
+        }
+    }
+
+    /* If last read had eof, but we were able to read some data, then all is OK. We'll get another eof next read. */
+    if (errorIsEOF(*error) && totalSize > 0)
+        *error = errorOK;
+
+    return totalSize;
+}
+
+
 /*
  * Read a variable size block.
  */
@@ -87,6 +371,22 @@ size_t passThroughReadSized(void *this, Byte *block, size_t size, Error *error)
     return actual;
 }
 
+/*
+ * Borrow a variable size block, falling back to reading it into our own buffer.
+ */
+size_t passThroughBorrowSized(void *this, Byte **block, size_t size, Error *error)
+{
+    /* Read the block length */
+    size_t blockSize = passThroughGet4(this, error);
+    if (isError(*error))
+        return 0;
+    if (blockSize > size)
+        return ioStackError(error, "BorrowSized: Block length is too large");
+
+    /* Borrow the rest of the block */
+    return passThroughBorrowAll(this, block, blockSize, error);
+}
+
 size_t passThroughWriteSized(void *this, Byte *block, size_t size, Error *error)
 {
     if (isError(*error))
@@ -111,4 +411,4 @@ size_t dummyBlockSize(Filter *this, size_t size, Error *error)
 /*
  * Defines a "no-op" filter, mainly to use as a placeholder.
  */
-FilterInterface passThroughInterface = (FilterInterface) {.fnBlockSize = (FilterBlockSize)dummyBlockSize};
+FilterInterface passThroughInterface = (FilterInterface) {.name = "PassThrough", .fnBlockSize = (FilterBlockSize)dummyBlockSize};
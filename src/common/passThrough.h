@@ -10,25 +10,44 @@
  */
 #ifndef COMMON_PASSTHROUGH_H
 #define COMMON_PASSTHROUGH_H
+#include <time.h>
 #include "common/filter.h"
 #include "iostack.h"
 
 extern FilterInterface passThroughInterface;
 #define passThrough(Event, this, ...)   ((Filter*)this)->next##Event->iface->fn##Event(((Filter*)this)->next##Event, __VA_ARGS__)
 #define passThroughOpen(this, path, oflags, mode, error) passThrough(Open, this, path, oflags, mode, error)
-#define passThroughRead(this, buf, size, error) passThrough(Read, this, buf, size, error)
-#define passThroughWrite(this, buf, size, error) passThrough(Write, this, buf, size, error)
+#define passThroughRead(this, buf, size, error) statsRead((Filter *)(this), buf, size, error)
+#define passThroughWrite(this, buf, size, error) statsWrite((Filter *)(this), buf, size, error)
 #define passThroughClose(this, error) passThrough(Close, this, error)
 #define passThroughAbort(this, error)  passThrough(Abort, this, error)
-#define passThroughSync(this, error) passThrough(Sync, this, error)
-#define passThroughSeek(this, position, error) passThrough(Seek, this, position, error)
+#define passThroughSync(this, error) statsSync((Filter *)(this), error)
+#define passThroughSeek(this, position, error) statsSeek((Filter *)(this), position, error)
 #define passThroughBlockSize(this, size, error) passThrough(BlockSize, this, size, error)
 #define passThroughDelete(this, path, error) passThrough(Delete, this, path, error)
 
 
+/* Vectored events fall back to one Read or Write per entry if the next filter doesn't handle them. */
+size_t passThroughReadv(void *this, const struct iovec *iov, size_t iovCnt, Error *error);
+size_t passThroughWritev(void *this, const struct iovec *iov, size_t iovCnt, Error *error);
+
+/* Positional events fall back to a Seek followed by a Read or Write if the next filter doesn't handle them. */
+size_t passThroughPread(void *this, Byte *buf, size_t size, off_t offset, Error *error);
+size_t passThroughPwrite(void *this, const Byte *buf, size_t size, off_t offset, Error *error);
+
+/* Borrowing falls back to reading into our own buffer if the next filter doesn't lend out its buffers. */
+size_t passThroughBorrow(void *this, Byte **buf, size_t size, Error *error);
+void passThroughReturn(void *this, Byte *buf, Error *error);
+size_t passThroughBorrowAll(void *this, Byte **buf, size_t size, Error *error);
+size_t passThroughBorrowSized(void *this, Byte **block, size_t size, Error *error);
+
 /* Helper function to ensure all the data is written. */
 size_t passThroughWriteAll(void *this, const Byte *buf, size_t size, Error *error);
 size_t passThroughReadAll(void *this, Byte *buf, size_t size, Error *error);
+size_t passThroughWritevAll(void *this, const struct iovec *iov, size_t iovCnt, Error *error);
+size_t passThroughReadvAll(void *this, const struct iovec *iov, size_t iovCnt, Error *error);
+size_t passThroughPwriteAll(void *this, const Byte *buf, size_t size, off_t offset, Error *error);
+size_t passThroughPreadAll(void *this, Byte *buf, size_t size, off_t offset, Error *error);
 size_t passThroughReadSized(void *this, Byte *header, size_t size, Error *error);
 size_t passThroughWriteSized(void *this, Byte *header, size_t size, Error *error);
 
@@ -42,4 +61,85 @@ size_t passThroughWriteSized(void *this, Byte *header, size_t size, Error *error
 #define passThroughGet4(this, error)         fileGet4(this, error)
 #define passthroughGet8(this, error)         fileGet8(this, errorO)
 
+
+/*
+ * Statistics. The frequent events go through these wrappers, which time the event and
+ * charge it to the filter which handles it. When statistics are off, they just dispatch the event.
+ */
+typedef struct StatsTimer {uint64_t start; uint64_t savedChildNs;} StatsTimer;
+
+static inline uint64_t statsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Start timing an event. Later filters will add their time to filterChildNs. */
+static inline void statsBegin(StatsTimer *timer)
+{
+    timer->savedChildNs = filterChildNs;
+    filterChildNs = 0;
+    timer->start = statsNow();
+}
+
+/* Charge the event to the filter, less the time spent in later filters, and pass the total time up. */
+static inline void statsEnd(Filter *filter, StatsTimer *timer, size_t bytesRead, size_t bytesWritten)
+{
+    uint64_t elapsed = statsNow() - timer->start;
+    filter->stats.calls++;
+    filter->stats.bytesRead += bytesRead;
+    filter->stats.bytesWritten += bytesWritten;
+    filter->stats.nanoseconds += elapsed - sizeMin(elapsed, filterChildNs);
+    filterChildNs = timer->savedChildNs + elapsed;
+}
+
+static inline size_t statsRead(Filter *this, Byte *buf, size_t size, Error *error)
+{
+    Filter *next = this->nextRead;
+    if (!filterStatsEnabled)
+        return next->iface->fnRead(next, buf, size, error);
+
+    StatsTimer timer; statsBegin(&timer);
+    size_t actual = next->iface->fnRead(next, buf, size, error);
+    statsEnd(next, &timer, actual, 0);
+    return actual;
+}
+
+static inline size_t statsWrite(Filter *this, const Byte *buf, size_t size, Error *error)
+{
+    Filter *next = this->nextWrite;
+    if (!filterStatsEnabled)
+        return next->iface->fnWrite(next, buf, size, error);
+
+    StatsTimer timer; statsBegin(&timer);
+    size_t actual = next->iface->fnWrite(next, buf, size, error);
+    statsEnd(next, &timer, 0, actual);
+    return actual;
+}
+
+static inline off_t statsSeek(Filter *this, off_t position, Error *error)
+{
+    Filter *next = this->nextSeek;
+    if (!filterStatsEnabled)
+        return next->iface->fnSeek(next, position, error);
+
+    StatsTimer timer; statsBegin(&timer);
+    off_t actual = next->iface->fnSeek(next, position, error);
+    statsEnd(next, &timer, 0, 0);
+    next->stats.seeks++;
+    return actual;
+}
+
+static inline void statsSync(Filter *this, Error *error)
+{
+    Filter *next = this->nextSync;
+    if (!filterStatsEnabled)
+        return next->iface->fnSync(next, error);
+
+    StatsTimer timer; statsBegin(&timer);
+    next->iface->fnSync(next, error);
+    statsEnd(next, &timer, 0, 0);
+}
+
 #endif /* COMMON_PASSTHROUGH_H */
@@ -4,6 +4,8 @@
 //#define DEBUG
 #include <unistd.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "common/syscall.h"
 #include "common/debug.h"
 
@@ -56,6 +58,103 @@ size_t sys_write(int fd, const Byte *buf, size_t size, Error *error)
 }
 
 
+/* Never pass more vector entries than the system accepts in one call. */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * Read a vector of buffers from a file.
+ * @param error - if set on entry, return immediately. On exit, contains OK, EOF or error.
+ */
+size_t sys_readv(int fd, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    ssize_t retVal = readv(fd, iov, (int)sizeMin(iovCnt, IOV_MAX));
+
+    if (retVal == 0)
+        *error = errorEOF;
+
+    else if (retVal == -1)
+    {
+        *error = systemError();
+        retVal = 0;
+    }
+
+    debug("sys_readv: fd=%d iovCnt=%zu actual=%zd  msg=%s\n", fd, iovCnt, retVal, error->msg);
+    return (size_t) retVal;
+}
+
+
+/**
+ * Write a vector of buffers to a file.
+ * @param error - if set on entry, return immediately. On exit, contains OK, EOF or error.
+ */
+size_t sys_writev(int fd, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    ssize_t retVal = writev(fd, iov, (int)sizeMin(iovCnt, IOV_MAX));
+    if (retVal == -1)
+    {
+        *error = systemError();
+        retVal = 0;
+    }
+
+    debug("sys_writev: fd=%d iovCnt=%zu actual=%zd  msg=%s\n", fd, iovCnt, retVal, error->msg);
+    return (size_t) retVal;
+}
+
+
+/**
+ * Read data from an absolute file position, leaving the file offset unchanged.
+ * @param error - if set on entry, return immediately. On exit, contains OK, EOF or error.
+ */
+size_t sys_pread(int fd, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    ssize_t retVal = pread(fd, buf, size, offset);
+
+    if (retVal == 0)
+        *error = errorEOF;
+
+    else if (retVal == -1)
+    {
+        *error = systemError();
+        retVal = 0;
+    }
+
+    debug("sys_pread: fd=%d size=%zu offset=%lld actual=%zd  msg=%s\n", fd, size, offset, retVal, error->msg);
+    return (size_t) retVal;
+}
+
+
+/**
+ * Write data to an absolute file position, leaving the file offset unchanged.
+ * @param error - if set on entry, return immediately. On exit, contains OK, EOF or error.
+ */
+size_t sys_pwrite(int fd, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    ssize_t retVal = pwrite(fd, buf, size, offset);
+    if (retVal == -1)
+    {
+        *error = systemError();
+        retVal = 0;
+    }
+
+    debug("sys_pwrite: fd=%d size=%zu offset=%lld msg=%s\n", fd, size, offset, error->msg);
+    return (size_t) retVal;
+}
+
+
 /**
  * Open a file, respecting error handling conventions.
  *  @param error - if set on entry, return immediately. On exit, contains OK, EOF or error.
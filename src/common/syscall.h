@@ -11,6 +11,10 @@
 int sys_open(const char *path, int oflag, int perm, Error *error);
 size_t sys_read(int fd, Byte *buf, size_t size, Error *error);
 size_t sys_write(int fd, const Byte *buf, size_t size, Error *error);
+size_t sys_readv(int fd, const struct iovec *iov, size_t iovCnt, Error *error);
+size_t sys_writev(int fd, const struct iovec *iov, size_t iovCnt, Error *error);
+size_t sys_pread(int fd, Byte *buf, size_t size, off_t offset, Error *error);
+size_t sys_pwrite(int fd, const Byte *buf, size_t size, off_t offset, Error *error);
 void sys_close(int fd, Error *error);
 void sys_datasync(int fd, Error *error);
 off_t sys_lseek(int fd, off_t position, Error *error);
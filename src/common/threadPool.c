@@ -0,0 +1,132 @@
+/**
+ * A pool of worker threads, using pthreads.
+ * If no threads could be started, tasks are executed synchronously when submitted.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include "common/threadPool.h"
+
+struct ThreadPool {
+    pthread_mutex_t lock;         /* Protects everything below */
+    pthread_cond_t workReady;     /* Signalled when a task is queued or we are shutting down */
+    pthread_cond_t workDone;      /* Broadcast when a task completes */
+    Task *head;                   /* Oldest task waiting to execute */
+    Task *tail;                   /* Newest task waiting to execute */
+    bool shutdown;                /* Exit once the queue is empty */
+    size_t nrThreads;             /* Number of threads actually started */
+    pthread_t threads[];          /* The worker threads */
+};
+
+/*
+ * Worker thread. Execute tasks until shutdown.
+ */
+static void *threadPoolWorker(void *arg)
+{
+    ThreadPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        /* Wait for a task or a shutdown request. */
+        while (pool->head == NULL && !pool->shutdown)
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        if (pool->head == NULL)
+            break;
+
+        /* Remove the oldest task from the queue. */
+        Task *task = pool->head;
+        pool->head = task->nextTask;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+
+        /* Execute the task without holding the lock. */
+        pthread_mutex_unlock(&pool->lock);
+        task->fn(task->arg);
+        pthread_mutex_lock(&pool->lock);
+
+        /* Let everybody know the task is done. */
+        task->done = true;
+        pthread_cond_broadcast(&pool->workDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/**
+ * Create a pool of worker threads.
+ */
+ThreadPool *threadPoolNew(size_t nrThreads)
+{
+    ThreadPool *pool = malloc(sizeof(ThreadPool) + nrThreads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workReady, NULL);
+    pthread_cond_init(&pool->workDone, NULL);
+    pool->head = pool->tail = NULL;
+    pool->shutdown = false;
+
+    /* Start the threads. If we can't start them all, make do with what we have. */
+    for (pool->nrThreads = 0; pool->nrThreads < nrThreads; pool->nrThreads++)
+        if (pthread_create(&pool->threads[pool->nrThreads], NULL, threadPoolWorker, pool) != 0)
+            break;
+
+    return pool;
+}
+
+
+/**
+ * Queue a task for execution by the next available thread.
+ */
+void threadPoolSubmit(ThreadPool *pool, Task *task, TaskFn fn, void *arg)
+{
+    *task = (Task){.fn = fn, .arg = arg, .done = false, .nextTask = NULL};
+
+    /* No threads? Then do the work now. */
+    if (pool->nrThreads == 0)
+    {
+        fn(arg);
+        task->done = true;
+        return;
+    }
+
+    /* Add the task to the end of the queue and wake up a worker. */
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail == NULL)
+        pool->head = task;
+    else
+        pool->tail->nextTask = task;
+    pool->tail = task;
+    pthread_cond_signal(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Wait for a previously submitted task to complete.
+ */
+void threadPoolWait(ThreadPool *pool, Task *task)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!task->done)
+        pthread_cond_wait(&pool->workDone, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Finish any queued tasks, then stop the threads and release the pool.
+ */
+void threadPoolFree(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t idx = 0; idx < pool->nrThreads; idx++)
+        pthread_join(pool->threads[idx], NULL);
+
+    pthread_cond_destroy(&pool->workDone);
+    pthread_cond_destroy(&pool->workReady);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
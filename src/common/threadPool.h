@@ -0,0 +1,30 @@
+/**
+ * A small pool of worker threads which execute tasks in the order they are submitted.
+ * With a single thread, tasks also complete in the order they were submitted.
+ *
+ * Tasks are owned by the caller, typically embedded in some larger structure,
+ * so submitting a task does not allocate memory.
+ */
+#ifndef COMMON_THREADPOOL_H
+#define COMMON_THREADPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef void (*TaskFn)(void *arg);
+
+typedef struct Task {
+    TaskFn fn;                /* Function to execute */
+    void *arg;                /* Argument passed to the function */
+    bool done;                /* Has the task completed? */
+    struct Task *nextTask;    /* Next task in the pool's queue */
+} Task;
+
+typedef struct ThreadPool ThreadPool;
+
+ThreadPool *threadPoolNew(size_t nrThreads);
+void threadPoolSubmit(ThreadPool *pool, Task *task, TaskFn fn, void *arg);
+void threadPoolWait(ThreadPool *pool, Task *task);
+void threadPoolFree(ThreadPool *pool);
+
+#endif /* COMMON_THREADPOOL_H */
@@ -0,0 +1,191 @@
+/**
+ * The paged index shared by the compression filters. See blockIndex.h.
+ */
+#include <stdlib.h>
+#include "compress/blockIndex.h"
+#include "iostack_error.h"
+#include "common/passThrough.h"
+#include "common/packed.h"
+#include "iostack.h"
+
+
+/**
+ * Start out with an index kept in a separate index file, getting the file size which follows the entries.
+ * Unless the index is huge, load it now. If the file was truncated or is new, the index starts out empty.
+ */
+void blockIndexOpen(BlockIndex *index, IoStack *file, bool truncated, Error *error)
+{
+    *index = (BlockIndex){.file = file};
+    if (truncated)
+        return;
+
+    off_t indexSize = fileSeek(file, FILE_END_POSITION, error);
+    if (indexSize == 0 || isError(*error))
+        return;
+    if (indexSize % sizeof(off_t) != 0)
+    {
+        ioStackError(error, "compressed index file is corrupt");
+        return;
+    }
+
+    /* The last word is the uncompressed file size. */
+    Byte buf[sizeof(off_t)], *bp = buf;
+    index->savedEntries = indexSize / sizeof(off_t) - 1;
+    index->nrEntries = index->savedEntries;
+    fileReadAt(file, buf, sizeof(buf), index->savedEntries * sizeof(off_t), error);
+    index->savedSize = unpack8(&bp, buf + sizeof(buf));
+
+    if (index->nrEntries <= INDEX_LOAD_ENTRIES)
+        blockIndexLoad(index, error);
+}
+
+
+/**
+ * Start out with an index embedded in the data file, starting at the given position.
+ * Our caller has already found out how many entries it has.
+ */
+void blockIndexOpenEmbedded(BlockIndex *index, void *filter, off_t position, size_t nrEntries)
+{
+    *index = (BlockIndex){.filter = filter, .embeddedPosition = position, .nrEntries = nrEntries, .savedEntries = nrEntries};
+}
+
+
+/**
+ * Release the in-memory index. The index file, if any, belongs to our caller.
+ */
+void blockIndexFree(BlockIndex *index)
+{
+    for (size_t idx = 0; idx < index->nrPages; idx++)
+        free(index->pages[idx]);
+    free(index->pages);
+    index->pages = NULL;
+    index->nrPages = 0;
+}
+
+
+/*
+ * Get the page of the index holding an entry, loading it from the file if it isn't in memory.
+ */
+static IndexPage *indexPage(BlockIndex *index, size_t entryNr, Error *error)
+{
+    if (isError(*error))
+        return NULL;
+
+    /* Make room for the page in the directory. */
+    size_t pageNr = entryNr / INDEX_PAGE_ENTRIES;
+    if (pageNr >= index->nrPages)
+    {
+        size_t nrPages = sizeMax(pageNr + 1, 2 * index->nrPages);
+        index->pages = realloc(index->pages, nrPages * sizeof(IndexPage *));
+        memset(index->pages + index->nrPages, 0, (nrPages - index->nrPages) * sizeof(IndexPage *));
+        index->nrPages = nrPages;
+    }
+
+    /* If the page isn't in memory, create it, filling in whatever part of it is in the file. */
+    IndexPage *page = index->pages[pageNr];
+    if (page == NULL)
+    {
+        page = calloc(1, sizeof(IndexPage));
+        index->pages[pageNr] = page;
+
+        size_t firstEntry = pageNr * INDEX_PAGE_ENTRIES;
+        if (firstEntry < index->savedEntries)
+        {
+            Byte buf[INDEX_PAGE_ENTRIES * sizeof(off_t)];
+            size_t nrEntries = sizeMin(INDEX_PAGE_ENTRIES, index->savedEntries - firstEntry);
+            if (index->file == NULL)
+                passThroughPreadAll(index->filter, buf, nrEntries * sizeof(off_t), index->embeddedPosition + firstEntry * sizeof(off_t), error);
+            else
+                fileReadAt(index->file, buf, nrEntries * sizeof(off_t), firstEntry * sizeof(off_t), error);
+
+            Byte *bp = buf;
+            for (size_t idx = 0; idx < nrEntries; idx++)
+                page->entries[idx] = unpack8(&bp, buf + sizeof(buf));
+        }
+    }
+
+    return page;
+}
+
+
+/**
+ * Look up where a block starts in the compressed file.
+ */
+off_t blockIndexGet(BlockIndex *index, size_t entryNr, Error *error)
+{
+    IndexPage *page = indexPage(index, entryNr, error);
+    if (isError(*error))
+        return 0;
+    return page->entries[entryNr % INDEX_PAGE_ENTRIES];
+}
+
+
+/**
+ * Record where a block starts in the compressed file.
+ */
+void blockIndexSet(BlockIndex *index, size_t entryNr, off_t offset, Error *error)
+{
+    IndexPage *page = indexPage(index, entryNr, error);
+    if (isError(*error))
+        return;
+
+    off_t *entry = &page->entries[entryNr % INDEX_PAGE_ENTRIES];
+    if (entryNr < index->nrEntries && *entry == offset)
+        return;
+
+    *entry = offset;
+    page->dirty = true;
+    index->nrEntries = sizeMax(index->nrEntries, entryNr + 1);
+}
+
+
+/**
+ * Bring every page of the index into memory.
+ */
+void blockIndexLoad(BlockIndex *index, Error *error)
+{
+    for (size_t entryNr = 0; entryNr < index->nrEntries; entryNr += INDEX_PAGE_ENTRIES)
+        indexPage(index, entryNr, error);
+}
+
+
+/**
+ * Write the changed pages of the index back to the index file, followed by the file size.
+ */
+void blockIndexSave(BlockIndex *index, off_t fileSize, Error *error)
+{
+    bool changed = fileSize != index->savedSize;
+    for (size_t pageNr = 0; pageNr < index->nrPages && !isError(*error); pageNr++)
+    {
+        IndexPage *page = index->pages[pageNr];
+        if (page == NULL || !page->dirty)
+            continue;
+        changed = true;
+
+        /* Pack the entries of the page which are part of the index. */
+        Byte buf[INDEX_PAGE_ENTRIES * sizeof(off_t)];
+        size_t firstEntry = pageNr * INDEX_PAGE_ENTRIES;
+        size_t nrEntries = sizeMin(INDEX_PAGE_ENTRIES, index->nrEntries - firstEntry);
+        Byte *bp = buf;
+        for (size_t idx = 0; idx < nrEntries; idx++)
+            pack8(&bp, buf + sizeof(buf), page->entries[idx]);
+
+        fileWriteAt(index->file, buf, bp - buf, firstEntry * sizeof(off_t), error);
+        page->dirty = false;
+    }
+
+    /* The file size goes after the last entry, where a growing index overwrites it. */
+    if (changed && !isError(*error))
+    {
+        Byte buf[sizeof(off_t)], *bp = buf;
+        pack8(&bp, buf + sizeof(buf), fileSize);
+        fileWriteAt(index->file, buf, sizeof(buf), index->nrEntries * sizeof(off_t), error);
+    }
+
+    /* Entries we saved can now be loaded from the file. */
+    if (!isError(*error))
+    {
+        index->savedEntries = sizeMax(index->savedEntries, index->nrEntries);
+        index->savedSize = fileSize;
+    }
+}
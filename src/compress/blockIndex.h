@@ -0,0 +1,56 @@
+/**
+ * The index of a compressed file, where entry N holds the offset of block N within the compressed data.
+ * Compressed blocks vary in size, so the index is what lets the compression filters seek to a block boundary.
+ *
+ * The index is kept in memory as pages. A modest index is loaded when the file is opened, so seeks
+ * never wait for it, while a huge one is loaded a page at a time as pages are first touched.
+ * The index either lives in a separate index file, where changed pages are written back in place,
+ * or it is embedded in the data file, where the filter owning it decides how to write it out.
+ *
+ * A separate index file ends with the uncompressed size of the file, following the last entry,
+ * so finding the end of the file doesn't mean decompressing the final block.
+ */
+#ifndef COMPRESS_BLOCKINDEX_H
+#define COMPRESS_BLOCKINDEX_H
+
+#include "common/filter.h"
+
+#define INDEX_PAGE_ENTRIES 1024
+#define INDEX_LOAD_ENTRIES (64 * INDEX_PAGE_ENTRIES)   /* Larger indexes are loaded lazily */
+
+/* A page of the in-memory index. */
+typedef struct IndexPage
+{
+    off_t entries[INDEX_PAGE_ENTRIES];
+    bool dirty;                       /* Has the page changed since being loaded? */
+} IndexPage;
+
+typedef struct BlockIndex
+{
+    IoStack *file;                    /* Separate index file, or NULL if the index is embedded in the data file */
+    void *filter;                     /* With an embedded index, the filter whose next filter holds it */
+    off_t embeddedPosition;           /* With an embedded index, where it starts in the data file */
+
+    IndexPage **pages;                /* In-memory copy of the index, with pages loaded on demand */
+    size_t nrPages;                   /* Number of page slots, loaded or not */
+    size_t nrEntries;                 /* Number of entries in the index */
+    size_t savedEntries;              /* Number of entries which can be loaded from the file */
+    off_t savedSize;                  /* Uncompressed file size saved in the index file */
+} BlockIndex;
+
+/* Start out with an index kept in a separate file, or one embedded in the data file. */
+void blockIndexOpen(BlockIndex *index, IoStack *file, bool truncated, Error *error);
+void blockIndexOpenEmbedded(BlockIndex *index, void *filter, off_t position, size_t nrEntries);
+void blockIndexFree(BlockIndex *index);
+
+/* Look up or record where a block starts. */
+off_t blockIndexGet(BlockIndex *index, size_t entryNr, Error *error);
+void blockIndexSet(BlockIndex *index, size_t entryNr, off_t offset, Error *error);
+
+/* Bring the whole index into memory, eg. before overwriting where it is stored. */
+void blockIndexLoad(BlockIndex *index, Error *error);
+
+/* Write the changed pages back to a separate index file, along with the uncompressed file size. */
+void blockIndexSave(BlockIndex *index, off_t fileSize, Error *error);
+
+#endif /* COMPRESS_BLOCKINDEX_H */
@@ -0,0 +1,48 @@
+/**
+ * The table of compression codecs, along with the "none" codec which stores blocks as they are.
+ * "none" is useful as a baseline when benchmarking the other codecs.
+ */
+#include <string.h>
+#include "compress/codec.h"
+#include "iostack_error.h"
+
+static CodecInterface *codecs[] = {&noneCodec, &lz4Codec, &zstdCodec};
+
+
+/**
+ * Find a codec by name.
+ */
+CodecInterface *codecLookup(const char *name)
+{
+    for (size_t idx = 0; idx < sizeof(codecs) / sizeof(codecs[0]); idx++)
+        if (strcmp(codecs[idx]->name, name) == 0)
+            return codecs[idx];
+
+    return NULL;
+}
+
+
+static size_t noneBound(size_t plainSize)
+{
+    return plainSize;
+}
+
+
+static size_t noneCopy(void *state, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error)
+{
+    if (isError(*error))
+        return 0;
+    if (fromSize > toSize)
+        return ioStackError(error, "none codec - block doesn't fit in the buffer");
+
+    memcpy(toBuf, fromBuf, fromSize);
+    return fromSize;
+}
+
+
+CodecInterface noneCodec = (CodecInterface) {
+    .name = "none",
+    .fnBound = noneBound,
+    .fnCompress = noneCopy,
+    .fnDecompress = noneCopy,
+};
@@ -0,0 +1,39 @@
+/**
+ * A compression codec compresses and decompresses single blocks for the generic compressed file filter.
+ * The filter takes care of records, the index and seeking, so a codec only deals with buffers.
+ *
+ * Each open file gets its own codec state, so a codec can keep contexts from one block to the next.
+ * A codec may also take options, such as a compression level, which the filter hands over when
+ * creating the state. Options are codec specific, and NULL means the codec's defaults.
+ * Codecs are found by name, and the name is recorded in the compressed file's header.
+ * New codecs are added to the table in codec.c.
+ */
+#ifndef COMPRESS_CODEC_H
+#define COMPRESS_CODEC_H
+
+#include "common/filter.h"
+
+typedef void *(*CodecNew)(const void *options, Error *error);
+typedef void (*CodecFree)(void *state);
+typedef size_t (*CodecBound)(size_t plainSize);
+typedef size_t (*CodecCompress)(void *state, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error);
+typedef size_t (*CodecDecompress)(void *state, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error);
+
+typedef struct CodecInterface {
+    const char *name;               /* Name recorded in the file header */
+    CodecNew fnNew;                 /* Create per-file state. Optional. */
+    size_t optionsSize;             /* Size of the codec's options, zero if it has none */
+    CodecFree fnFree;
+    CodecBound fnBound;             /* Largest compressed size for a block of plainSize bytes */
+    CodecCompress fnCompress;
+    CodecDecompress fnDecompress;
+} CodecInterface;
+
+extern CodecInterface noneCodec;
+extern CodecInterface lz4Codec;
+extern CodecInterface zstdCodec;
+
+/* Find a codec by name, or NULL if there is no such codec. */
+CodecInterface *codecLookup(const char *name);
+
+#endif /* COMPRESS_CODEC_H */
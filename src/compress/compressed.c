@@ -0,0 +1,388 @@
+/**
+ * A filter which compresses blocks with a pluggable codec. The filter owns the file layout,
+ * while the codec (see codec.h) only compresses and decompresses individual blocks.
+ *
+ * The compressed file starts with a size-prefixed header naming the codec and the block size,
+ * so readers pick up the codec from the file rather than from how the filter was configured.
+ * Each block follows as a size-prefixed record, and a separate ".idx" file holds the offset
+ * of each block so we can seek to block boundaries.
+ */
+//#define DEBUG
+#include <stdlib.h>
+#include <fcntl.h>
+#include "common/debug.h"
+#include "common/filter.h"
+#include "compress/compressed.h"
+#include "compress/codec.h"
+#include "iostack_error.h"
+#include "common/passThrough.h"
+#include "iostack.h"
+#include "common/packed.h"
+#include "compress/blockIndex.h"
+
+#define MAX_CODEC_NAME 64
+#define MAX_COMPRESSED_HEADER_SIZE 256
+
+/* Structure holding the state of our compression/decompression filter. */
+struct CompressedFilter
+{
+    Filter filter;
+
+    /* Configuration. When reading an existing file, these come from the file header. */
+    char codecName[MAX_CODEC_NAME];   /* Name of the codec, if compressing a new file */
+    size_t blockSize;                 /* Size of uncompressed block */
+    CodecInterface *optionsCodec;     /* The codec our options are meant for, if any */
+    void *codecOptions;               /* Our own copy of the codec's options, or NULL for its defaults */
+
+    CodecInterface *codec;            /* The codec which compresses the blocks */
+    void *codecState;                 /* The codec's own state for this file */
+
+    size_t compressedSize;            /* upper limit on compressed block size */
+    Byte *compressedBuf;              /* Buffer to hold compressed data */
+    size_t headerSize;                /* Size of the file header, which is where the first record starts */
+    bool writable;
+
+    IoStack *indexFile;               /* Index file holding the compressed offset of each block */
+    off_t compressedPosition;         /* The offset of the current compressed block within the compressed file */
+    size_t recordNr;                  /* Block number of the current compressed block */
+
+    BlockIndex index;                 /* Where each block starts in the compressed file */
+    off_t fileSize;                   /* Uncompressed size of the file */
+    bool truncated;                   /* Was the file truncated when opened, so it starts out empty? */
+};
+
+static void compressedConfigure(CompressedFilter *this, Error *error);
+static void compressedHeaderRead(CompressedFilter *this, Error *error);
+static void compressedHeaderWrite(CompressedFilter *this, Error *error);
+
+
+CompressedFilter *compressedFilterOpen(CompressedFilter *pipe, const char *path, int oflags, int mode, Error *error)
+{
+    debug("compressedOpen: path=%s  oflags=0x%x\n", path, oflags);
+
+    /* We need to read the header, even if otherwise write only */
+    if ((oflags & O_ACCMODE) == O_WRONLY)
+        oflags = (oflags & ~O_ACCMODE) | O_RDWR;
+
+    /* Open the compressed file and clone ourselves */
+    Filter *next = passThroughOpen(pipe, path, oflags, mode, error);
+    CompressedFilter *this = compressedFilterOptionsNew(pipe->codecName, pipe->blockSize, pipe->codecOptions, next);
+    if (isError(*error))
+        return this;
+
+    /* Open the index file as well. */
+    char indexPath[MAXPGPATH];
+    strlcpy(indexPath, path, sizeof(indexPath));
+    strlcat(indexPath, ".idx", sizeof(indexPath));
+    this->indexFile = ioStackNew(passThroughOpen(this, indexPath, oflags, mode, error));
+
+    this->truncated = (oflags & O_TRUNC) != 0;
+    this->writable = (oflags & O_ACCMODE) != O_RDONLY;
+
+    return this;
+}
+
+
+size_t compressedFilterBlockSize(CompressedFilter *this, size_t prevSize, Error *error)
+{
+    /* Starting with the index file, we send 8 byte blocks */
+    size_t indexSize = passThroughBlockSize(this->indexFile, sizeof(off_t), error);
+    if (sizeof(off_t) % indexSize != 0)
+        return ioStackError(error, "compressed index file has incompatible block size");
+
+    /* Open the index, which also tells us how big the file is. */
+    blockIndexOpen(&this->index, this->indexFile, this->truncated, error);
+    this->fileSize = this->index.savedSize;
+
+    /* For our data file, we send variable sized blocks to the next stage, so treat as byte stream. */
+    size_t nextSize = passThroughBlockSize(this, 1, error);
+    if (nextSize != 1)
+        return ioStackError(error, "Compression has mismatched block size");
+
+    /* Once our successor is initialized, we can read/write the file header, which tells us the codec. */
+    compressedConfigure(this, error);
+    if (isError(*error))
+        return 0;
+
+    /* Allocate a buffer to hold a compressed block */
+    this->compressedSize = this->codec->fnBound(this->blockSize);
+    this->compressedBuf = malloc(this->compressedSize);
+
+    /* Our caller should send us blocks of this size. */
+    return this->blockSize;
+}
+
+
+size_t compressedFilterWrite(CompressedFilter *this, const Byte *buf, size_t size, Error *error)
+{
+    /* We do one block at a time */
+    size = sizeMin(size, this->blockSize);
+    debug("compressedWrite: size=%zu  compressedPosition=%llu\n", size, this->compressedPosition);
+
+    /* Make sure the index knows where the current block starts */
+    blockIndexSet(&this->index, this->recordNr, this->compressedPosition, error);
+
+    /* Compress the block and write it out as a variable sized record */
+    size_t actual = this->codec->fnCompress(this->codecState, this->compressedBuf, this->compressedSize, buf, size, error);
+    passThroughWriteSized(this, this->compressedBuf, actual, error);
+    if (isError(*error))
+        return 0;
+
+    /* Advance to the next record, indexing it if we wrote a full block */
+    off_t recordEnd = this->recordNr * this->blockSize + size;
+    this->compressedPosition += (actual + 4);
+    this->recordNr++;
+    if (size == this->blockSize)
+        blockIndexSet(&this->index, this->recordNr, this->compressedPosition, error);
+    if (recordEnd > this->fileSize)
+        this->fileSize = recordEnd;
+
+    return size;
+}
+
+
+size_t compressedFilterRead(CompressedFilter *this, Byte *buf, size_t size, Error *error)
+{
+    /* We do one record at a time */
+    size = sizeMin(size, this->blockSize);
+    debug("compressedRead: size=%zu  compressedPosition=%llu\n", size, this->compressedPosition);
+    if (isError(*error))
+        return 0;
+
+    /* Read the compressed record, borrowing it from the next filter if possible. */
+    Byte *record = this->compressedBuf;
+    size_t compressedActual = passThroughBorrowSized(this, &record, this->compressedSize, error);
+    if (isError(*error))
+        return 0;
+
+    /* Update the compressed file position to be after the record. */
+    this->compressedPosition += (compressedActual + 4);
+    this->recordNr++;
+
+    /* Decompress the record we just read, giving it back if borrowed. */
+    size_t actual = this->codec->fnDecompress(this->codecState, buf, size, record, compressedActual, error);
+    if (record != this->compressedBuf)
+        passThroughReturn(this, record, error);
+
+    return actual;
+}
+
+
+off_t compressedFilterSeek(CompressedFilter *this, off_t position, Error *error)
+{
+    debug("compressedSeek (start): position=%lld  compressedPosition=%llu\n", position, this->compressedPosition);
+
+    /* If seeking to the end, we know the file size from the index, so we don't have to decompress anything. */
+    if (position == FILE_END_POSITION)
+    {
+        /* Position at the start of the final partial record, or at the end if there isn't one. */
+        compressedFilterSeek(this, sizeRoundDown(this->fileSize, this->blockSize), error);
+        return this->fileSize;
+    }
+
+    /* Verify we are seeking to a record boundary */
+    if (position % this->blockSize != 0)
+        return ioStackError(error, "Compression - must seek to a block boundary");
+
+    /* Look up the position in the compressed file. Position 0 of a new file has no index entry yet. */
+    size_t recordNr = position / this->blockSize;
+    if (recordNr >= this->index.nrEntries && recordNr > 0)
+        return setError(error, errorEOF);
+    this->compressedPosition = (recordNr < this->index.nrEntries)? blockIndexGet(&this->index, recordNr, error): this->headerSize;
+    this->recordNr = recordNr;
+
+    debug("compressedSeek: position=%llu   compressedPosition=%llu \n", position, this->compressedPosition);
+
+    /* Seek to corresponding record */
+    passThroughSeek(this, this->compressedPosition, error);
+
+    return position;
+}
+
+
+/**
+ * Make the index durable along with the data.
+ */
+void compressedFilterSync(CompressedFilter *this, Error *error)
+{
+    blockIndexSave(&this->index, this->fileSize, error);
+    passThroughSync(this->indexFile, error);
+    passThroughSync(this, error);
+}
+
+
+void compressedFilterClose(CompressedFilter *this, Error *error)
+{
+    blockIndexSave(&this->index, this->fileSize, error);
+    fileClose(this->indexFile, error);
+    blockIndexFree(&this->index);
+    passThroughClose(this, error);
+
+    if (this->codecState != NULL)
+        this->codec->fnFree(this->codecState);
+    if (this->compressedBuf != NULL)
+        free(this->compressedBuf);
+    if (this->codecOptions != NULL)
+        free(this->codecOptions);
+    free(this);
+}
+
+
+void compressedFilterDelete(CompressedFilter *this, char *path, Error *error)
+{
+    /* Delete the main data file */
+    passThroughDelete(this, path, error);
+
+    /* Delete the index file as well */
+    char indexPath[MAXPGPATH];
+    strlcpy(indexPath, path, sizeof(indexPath));
+    strlcat(indexPath, ".idx", sizeof(indexPath));
+    passThroughDelete(this, indexPath, error);
+}
+
+
+/*
+ * Configure the codec, either from the header of an existing file or by writing a header for a new one.
+ */
+static void compressedConfigure(CompressedFilter *this, Error *error)
+{
+    /* Try to read an existing header, unless we know the file is empty. */
+    if (!this->truncated)
+        compressedHeaderRead(this, error);
+
+    /* If empty file, then try to write a new header */
+    if (this->writable && (this->truncated || errorIsEOF(*error)))
+    {
+        *error = errorOK;
+        compressedHeaderWrite(this, error);
+    }
+    else if (isError(*error))
+        ioStackError(error, "Compression can't read header");
+
+    /* Create the codec's state for this file. Our options only apply if the file uses the codec they were meant for. */
+    const void *options = (this->codec == this->optionsCodec)? this->codecOptions: NULL;
+    if (!isError(*error) && this->codec->fnNew != NULL)
+        this->codecState = this->codec->fnNew(options, error);
+
+    /* The first record follows the header. */
+    this->compressedPosition = this->headerSize;
+    this->recordNr = 0;
+}
+
+
+static void compressedHeaderRead(CompressedFilter *this, Error *error)
+{
+    if (isError(*error))
+        return;
+
+    /* Read the header */
+    Byte header[MAX_COMPRESSED_HEADER_SIZE] = {0};
+    size_t headerSize = passThroughReadSized(this, header, sizeof(header), error);
+    if (isError(*error))
+        return;
+
+    /* Remember the full header size as stored in the file. Since it was a "sized" write, add 4 bytes for the size field. */
+    this->headerSize = headerSize + 4;
+
+    /* Extract the various fields from the header, ensuring safe memory references */
+    Byte *bp = header;
+    Byte *end = header + headerSize;
+
+    /* Get the uncompressed block size for this file. */
+    this->blockSize = unpack4(&bp, end);
+    if (this->blockSize == 0 || this->blockSize > MAX_BLOCK_SIZE)
+        return (void) ioStackError(error, "Compressed block size in header is invalid");
+
+    /* Get the codec name */
+    size_t nameSize = unpack1(&bp, end);
+    if (nameSize > sizeof(this->codecName) - 1)  /* allow for null termination */
+        return (void) ioStackError(error, "Codec name in header is too large");
+    unpackBytes(&bp, end, (Byte *)this->codecName, nameSize);
+    this->codecName[nameSize] = '\0';
+
+    /* Verify we haven't overflowed. */
+    if (bp > end)
+        return (void) ioStackError(error, "Invalid compressed file header");
+
+    /* Look up the codec which wrote the file. */
+    this->codec = codecLookup(this->codecName);
+    if (this->codec == NULL)
+        return (void) ioStackError(error, "Unknown compression codec in file header");
+}
+
+
+static void compressedHeaderWrite(CompressedFilter *this, Error *error)
+{
+    /* Look up the codec we were configured with. */
+    this->codec = codecLookup(this->codecName);
+    if (this->codec == NULL)
+        return (void) ioStackError(error, "Unknown compression codec");
+
+    /* Build the header: block size followed by the codec name. */
+    Byte header[MAX_COMPRESSED_HEADER_SIZE];
+    Byte *bp = header;
+    Byte *end = header + sizeof(header);
+    pack4(&bp, end, this->blockSize);
+    pack1(&bp, end, strlen(this->codecName));
+    packBytes(&bp, end, (Byte *)this->codecName, strlen(this->codecName));
+
+    /* Verify we haven't overflowed our buffer. */
+    if (bp > end)
+        return (void) ioStackError(error, "Trying to write a header which is too large");
+
+    /* Write the header to the output file */
+    passThroughWriteSized(this, header, bp - header, error);
+
+    /* Remember the header size. Since we did a "sized" write, add 4 bytes for the record size. */
+    this->headerSize = bp - header + 4;
+}
+
+
+FilterInterface compressedFilterInterface = (FilterInterface) {
+    .name = "CompressedFilter",
+    .fnOpen = (FilterOpen)compressedFilterOpen,
+    .fnClose = (FilterClose)compressedFilterClose,
+    .fnRead = (FilterRead)compressedFilterRead,
+    .fnWrite = (FilterWrite)compressedFilterWrite,
+    .fnSeek = (FilterSeek)compressedFilterSeek,
+    .fnSync = (FilterSync)compressedFilterSync,
+    .fnBlockSize = (FilterBlockSize)compressedFilterBlockSize,
+    .fnDelete = (FilterDelete)compressedFilterDelete,
+};
+
+
+/**
+ * Create a filter for writing and reading compressed files.
+ * Existing files are read with whatever codec and block size they were written with.
+ * @param codecName - codec for new files: "lz4", "zstd" or "none".
+ * @param blockSize - size of individually compressed records, for new files.
+ */
+CompressedFilter *compressedFilterNew(char *codecName, size_t blockSize, void *next)
+{
+    return compressedFilterOptionsNew(codecName, blockSize, NULL, next);
+}
+
+
+/**
+ * Create a compressed file filter, passing options to the codec. The options are copied,
+ * but anything they point to, like a dictionary, must stay in memory as long as the filter is in use.
+ * They only apply to files written with the named codec.
+ * @param options - the codec's own options, eg. ZstdOptions, or NULL for its defaults.
+ */
+CompressedFilter *compressedFilterOptionsNew(char *codecName, size_t blockSize, const void *options, void *next)
+{
+    CompressedFilter *this = malloc(sizeof(CompressedFilter));
+    *this = (CompressedFilter){.blockSize = blockSize};
+    strlcpy(this->codecName, codecName, sizeof(this->codecName));
+
+    /* Keep our own copy of the options, so the caller's copy can go away. */
+    this->optionsCodec = codecLookup(codecName);
+    if (options != NULL && this->optionsCodec != NULL && this->optionsCodec->optionsSize > 0)
+    {
+        this->codecOptions = malloc(this->optionsCodec->optionsSize);
+        memcpy(this->codecOptions, options, this->optionsCodec->optionsSize);
+    }
+
+    filterInit(this, &compressedFilterInterface, next);
+    return this;
+}
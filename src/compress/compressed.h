@@ -0,0 +1,14 @@
+/* */
+/* Filter which compresses blocks with a codec chosen at run time. */
+/* */
+
+#ifndef FILTER_COMPRESSED_H
+#define FILTER_COMPRESSED_H
+#include "common/filter.h"
+
+typedef struct CompressedFilter CompressedFilter;
+
+CompressedFilter *compressedFilterNew(char *codecName, size_t blockSize, void *next);
+CompressedFilter *compressedFilterOptionsNew(char *codecName, size_t blockSize, const void *options, void *next);
+
+#endif /*FILTER_COMPRESSED_H */
@@ -3,6 +3,7 @@
 /* */
 //#define DEBUG
 #include <stdlib.h>
+#include <fcntl.h>
 #include <lz4.h>
 //#include <lz4frame.h>
 #include "common/debug.h"
@@ -13,12 +14,70 @@
 #include "iostack.h"
 #include "file/fileSystemBottom.h"
 #include "file/buffered.h"
+#include "common/threadPool.h"
+#include "common/packed.h"
+#include "compress/blockIndex.h"
 
 /* Forward references */
 static bool isErrorLz4(size_t size, Error *error);
 size_t lz4DecompressBuffer(Lz4Compress *this, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error);
 size_t lz4CompressBuffer(Lz4Compress *this, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error);
 size_t compressedSize(size_t size);
+static size_t lz4ParallelWrite(Lz4Compress *this, const Byte *buf, size_t size, Error *error);
+static off_t getIndex(Lz4Compress *this, size_t entryNr, Error *error);
+static void setIndex(Lz4Compress *this, size_t entryNr, off_t offset, Error *error);
+static void saveIndex(Lz4Compress *this, Error *error);
+static void readFooter(Lz4Compress *this, Error *error);
+static void writeTrailer(Lz4Compress *this, Error *error);
+static void nextRecord(Lz4Compress *this, size_t plainSize, size_t compressedActual, Error *error);
+static size_t compressRecord(Lz4Compress *this, Byte *toBuf, const Byte *fromBuf, size_t fromSize, bool *raw, Error *error);
+static size_t decompressRecord(Lz4Compress *this, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, bool restart, bool raw, Error *error);
+static void writeRecord(Lz4Compress *this, const Byte *record, size_t size, bool raw, Error *error);
+static size_t readRecord(Lz4Compress *this, Byte **record, bool *raw, Error *error);
+static bool isRestart(Lz4Compress *this, size_t entryNr, Error *error);
+static bool isSample(size_t incompressible);
+static size_t compressStreaming(Lz4Compress *this, Byte *toBuf, const Byte *fromBuf, size_t fromSize, bool compress, Error *error);
+static void saveHistory(Lz4Compress *this, const Byte *block, size_t size);
+static void rebuildHistory(Lz4Compress *this, Error *error);
+
+#define BLOCKS_PER_THREAD 8
+#define BLOCKS_PER_VECTOR 16
+
+/*
+ * When streaming, each record may refer back to the previous block (up to 64K of it).
+ * Records which don't are restart points, flagged in their index entry, where decoding can begin.
+ */
+#define HISTORY_SIZE (64*1024)
+#define RESTART_FLAG ((off_t)1 << 62)
+
+/*
+ * Blocks which don't compress to RAW_THRESHOLD_PERCENT of their size are stored raw, flagged in the
+ * top bit of the record's size prefix. After INCOMPRESSIBLE_BLOCKS raw blocks in a row, the file
+ * looks incompressible, and we only try compressing one block in SAMPLE_INTERVAL until one pays off.
+ */
+#define RAW_RECORD 0x80000000u
+#define RAW_THRESHOLD_PERCENT 90
+#define INCOMPRESSIBLE_BLOCKS 8
+#define SAMPLE_INTERVAL 32
+
+/*
+ * With an embedded index, the index is stored as a trailer following the compressed records,
+ * and the file ends with a fixed size footer locating it:
+ *     trailer position (8), number of entries (8), uncompressed file size (8), magic (8)
+ */
+#define FOOTER_SIZE 32
+#define FOOTER_MAGIC 0x4C5A34494E444558ull   /* "LZ4INDEX" */
+
+/* A run of consecutive blocks being compressed by one worker thread. */
+typedef struct Lz4Job
+{
+    Task task;                        /* The background task doing the compression */
+    Lz4Compress *owner;               /* The filter we are compressing for */
+    const Byte *plainBuf;             /* The first uncompressed block */
+    size_t firstBlock;                /* Index of the first block within the batch */
+    size_t nrBlocks;                  /* Number of blocks to compress */
+    Error error;                      /* Error status of the compression */
+} Lz4Job;
 
 /* Structure holding the state of our compression/decompression filter. */
 struct Lz4Compress
@@ -32,10 +91,40 @@ struct Lz4Compress
 
     IoStack *indexFile;            /* Index file created "on the fly" to support block seeks. */
     off_t compressedPosition;         /* The offset of the current compressed block within the compressed file */
-
-    Byte *tempBuf;                    /* temporary buffer to hold decompressed data when probing for size */
-
-    bool previousRead;                /* true if the previous op was a read (or equivaleht) */
+    size_t recordNr;                  /* Block number of the current compressed block */
+
+    BlockIndex index;                 /* Where each block starts in the compressed file */
+    off_t fileSize;                   /* Uncompressed size of the file */
+    bool truncated;                   /* Was the file truncated when opened, so the index starts out empty? */
+    bool writable;                    /* Was the file opened for writing? */
+
+    /* Index embedded in the data file rather than in a separate index file */
+    bool embedded;                    /* Is the index stored in a trailer? */
+    off_t dataEnd;                    /* End of the compressed records, where the trailer goes */
+    off_t physicalEnd;                /* Size of the data file, which we never shrink */
+    bool indexChanged;                /* Has the index changed since the trailer was written? */
+
+    /* Streaming compression, where blocks are linked to the previous block */
+    size_t restartInterval;           /* Blocks between forced restart points, zero if not streaming */
+    LZ4_stream_t *stream;             /* Compression state carried from block to block */
+    Byte *history;                    /* The previous block, as seen by both compression and decompression */
+    size_t historySize;
+    bool historyValid;                /* Does the history hold the block before the current record? */
+    bool streamSynced;                /* Does the compression stream already know about the history? */
+
+    size_t incompressible;            /* Number of blocks in a row stored raw */
+
+    Byte *tempBuf;                    /* temporary buffer to hold a decompressed block we only need as history */
+    Byte *vecBuf;                     /* Buffer to gather size-prefixed records from a vectored write */
+
+    /* Parallel compression of multi-block writes */
+    size_t nrThreads;                 /* Number of compression threads. Zero if compressing inline. */
+    ThreadPool *workers;              /* Threads which compress blocks in parallel */
+    Lz4Job *jobs;                     /* One job per thread */
+    Byte *batchBuf;                   /* Compressed blocks of the current batch, each in a slot of compressedSize */
+    size_t *batchActual;              /* Compressed size of each block in the batch */
+    bool *batchSample;                /* Is the block in the batch one we compress? */
+    size_t batchBlocks;               /* Max number of blocks in a batch */
 };
 
 
@@ -45,19 +134,30 @@ Lz4Compress *lz4CompressOpen(Lz4Compress *pipe, const char *path, int oflags, in
 
     /* Open the compressed file and clone ourselves */
     Filter *next = passThroughOpen(pipe, path, oflags, mode, error);
-    Lz4Compress *this = lz4CompressNew(pipe->blockSize, next);
+    Lz4Compress *this = lz4CompressParallelNew(pipe->blockSize, pipe->nrThreads, next);
+    this->embedded = pipe->embedded;
+    this->restartInterval = pipe->restartInterval;
     if (isError(*error))
         return this;
 
-    /* Open the index file as well. */
-    char indexPath[MAXPGPATH];
-    strlcpy(indexPath, path, sizeof(indexPath));
-    strlcat(indexPath, ".idx", sizeof(indexPath));
-    this->indexFile = ioStackNew(passThroughOpen(this, indexPath, oflags, mode, error));
+    /* Open the index file as well, unless the index is embedded in the data file. */
+    if (!this->embedded)
+    {
+        char indexPath[MAXPGPATH];
+        strlcpy(indexPath, path, sizeof(indexPath));
+        strlcat(indexPath, ".idx", sizeof(indexPath));
+        this->indexFile = ioStackNew(passThroughOpen(this, indexPath, oflags, mode, error));
+    }
 
     /* Make note we are at the start of the compressed file */
     this->compressedPosition = 0;
-    this->previousRead = true;
+    this->recordNr = 0;
+    this->truncated = (oflags & O_TRUNC) != 0;
+    this->writable = (oflags & O_ACCMODE) != O_RDONLY;
+
+    /* If compressing in parallel, start the worker threads. */
+    if (this->nrThreads > 0 && (oflags & O_ACCMODE) != O_RDONLY)
+        this->workers = threadPoolNew(this->nrThreads);
 
     /* Do we want to write a file header containing the block size? */
     /* TODO: later. */
@@ -68,19 +168,50 @@ Lz4Compress *lz4CompressOpen(Lz4Compress *pipe, const char *path, int oflags, in
 size_t lz4CompressBlockSize(Lz4Compress *this, size_t prevSize, Error *error)
 {
     /* Starting with the index file, we send 4 byte blocks */
-    size_t indexSize = passThroughBlockSize(this->indexFile, sizeof(off_t), error);
-    if (sizeof(off_t) % indexSize != 0)
-        return ioStackError(error, "lz4 index file has incompatible block size");
+    if (!this->embedded)
+    {
+        size_t indexSize = passThroughBlockSize(this->indexFile, sizeof(off_t), error);
+        if (sizeof(off_t) % indexSize != 0)
+            return ioStackError(error, "lz4 index file has incompatible block size");
+
+        /* Open the index, which also tells us how big the file is. */
+        blockIndexOpen(&this->index, this->indexFile, this->truncated, error);
+        this->fileSize = this->index.savedSize;
+    }
+    else
+        blockIndexOpenEmbedded(&this->index, this, 0, 0);
 
     /* For our data file, we send variable sized blocks to the next stage, so treat as byte stream. */
     size_t nextSize = passThroughBlockSize(this, 1, error);
     if (nextSize != 1)
         return ioStackError(error, "lz4 Compression has mismatched block size");
 
+    /* With an embedded index, the footer tells us where the index is and how big the file is. */
+    if (this->embedded)
+        readFooter(this, error);
+
     /* Allocate a buffer to hold a compressed block */
     this->compressedSize = compressedSize(this->blockSize);
     this->compressedBuf = malloc(this->compressedSize);
     this->tempBuf = malloc(this->blockSize);
+    this->vecBuf = malloc(BLOCKS_PER_VECTOR * (this->compressedSize + 4));
+
+    /* If streaming, allocate the state carried between blocks. */
+    if (this->restartInterval > 0)
+    {
+        this->stream = LZ4_createStream();
+        this->history = malloc(HISTORY_SIZE);
+    }
+
+    /* If compressing in parallel, allocate room for a batch of compressed blocks. */
+    if (this->workers != NULL)
+    {
+        this->batchBlocks = this->nrThreads * BLOCKS_PER_THREAD;
+        this->batchBuf = malloc(this->batchBlocks * this->compressedSize);
+        this->batchActual = malloc(this->batchBlocks * sizeof(size_t));
+        this->batchSample = malloc(this->batchBlocks * sizeof(bool));
+        this->jobs = malloc(this->nrThreads * sizeof(Lz4Job));
+    }
 
     /* Our caller should send us blocks of this size. */
     return this->blockSize;
@@ -89,32 +220,170 @@ size_t lz4CompressBlockSize(Lz4Compress *this, size_t prevSize, Error *error)
 
 size_t lz4CompressWrite(Lz4Compress *this, const Byte *buf, size_t size, Error *error)
 {
+    /* If writing several full blocks, compress them in parallel */
+    if (this->workers != NULL && size >= 2 * this->blockSize)
+        return lz4ParallelWrite(this, buf, size, error);
+
     /* We do one block at a time */
     size = sizeMin(size, this->blockSize);
 
     debug("lz4Write: size=%zu  compressedPosition=%llu\n", size, this->compressedPosition);
 
-    /* If previous read, synchronize the index by writing out offset to start of current block */
-    if (this->previousRead)
-        filePut8(this->indexFile, this->compressedPosition, error);
-    this->previousRead = false;
+    /* Make sure the index knows where the current block starts */
+    setIndex(this, this->recordNr, this->compressedPosition, error);
 
-    /* Compress the block and write it out as a variable sized record */
-    size_t actual = lz4CompressBuffer(this, this->compressedBuf, this->compressedSize, buf, size, error);
-    passThroughWriteSized(this, this->compressedBuf, actual, error);
+    /* Compress the block and write it out as a variable sized record, or as is if it didn't compress */
+    bool raw;
+    size_t actual = compressRecord(this, this->compressedBuf, buf, size, &raw, error);
+    writeRecord(this, raw? buf: this->compressedBuf, actual, raw, error);
     if (isError(*error))
         return 0;
 
-    /* Update our file position */
-    this->compressedPosition += (actual + 4);
-
-    /* If we wrote a full block, write out an index entry */
-    if (size == this->blockSize)
-        filePut8(this->indexFile, this->compressedPosition, error);
+    /* Advance to the next record, indexing it if we wrote a full block */
+    nextRecord(this, size, actual, error);
 
     return size;
 }
 
+
+/* Background task which compresses a run of full blocks into their slots in the batch buffer, skipping blocks which aren't samples. */
+static void lz4CompressTask(void *arg)
+{
+    Lz4Job *job = arg;
+    Lz4Compress *this = job->owner;
+
+    for (size_t idx = job->firstBlock; idx < job->firstBlock + job->nrBlocks && !isError(job->error); idx++)
+        if (this->batchSample[idx])
+            this->batchActual[idx] = lz4CompressBuffer(this, this->batchBuf + idx * this->compressedSize, this->compressedSize,
+                                                       job->plainBuf + (idx - job->firstBlock) * this->blockSize, this->blockSize,
+                                                       &job->error);
+}
+
+/*
+ * Compress a batch of full blocks in parallel, one run of blocks per thread,
+ * then write the records and their index entries out in order.
+ *   @returns - number of uncompressed bytes consumed, always a multiple of the block size.
+ */
+static size_t lz4ParallelWrite(Lz4Compress *this, const Byte *buf, size_t size, Error *error)
+{
+    debug("lz4ParallelWrite: size=%zu  compressedPosition=%llu\n", size, this->compressedPosition);
+    if (isError(*error))
+        return 0;
+
+    /* Split the batch of blocks evenly between the threads. */
+    size_t nrBlocks = sizeMin(size / this->blockSize, this->batchBlocks);
+
+    /* Decide which blocks to compress, as though the ones we don't compress end up stored raw. */
+    for (size_t idx = 0; idx < nrBlocks; idx++)
+        this->batchSample[idx] = isSample(this->incompressible + idx);
+
+    size_t perJob = (nrBlocks + this->nrThreads - 1) / this->nrThreads;
+
+    /* Start a job for each run of blocks. */
+    size_t nrJobs = 0;
+    for (size_t first = 0; first < nrBlocks; first += perJob, nrJobs++)
+    {
+        Lz4Job *job = &this->jobs[nrJobs];
+        job->owner = this;
+        job->plainBuf = buf + first * this->blockSize;
+        job->firstBlock = first;
+        job->nrBlocks = sizeMin(perJob, nrBlocks - first);
+        job->error = errorOK;
+        threadPoolSubmit(this->workers, &job->task, lz4CompressTask, job);
+    }
+
+    /* Make sure the index knows where the current block starts */
+    setIndex(this, this->recordNr, this->compressedPosition, error);
+
+    /* Wait for all of them to finish, collecting errors. */
+    for (size_t idx = 0; idx < nrJobs; idx++)
+    {
+        threadPoolWait(this->workers, &this->jobs[idx].task);
+        setError(error, this->jobs[idx].error);
+    }
+
+    /* Write out each record, in order, followed by the index entry for the next block. Blocks which didn't compress go out raw. */
+    for (size_t idx = 0; idx < nrBlocks && !isError(*error); idx++)
+    {
+        const Byte *plain = buf + idx * this->blockSize;
+        Byte *compressed = this->batchBuf + idx * this->compressedSize;
+
+        /* If an earlier block of the batch compressed after all, compress the blocks we skipped which are now due. */
+        if (!this->batchSample[idx] && isSample(this->incompressible))
+        {
+            this->batchActual[idx] = lz4CompressBuffer(this, compressed, this->compressedSize, plain, this->blockSize, error);
+            this->batchSample[idx] = true;
+        }
+
+        bool raw = !this->batchSample[idx] || this->batchActual[idx] * 100 > this->blockSize * RAW_THRESHOLD_PERCENT;
+        this->incompressible = raw? this->incompressible + 1: 0;
+
+        size_t actual = raw? this->blockSize: this->batchActual[idx];
+        writeRecord(this, raw? plain: compressed, actual, raw, error);
+        nextRecord(this, this->blockSize, actual, error);
+    }
+    if (isError(*error))
+        return 0;
+
+    return nrBlocks * this->blockSize;
+}
+
+/**
+ * Compress a vector of blocks, gathering the size-prefixed records so they are written
+ * in a few large requests rather than two requests per record.
+ */
+size_t lz4CompressWritev(Lz4Compress *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    debug("lz4Writev: iovCnt=%zu  compressedPosition=%llu\n", iovCnt, this->compressedPosition);
+    if (isError(*error))
+        return 0;
+
+    /* Make sure the index knows where the current block starts */
+    setIndex(this, this->recordNr, this->compressedPosition, error);
+
+    size_t totalSize = 0;
+    Byte *bp = this->vecBuf;
+    Byte *end = this->vecBuf + BLOCKS_PER_VECTOR * (this->compressedSize + 4);
+    for (size_t idx = 0; idx < iovCnt && !isError(*error); idx++)
+    {
+        const Byte *buf = iov[idx].iov_base;
+        size_t size = iov[idx].iov_len;
+        while (size > 0 && !isError(*error))
+        {
+            /* Compress the next block into the gather buffer, following its size prefix */
+            size_t plainSize = sizeMin(size, this->blockSize);
+            bool raw;
+            size_t actual = compressRecord(this, bp + 4, buf, plainSize, &raw, error);
+            if (raw)
+                memcpy(bp + 4, buf, plainSize);
+            pack4(&bp, end, actual | (raw? RAW_RECORD: 0));
+            bp += actual;
+
+            /* Advance to the next record, indexing it if we wrote a full block */
+            nextRecord(this, plainSize, actual, error);
+
+            /* Write out the gathered records if there isn't room for another */
+            if (bp + this->compressedSize + 4 > end)
+            {
+                passThroughWriteAll(this, this->vecBuf, bp - this->vecBuf, error);
+                bp = this->vecBuf;
+            }
+
+            buf += plainSize;
+            size -= plainSize;
+            totalSize += plainSize;
+        }
+    }
+
+    /* Write out whatever is left over. */
+    if (bp > this->vecBuf)
+        passThroughWriteAll(this, this->vecBuf, bp - this->vecBuf, error);
+
+    if (isError(*error))
+        return 0;
+    return totalSize;
+}
+
 size_t lz4CompressRead(Lz4Compress *this, Byte *buf, size_t size, Error *error)
 {
     /* We do one record at a time */
@@ -124,21 +393,30 @@ size_t lz4CompressRead(Lz4Compress *this, Byte *buf, size_t size, Error *error)
     if (isError(*error))
         return 0;
 
-    /* If last op was a read, read the index so we stay in sync */
-    if (this->previousRead)
-        fileGet8(this->indexFile, error);
-    this->previousRead = true;
+    /* With an embedded index, the compressed records end where the trailer begins. */
+    if (this->embedded && this->compressedPosition >= this->dataEnd)
+        return setError(error, errorEOF);
 
-    /* Read the compressed record, */
-    size_t compressedActual = passThroughReadSized(this, this->compressedBuf, this->compressedSize, error);
+    /* When streaming, make sure we have the previous block unless decoding starts over here. */
+    bool restart = this->restartInterval > 0 && isRestart(this, this->recordNr, error);
+    if (this->restartInterval > 0 && !restart && !this->historyValid)
+        rebuildHistory(this, error);
+
+    /* Read the compressed record, borrowing it from the next filter if possible. */
+    Byte *record = this->compressedBuf;
+    bool raw;
+    size_t compressedActual = readRecord(this, &record, &raw, error);
     if (isError(*error))
         return 0;
 
-    /* Update the compressed file position to be afterr the record. */
+    /* Update the compressed file position to be after the record. */
     this->compressedPosition += (compressedActual + 4);
+    this->recordNr++;
 
-    /* Decompress the record we just read. */
-    size_t actual = lz4DecompressBuffer(this, buf, size, this->compressedBuf, compressedActual, error);
+    /* Decompress the record we just read, giving it back if borrowed. */
+    size_t actual = decompressRecord(this, buf, size, record, compressedActual, restart, raw, error);
+    if (record != this->compressedBuf)
+        passThroughReturn(this, record, error);
 
     return actual;
 }
@@ -147,34 +425,15 @@ off_t lz4CompressSeek(Lz4Compress *this, off_t position, Error *error)
 {
     debug("lzSeek (start): position=%lld  compressedPosition=%llu\n", position, this->compressedPosition);
 
-    /* If seeking to the end, ... */
+    /* If seeking to the end, we know the file size from the index, so we don't have to decompress anything. */
     if (position == FILE_END_POSITION)
     {
-        /* Query the index to figure out how many records are in the file. */
-        size_t indexSize = fileSeek(this->indexFile, FILE_END_POSITION, error);
-        size_t nrRecords = indexSize / 8;
-
-        /* if index file is empty, the data file should be as well.  TODO: should we verify? */
-        if (nrRecords == 0)
-            return 0;
-
-        /* Seek to the final partial record, if any */
-        off_t lastPosition = (nrRecords-1) * this->blockSize;
-        lz4CompressSeek(this, lastPosition, error);
-
-        /* read the final partial record, treating EOF like a zero length partial record */
-        size_t lastSize = lz4CompressRead(this, this->tempBuf, this->blockSize, error);
-        if (errorIsEOF(*error))
-            *error = errorOK;
-
-        /* If the last record was partial, then go back to its starting position. */
-        if (errorIsOK(*error) && lastSize < this->blockSize)
-            lz4CompressSeek(this, lastPosition, error);
-
-        debug("lz4Seek (end of  file): lastPosition=%llu lastSize=%zu  compressedPosition=%llu\n", lastPosition, lastSize, this->compressedPosition);
+        /* Position at the start of the final partial record, or at the end if there isn't one. */
+        lz4CompressSeek(this, sizeRoundDown(this->fileSize, this->blockSize), error);
+        debug("lz4Seek (end of  file): fileSize=%lld  compressedPosition=%llu\n", this->fileSize, this->compressedPosition);
 
         /* Done. Return the file size, and we are positioned at end of last full record */
-        return lastPosition + lastSize;
+        return this->fileSize;
     }
 
     /* otherwise, seeking to a file position */
@@ -182,21 +441,16 @@ off_t lz4CompressSeek(Lz4Compress *this, off_t position, Error *error)
     if (position % this->blockSize != 0)
         return ioStackError(error, "l14 Compression - must seek to a block boundary");
 
-    /* Read from the index to get the position in the compressed file. */
+    /* Look up the position in the compressed file. Position 0 of a new file has no index entry yet. */
     size_t recordNr = position / this->blockSize;
-    fileSeek(this->indexFile, recordNr*8, error);
-    this->compressedPosition = fileGet8(this->indexFile, error);
+    if (recordNr >= this->index.nrEntries && recordNr > 0)
+        return setError(error, errorEOF);
+    this->compressedPosition = (recordNr < this->index.nrEntries)? getIndex(this, recordNr, error): 0;
 
-    /* To keep index and data in sync, this is like a write */
-    this->previousRead = false;
-
-    /* When seeking to position 0 in a new file, it is OK to get an EOF reading the index */
-    if (errorIsEOF(*error) && position == 0)
-    {
-        this->previousRead = true;
-        this->compressedPosition = 0;
-        *error = errorOK;
-    }
+    /* Unless staying put, the history no longer holds the block before the current record. */
+    if (recordNr != this->recordNr)
+        this->historyValid = false;
+    this->recordNr = recordNr;
 
     debug("lz4Seek: position=%llu   compressedPosition=%llu \n", position, this->compressedPosition);
 
@@ -206,14 +460,46 @@ off_t lz4CompressSeek(Lz4Compress *this, off_t position, Error *error)
     return position;
 }
 
+
+/**
+ * Make the index durable along with the data.
+ */
+void lz4CompressSync(Lz4Compress *this, Error *error)
+{
+    saveIndex(this, error);
+    if (!this->embedded)
+        passThroughSync(this->indexFile, error);
+    passThroughSync(this, error);
+}
+
+
 void lz4CompressClose(Lz4Compress *this, Error *error)
 {
-    fileClose(this->indexFile, error);
+    saveIndex(this, error);
+    if (!this->embedded)
+        fileClose(this->indexFile, error);
+    blockIndexFree(&this->index);
     passThroughClose(this, error);
     if (this->compressedBuf != NULL)
         free(this->compressedBuf);
     if (this->tempBuf != NULL)
         free(this->tempBuf);
+    if (this->vecBuf != NULL)
+        free(this->vecBuf);
+    if (this->workers != NULL)
+        threadPoolFree(this->workers);
+    if (this->jobs != NULL)
+        free(this->jobs);
+    if (this->batchBuf != NULL)
+        free(this->batchBuf);
+    if (this->batchActual != NULL)
+        free(this->batchActual);
+    if (this->batchSample != NULL)
+        free(this->batchSample);
+    if (this->stream != NULL)
+        LZ4_freeStream(this->stream);
+    if (this->history != NULL)
+        free(this->history);
     free(this);
 }
 
@@ -224,12 +510,350 @@ void lz4CompressDelete(Lz4Compress *this, char *path, Error *error)
     passThroughDelete(this, path, error);
 
     /* Delete the index file as well */
+    if (this->embedded)
+        return;
     char indexPath[MAXPGPATH];
     strlcpy(indexPath, path, sizeof(indexPath));
     strlcat(indexPath, ".idx", sizeof(indexPath));
     passThroughDelete(this, indexPath, error);
 }
 
+/*
+ * Finish writing a record, advancing to the next one.
+ * If the record was a full block, the next one starts a new block and gets an index entry.
+ */
+static void nextRecord(Lz4Compress *this, size_t plainSize, size_t compressedActual, Error *error)
+{
+    off_t recordEnd = this->recordNr * this->blockSize + plainSize;
+    this->compressedPosition += (compressedActual + 4);
+    this->recordNr++;
+    this->dataEnd = sizeMax(this->dataEnd, this->compressedPosition);
+    this->indexChanged = true;
+
+    if (plainSize == this->blockSize)
+        setIndex(this, this->recordNr, this->compressedPosition, error);
+    if (recordEnd > this->fileSize)
+        this->fileSize = recordEnd;
+}
+
+
+/* Look up where a block starts in the compressed file. */
+static off_t getIndex(Lz4Compress *this, size_t entryNr, Error *error)
+{
+    return blockIndexGet(&this->index, entryNr, error) & ~RESTART_FLAG;
+}
+
+
+/* Is the block a restart point, where decoding can begin without the previous block? */
+static bool isRestart(Lz4Compress *this, size_t entryNr, Error *error)
+{
+    if (entryNr == 0)
+        return true;
+    if (entryNr >= this->index.nrEntries)
+        return false;
+
+    return (blockIndexGet(&this->index, entryNr, error) & RESTART_FLAG) != 0;
+}
+
+
+/* Record where a block starts in the compressed file. */
+static void setIndex(Lz4Compress *this, size_t entryNr, off_t offset, Error *error)
+{
+    blockIndexSet(&this->index, entryNr, offset, error);
+    this->indexChanged = true;
+}
+
+
+/*
+ * Write the index out, either as a trailer or to the index file.
+ */
+static void saveIndex(Lz4Compress *this, Error *error)
+{
+    if (this->embedded)
+        writeTrailer(this, error);
+    else
+        blockIndexSave(&this->index, this->fileSize, error);
+}
+
+
+/*
+ * Read the footer of a file with an embedded index. An empty file has no footer.
+ * If we are going to write, load the whole index now, since our writes will overwrite the trailer.
+ */
+static void readFooter(Lz4Compress *this, Error *error)
+{
+    if (this->truncated || isError(*error))
+        return;
+
+    /* Read the footer from the end of the file. */
+    this->physicalEnd = passThroughSeek(this, FILE_END_POSITION, error);
+    if (this->physicalEnd == 0 || isError(*error))
+        return;
+    if (this->physicalEnd < FOOTER_SIZE)
+    {
+        ioStackError(error, "lz4 compressed file is missing its index");
+        return;
+    }
+
+    Byte buf[FOOTER_SIZE], *bp = buf;
+    passThroughPreadAll(this, buf, FOOTER_SIZE, this->physicalEnd - FOOTER_SIZE, error);
+    off_t trailerPosition = unpack8(&bp, buf + FOOTER_SIZE);
+    size_t nrEntries = unpack8(&bp, buf + FOOTER_SIZE);
+    this->fileSize = unpack8(&bp, buf + FOOTER_SIZE);
+    uint64_t magic = unpack8(&bp, buf + FOOTER_SIZE);
+    if (isError(*error))
+        return;
+    if (magic != FOOTER_MAGIC || trailerPosition + nrEntries * sizeof(off_t) + FOOTER_SIZE > this->physicalEnd)
+    {
+        ioStackError(error, "lz4 compressed file has a corrupt index");
+        return;
+    }
+
+    blockIndexOpenEmbedded(&this->index, this, trailerPosition, nrEntries);
+    this->dataEnd = trailerPosition;
+
+    /* Load the whole index before our writes can overwrite it. */
+    if (this->writable)
+        blockIndexLoad(&this->index, error);
+
+    passThroughSeek(this, 0, error);
+}
+
+
+/*
+ * Write the index as a trailer after the compressed records, followed by the footer.
+ * The data file never shrinks, so pad the trailer if necessary to put the footer at the very end.
+ */
+static void writeTrailer(Lz4Compress *this, Error *error)
+{
+    if (!this->indexChanged || isError(*error))
+        return;
+
+    /* Write out the index entries, a page at a time. */
+    Byte buf[INDEX_PAGE_ENTRIES * sizeof(off_t)];
+    off_t position = this->dataEnd;
+    for (size_t firstEntry = 0; firstEntry < this->index.nrEntries && !isError(*error); firstEntry += INDEX_PAGE_ENTRIES)
+    {
+        size_t nrEntries = sizeMin(INDEX_PAGE_ENTRIES, this->index.nrEntries - firstEntry);
+        Byte *bp = buf;
+        for (size_t idx = 0; idx < nrEntries && !isError(*error); idx++)
+            pack8(&bp, buf + sizeof(buf), blockIndexGet(&this->index, firstEntry + idx, error));
+
+        position += passThroughPwriteAll(this, buf, bp - buf, position, error);
+    }
+
+    /* Pad with zeros so the footer lands at the old end of file. */
+    memset(buf, 0, sizeof(buf));
+    while (position + FOOTER_SIZE < this->physicalEnd && !isError(*error))
+    {
+        size_t padSize = sizeMin(sizeof(buf), this->physicalEnd - FOOTER_SIZE - position);
+        position += passThroughPwriteAll(this, buf, padSize, position, error);
+    }
+
+    /* Write the footer. */
+    Byte *bp = buf;
+    pack8(&bp, buf + FOOTER_SIZE, this->dataEnd);
+    pack8(&bp, buf + FOOTER_SIZE, this->index.nrEntries);
+    pack8(&bp, buf + FOOTER_SIZE, this->fileSize);
+    pack8(&bp, buf + FOOTER_SIZE, FOOTER_MAGIC);
+    passThroughPwriteAll(this, buf, FOOTER_SIZE, position, error);
+    if (isError(*error))
+        return;
+
+    this->physicalEnd = position + FOOTER_SIZE;
+    this->index.embeddedPosition = this->dataEnd;
+    this->index.savedEntries = this->index.nrEntries;
+    this->indexChanged = false;
+
+    /* Positioned writes leave the next filter anywhere, so get back to the current record. */
+    passThroughSeek(this, this->compressedPosition, error);
+}
+
+
+/*
+ * Compress a record, unless compressing doesn't pay off, in which case the record is the block itself.
+ *   @param raw - set if the record should be stored raw.
+ *   @returns - the size of the record.
+ */
+static size_t compressRecord(Lz4Compress *this, Byte *toBuf, const Byte *fromBuf, size_t fromSize, bool *raw, Error *error)
+{
+    *raw = false;
+    if (isError(*error))
+        return 0;
+
+    /* Once the file looks incompressible, only compress an occasional sample block. */
+    bool sample = isSample(this->incompressible);
+
+    size_t actual = 0;
+    if (this->restartInterval > 0)
+        actual = compressStreaming(this, toBuf, fromBuf, fromSize, sample, error);
+    else if (sample)
+        actual = lz4CompressBuffer(this, toBuf, this->compressedSize, fromBuf, fromSize, error);
+    if (isError(*error))
+        return 0;
+
+    /* If we didn't compress, or it didn't shrink enough, store the block raw. */
+    if (!sample || actual * 100 > fromSize * RAW_THRESHOLD_PERCENT)
+    {
+        *raw = true;
+        this->incompressible++;
+        return fromSize;
+    }
+
+    this->incompressible = 0;
+    return actual;
+}
+
+
+/*
+ * Do we compress the next block, given how many blocks in a row were stored raw?
+ * Once the file looks incompressible, we only compress an occasional sample.
+ */
+static bool isSample(size_t incompressible)
+{
+    return incompressible < INCOMPRESSIBLE_BLOCKS || incompressible % SAMPLE_INTERVAL == 0;
+}
+
+
+/*
+ * Compress a block, linking it to the previous block unless it is a restart point,
+ * either because one is due or because we don't have the previous block.
+ * If we aren't actually compressing, just keep the block as history.
+ */
+static size_t compressStreaming(Lz4Compress *this, Byte *toBuf, const Byte *fromBuf, size_t fromSize, bool compress, Error *error)
+{
+    /* Start over at a restart point, marking it in the index. */
+    if (!this->historyValid || this->recordNr % this->restartInterval == 0)
+    {
+        LZ4_resetStream_fast(this->stream);
+        setIndex(this, this->recordNr, this->compressedPosition | RESTART_FLAG, error);
+    }
+
+    /* Otherwise, if we got the previous block by reading it, tell the stream about it. */
+    else if (!this->streamSynced && compress)
+        LZ4_loadDict(this->stream, (char *)this->history, (int)this->historySize);
+
+    if (!compress)
+    {
+        saveHistory(this, fromBuf, fromSize);
+        return 0;
+    }
+
+    int actual = LZ4_compress_fast_continue(this->stream, (char *)fromBuf, (char *)toBuf, (int)fromSize, (int)this->compressedSize, 1);
+    if (actual <= 0)
+        return ioStackError(error, "lz4 unable to compress the buffer");
+
+    /* Save the block as history for the next one, since our caller's buffer won't stay around. */
+    this->historySize = LZ4_saveDict(this->stream, (char *)this->history, HISTORY_SIZE);
+    this->historyValid = true;
+    this->streamSynced = true;
+
+    return actual;
+}
+
+
+/*
+ * Decompress a record, or copy it if it was stored raw.
+ * When streaming, the record may refer back to the previous block, which we keep as history.
+ */
+static size_t decompressRecord(Lz4Compress *this, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, bool restart, bool raw, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    /* A raw record is the block itself. */
+    if (raw)
+    {
+        if (fromSize > toSize)
+            return ioStackError(error, "lz4 raw record is larger than a block");
+        memcpy(toBuf, fromBuf, fromSize);
+        if (this->restartInterval > 0)
+            saveHistory(this, toBuf, fromSize);
+        return fromSize;
+    }
+
+    if (this->restartInterval == 0)
+        return lz4DecompressBuffer(this, toBuf, toSize, fromBuf, fromSize, error);
+
+    if (restart)
+        this->historySize = 0;
+    int actual = LZ4_decompress_safe_usingDict((char *)fromBuf, (char *)toBuf, (int)fromSize, (int)toSize,
+                                               (char *)this->history, (int)this->historySize);
+    if (actual < 0)
+        return ioStackError(error, "lz4 unable to decompress a buffer");
+
+    /* The block becomes the history for the next one, matching what the compressor saved. */
+    saveHistory(this, toBuf, actual);
+    return actual;
+}
+
+
+/*
+ * Keep (the end of) a block as history for the next one. The compression stream doesn't know about it.
+ */
+static void saveHistory(Lz4Compress *this, const Byte *block, size_t size)
+{
+    this->historySize = sizeMin(size, HISTORY_SIZE);
+    memcpy(this->history, block + size - this->historySize, this->historySize);
+    this->historyValid = true;
+    this->streamSynced = false;
+}
+
+
+/*
+ * Write a record with its size prefix, flagging it if the block is stored raw.
+ */
+static void writeRecord(Lz4Compress *this, const Byte *record, size_t size, bool raw, Error *error)
+{
+    if (isError(*error))
+        return;
+
+    passThroughPut4(this, size | (raw? RAW_RECORD: 0), error);
+    passThroughWriteAll(this, record, size, error);
+}
+
+
+/*
+ * Read a record, borrowing it from the next filter if possible.
+ *   @param raw - set if the record holds the block raw.
+ *   @returns - the size of the record.
+ */
+static size_t readRecord(Lz4Compress *this, Byte **record, bool *raw, Error *error)
+{
+    size_t prefix = passThroughGet4(this, error);
+    if (isError(*error))
+        return 0;
+
+    *raw = (prefix & RAW_RECORD) != 0;
+    size_t size = prefix & ~RAW_RECORD;
+    if (size > this->compressedSize)
+        return ioStackError(error, "lz4 record length is too large");
+
+    return passThroughBorrowAll(this, record, size, error);
+}
+
+
+/*
+ * We are about to read a record which depends on the previous block, but we don't have it.
+ * Back up to the closest restart point and decode forward to the current record.
+ */
+static void rebuildHistory(Lz4Compress *this, Error *error)
+{
+    size_t target = this->recordNr;
+    size_t restartNr = target;
+    while (restartNr > 0 && !isRestart(this, restartNr, error))
+        restartNr--;
+
+    debug("rebuildHistory: target=%zu restartNr=%zu\n", target, restartNr);
+    this->recordNr = restartNr;
+    this->compressedPosition = getIndex(this, restartNr, error);
+    passThroughSeek(this, this->compressedPosition, error);
+
+    while (this->recordNr < target && !isError(*error))
+        lz4CompressRead(this, this->tempBuf, this->blockSize, error);
+}
+
+
 /**
  * Compress a block of data from the input buffer to the output buffer.
  * Note the output buffer must be large enough to hold Size(input) bytes.
@@ -287,13 +911,16 @@ size_t compressedSize(size_t rawSize)
 
 
 FilterInterface lz4CompressInterface = (FilterInterface) {
+    .name = "Lz4Compress",
     .fnOpen = (FilterOpen)lz4CompressOpen,
     .fnClose = (FilterClose)lz4CompressClose,
     .fnRead = (FilterRead)lz4CompressRead,
     .fnWrite = (FilterWrite)lz4CompressWrite,
     .fnSeek = (FilterSeek)lz4CompressSeek,
+    .fnSync = (FilterSync)lz4CompressSync,
     .fnBlockSize = (FilterBlockSize)lz4CompressBlockSize,
-    .fnDelete = (FilterDelete)lz4CompressDelete
+    .fnDelete = (FilterDelete)lz4CompressDelete,
+    .fnWritev = (FilterWritev)lz4CompressWritev,
 };
 
 
@@ -308,3 +935,46 @@ Lz4Compress *lz4CompressNew(size_t blockSize, void *next)
     filterInit(this, &lz4CompressInterface, next);
     return this;
 }
+
+
+/**
+ * Create a compression filter which stores its index inside the compressed file,
+ * rather than in a separate ".idx" file. The index is written as a trailer when
+ * the file is synced or closed.
+ * @param blockSize - size of individually compressed records.
+ */
+Lz4Compress *lz4CompressEmbeddedNew(size_t blockSize, void *next)
+{
+    Lz4Compress *this = lz4CompressNew(blockSize, next);
+    this->embedded = true;
+    return this;
+}
+
+
+/**
+ * Create a compression filter which links each block to the previous one, so small blocks
+ * compress better. To keep seeks reasonable, decoding starts over every restartInterval blocks,
+ * and whenever we write a block without having the previous one.
+ * @param blockSize - size of compressed records.
+ * @param restartInterval - maximum number of blocks between restart points.
+ */
+Lz4Compress *lz4CompressStreamingNew(size_t blockSize, size_t restartInterval, void *next)
+{
+    Lz4Compress *this = lz4CompressNew(blockSize, next);
+    this->restartInterval = sizeMax(restartInterval, 1);
+    return this;
+}
+
+
+/**
+ * Create a compression filter which compresses large, multi-block writes in parallel.
+ * Each block is an independent record, so the blocks can be compressed concurrently.
+ * @param blockSize - size of individually compressed records.
+ * @param nrThreads - number of compression threads.
+ */
+Lz4Compress *lz4CompressParallelNew(size_t blockSize, size_t nrThreads, void *next)
+{
+    Lz4Compress *this = lz4CompressNew(blockSize, next);
+    this->nrThreads = nrThreads;
+    return this;
+}
@@ -9,6 +9,9 @@
 typedef struct Lz4Compress Lz4Compress;
 
 Lz4Compress *lz4CompressNew(size_t bufferSize, void *next);
+Lz4Compress *lz4CompressParallelNew(size_t bufferSize, size_t nrThreads, void *next);
+Lz4Compress *lz4CompressEmbeddedNew(size_t bufferSize, void *next);
+Lz4Compress *lz4CompressStreamingNew(size_t bufferSize, size_t restartInterval, void *next);
 void Lz4CompressFree(void *this);
 
 #endif /*FILTER_LZ4_H */
@@ -0,0 +1,47 @@
+/**
+ * LZ4 as a codec for the generic compressed file filter. Each block is compressed independently,
+ * so the codec has no state.
+ */
+#include <lz4.h>
+#include "compress/codec.h"
+#include "iostack_error.h"
+
+
+static size_t lz4CodecBound(size_t plainSize)
+{
+    return LZ4_compressBound((int)plainSize);
+}
+
+
+static size_t lz4CodecCompress(void *state, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    int actual = LZ4_compress_default((char *)fromBuf, (char *)toBuf, (int)fromSize, (int)toSize);
+    if (actual <= 0)
+        return ioStackError(error, "lz4 unable to compress the buffer");
+
+    return actual;
+}
+
+
+static size_t lz4CodecDecompress(void *state, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error)
+{
+    if (isError(*error))
+        return 0;
+
+    int actual = LZ4_decompress_safe((char *)fromBuf, (char *)toBuf, (int)fromSize, (int)toSize);
+    if (actual < 0)
+        return ioStackError(error, "lz4 unable to decompress a buffer");
+
+    return actual;
+}
+
+
+CodecInterface lz4Codec = (CodecInterface) {
+    .name = "lz4",
+    .fnBound = lz4CodecBound,
+    .fnCompress = lz4CodecCompress,
+    .fnDecompress = lz4CodecDecompress,
+};
@@ -0,0 +1,151 @@
+/**
+ * Zstandard compression. The zstd filter is the generic compressed file filter (see compressed.c)
+ * using the zstd codec defined here, so it shares the file layout, the index and seeking with the other codecs.
+ *
+ * Zstandard is slower than LZ4 but compresses considerably better, which makes it a good
+ * choice for cold data which is written once and read once.
+ * The codec state holds the compression and decompression contexts, so they are configured once
+ * and reused for every block.
+ */
+//#define DEBUG
+#include <stdlib.h>
+#include <zstd.h>
+#include "common/debug.h"
+#include "compress/codec.h"
+#include "compress/compressed.h"
+#include "compress/zstd/zstd.h"
+#include "iostack_error.h"
+
+typedef struct ZstdCodecState
+{
+    ZSTD_CCtx *cctx;                  /* Compression context, with the parameters set once for every block */
+    ZSTD_DCtx *dctx;                  /* Decompression context */
+} ZstdCodecState;
+
+static bool isErrorZstd(size_t code, Error *error);
+
+
+/*
+ * Create the contexts for a file, configured with our options.
+ */
+static void *zstdCodecNew(const void *optionsVoid, Error *error)
+{
+    const ZstdOptions *options = (optionsVoid != NULL)? optionsVoid: &(ZstdOptions){0};
+    ZstdCodecState *state = malloc(sizeof(ZstdCodecState));
+    *state = (ZstdCodecState){.cctx = ZSTD_createCCtx(), .dctx = ZSTD_createDCtx()};
+    if (state->cctx == NULL || state->dctx == NULL)
+    {
+        ioStackError(error, "zstd unable to create a context");
+        return state;
+    }
+
+    /* The parameters stick to the context for every block. */
+    isErrorZstd(ZSTD_CCtx_setParameter(state->cctx, ZSTD_c_compressionLevel, options->level), error);
+    if (options->nrThreads > 0)
+        isErrorZstd(ZSTD_CCtx_setParameter(state->cctx, ZSTD_c_nbWorkers, (int)options->nrThreads), error);
+    if (options->longDistance)
+        isErrorZstd(ZSTD_CCtx_setParameter(state->cctx, ZSTD_c_enableLongDistanceMatching, 1), error);
+    if (options->dictionary != NULL)
+    {
+        isErrorZstd(ZSTD_CCtx_loadDictionary(state->cctx, options->dictionary, options->dictionarySize), error);
+        isErrorZstd(ZSTD_DCtx_loadDictionary(state->dctx, options->dictionary, options->dictionarySize), error);
+    }
+
+    return state;
+}
+
+
+static void zstdCodecFree(void *stateVoid)
+{
+    ZstdCodecState *state = stateVoid;
+    ZSTD_freeCCtx(state->cctx);
+    ZSTD_freeDCtx(state->dctx);
+    free(state);
+}
+
+
+static size_t zstdCodecBound(size_t plainSize)
+{
+    return ZSTD_compressBound(plainSize);
+}
+
+
+/*
+ * Compress a block of data into a single zstd frame.
+ * @return - the number of compressed bytes.
+ */
+static size_t zstdCodecCompress(void *stateVoid, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error)
+{
+    ZstdCodecState *state = stateVoid;
+    if (isError(*error))
+        return 0;
+
+    size_t actual = ZSTD_compress2(state->cctx, toBuf, toSize, fromBuf, fromSize);
+    if (isErrorZstd(actual, error))
+        return 0;
+
+    debug("zstdCodecCompress: fromSize=%zu actual=%zu\n", fromSize, actual);
+    return actual;
+}
+
+
+/*
+ * Decompress a zstd frame holding a block of data.
+ * @return - the number of decompressed bytes.
+ */
+static size_t zstdCodecDecompress(void *stateVoid, Byte *toBuf, size_t toSize, const Byte *fromBuf, size_t fromSize, Error *error)
+{
+    ZstdCodecState *state = stateVoid;
+    if (isError(*error))
+        return 0;
+
+    size_t actual = ZSTD_decompressDCtx(state->dctx, toBuf, toSize, fromBuf, fromSize);
+    if (isErrorZstd(actual, error))
+        return 0;
+
+    debug("zstdCodecDecompress: fromSize=%zu actual=%zu\n", fromSize, actual);
+    return actual;
+}
+
+
+/* If zstd returned an error code, convert it to one of ours. */
+static bool isErrorZstd(size_t code, Error *error)
+{
+    if (ZSTD_isError(code))
+        setError(error, (Error){.code=errorCodeIoStack, .msg=ZSTD_getErrorName(code)});
+    return isError(*error);
+}
+
+
+CodecInterface zstdCodec = (CodecInterface) {
+    .name = "zstd",
+    .fnNew = zstdCodecNew,
+    .optionsSize = sizeof(ZstdOptions),
+    .fnFree = zstdCodecFree,
+    .fnBound = zstdCodecBound,
+    .fnCompress = zstdCodecCompress,
+    .fnDecompress = zstdCodecDecompress,
+};
+
+
+/**
+ * Create a filter for writing and reading zstd compressed files.
+ * @param blockSize - size of individually compressed records.
+ * @param level - compression level, zero for zstd's default.
+ */
+ZstdCompress *zstdCompressNew(size_t blockSize, int level, void *next)
+{
+    return zstdCompressOptionsNew(blockSize, &(ZstdOptions){.level = level}, next);
+}
+
+
+/**
+ * Create a zstd compression filter with full control over the compressor.
+ * A dictionary must stay in memory as long as the filter is in use.
+ * @param blockSize - size of individually compressed records.
+ * @param options - how to compress.
+ */
+ZstdCompress *zstdCompressOptionsNew(size_t blockSize, const ZstdOptions *options, void *next)
+{
+    return compressedFilterOptionsNew("zstd", blockSize, options, next);
+}
@@ -0,0 +1,25 @@
+/* */
+/* Filter which compresses blocks with Zstandard, as the compressed file filter with the zstd codec. */
+/* */
+
+#ifndef FILTER_ZSTD_H
+#define FILTER_ZSTD_H
+#include "common/filter.h"
+#include "compress/compressed.h"
+
+typedef CompressedFilter ZstdCompress;
+
+/* Tuning for the compressor. Zeros give the defaults. */
+typedef struct ZstdOptions
+{
+    int level;                    /* Compression level, zero for zstd's default */
+    size_t nrThreads;             /* Worker threads inside the compressor, zero to compress inline */
+    bool longDistance;            /* Look for matches further back, which pays off with large blocks */
+    const Byte *dictionary;       /* Trained dictionary, needed for both writing and reading */
+    size_t dictionarySize;
+} ZstdOptions;
+
+ZstdCompress *zstdCompressNew(size_t blockSize, int level, void *next);
+ZstdCompress *zstdCompressOptionsNew(size_t blockSize, const ZstdOptions *options, void *next);
+
+#endif /*FILTER_ZSTD_H */
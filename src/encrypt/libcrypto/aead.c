@@ -18,22 +18,30 @@
 #include "common/filter.h"
 #include "common/passThrough.h"
 #include "common/packed.h"
+#include "common/threadPool.h"
 
 /* Forward references */
 static const Error errorBadKeyLen = (Error){.code=errorCodeIoStack, .msg="Unexpected Key or IV length."};
 static const Error errorBadDecryption = (Error) {.code=errorCodeIoStack, .msg="Unable to decrypt current buffer"};
 static size_t openSSLError(Error *error);
 void generateNonce(Byte *nonce, Byte *iv, size_t ivSize, size_t seqNr);
-size_t aead_encrypt(AeadFilter *this, const Byte *plainText, size_t plainSize, Byte *header,
-                  size_t headerSize, Byte *cipherText, size_t cipherSize,Byte *tag, Error *error);
+size_t aead_encrypt(AeadFilter *this, EVP_CIPHER_CTX *ctx, size_t blockNr, const Byte *plainText, size_t plainSize,
+                    Byte *header, size_t headerSize, Byte *cipherText, size_t cipherSize, Byte *tag, Error *error);
 size_t aead_decrypt(AeadFilter *this, Byte *plainText, size_t plainSize, Byte *header,
                   size_t headerSize, Byte *cipherText, size_t cipherSize, Byte *tag, Error *error);
 void aeadCipherSetup(AeadFilter *this, char *cipherName, Error *error);
+static EVP_CIPHER_CTX *aeadContextNew(AeadFilter *this, Error *error);
+static const char *aeadAutoCipher(void);
 void aeadConfigure(AeadFilter *this, Error *error);
 void aeadHeaderRead(AeadFilter *this, Error *error);
 void aeadHeaderWrite(AeadFilter *this, Error *error);
 size_t paddingSize(AeadFilter *this, size_t blockSize);
 off_t aeadFilterSeek(AeadFilter *this, off_t position, Error *error);
+static size_t aeadParallelWrite(AeadFilter *this, const Byte *buf, size_t size, Error *error);
+size_t aeadFilterWritev(AeadFilter *this, const struct iovec *iov, size_t iovCnt, Error *error);
+static size_t aeadEncryptRecord(AeadFilter *this, const Byte *plainText, size_t plainSize, Byte *record, Error *error);
+static size_t aeadReadRecord(AeadFilter *this, Byte *buf, size_t size, bool positional, off_t cipherPosition, Error *error);
+static bool aeadEndExpected(AeadFilter *this);
 
 /**
  * Converter structure for encrypting and decrypting TLS Blocks.
@@ -41,6 +49,22 @@ off_t aeadFilterSeek(AeadFilter *this, off_t position, Error *error);
 #define MAX_CIPHER_NAME 64
 #define MAX_AEAD_HEADER_SIZE 1024
 #define HEADER_SEQUENCE_NUMBER ((size_t)-1)
+#define BLOCKS_PER_THREAD 8
+#define BLOCKS_PER_VECTOR 16
+
+/* A run of consecutive blocks being encrypted by one worker thread. */
+typedef struct AeadJob
+{
+    Task task;                   /* The background task doing the encryption */
+    AeadFilter *owner;           /* The filter we are encrypting for */
+    EVP_CIPHER_CTX *ctx;         /* Cipher context belonging to this job */
+    const Byte *plainText;       /* The first plaintext block */
+    Byte *cipherText;            /* Where to place the first encrypted record */
+    size_t blockNr;              /* Sequence number of the first block */
+    size_t nrBlocks;             /* Number of blocks to encrypt */
+    Error error;                 /* Error status of the encryption */
+} AeadJob;
+
 struct AeadFilter
 {
     Filter filter;
@@ -58,7 +82,7 @@ struct AeadFilter
     bool hasPadding;             /* Whether cipher block padding is added to the encrypted blocks */
     Byte iv[EVP_MAX_IV_LENGTH];  /* The initialization vector for the sequence of blocks. */
     EVP_CIPHER *cipher;          /* The libcrypto cipher structure */
-    EVP_CIPHER_CTX *ctx;         /* libcrypto context. */
+    EVP_CIPHER_CTX *ctx;         /* libcrypto context, keyed once so each block only sets its nonce. */
 
     /* Our state */
     size_t headerSize;            /* Size of the header we read/wrote to the encrypted file */
@@ -75,6 +99,14 @@ struct AeadFilter
     off_t maxWritePosition;       /* Biggest position after writing */
 
     Byte *plainBuf;                /* A buffer to temporarily hold a decrypted block */
+    Byte *vecBuf;                  /* Buffer to gather encrypted records from a vectored write */
+
+    /* Parallel encryption of multi-block writes */
+    size_t nrThreads;             /* Number of encryption threads. Zero if encrypting inline. */
+    ThreadPool *workers;          /* Threads which encrypt blocks in parallel */
+    AeadJob *jobs;                /* One job, with its own cipher context, per thread */
+    Byte *batchBuf;               /* Buffer holding a batch of encrypted records */
+    size_t batchBlocks;           /* Max number of blocks in a batch */
 };
 
 
@@ -93,7 +125,10 @@ AeadFilter *aeadFilterOpen(AeadFilter *pipe, const char *path, int oflags, int m
 
     /* Open the downstream file and clone ourselves */
     Filter *next = passThroughOpen(pipe, path, oflags, mode, error);
-    AeadFilter *this = aeadFilterNew(pipe->cipherName, pipe->plainSize, pipe->key, pipe->keySize, next);
+    AeadFilter *this = aeadFilterParallelNew(pipe->cipherName, pipe->plainSize, pipe->key, pipe->keySize, pipe->nrThreads, next);
+    this->workers = NULL;
+    this->jobs = NULL;
+    this->batchBuf = NULL;
     if (isError(*error))
         return this;
 
@@ -114,6 +149,11 @@ AeadFilter *aeadFilterOpen(AeadFilter *pipe, const char *path, int oflags, int m
     this->position = 0;
     this->cipherBuf = NULL;
     this->plainBuf = NULL;
+    this->vecBuf = NULL;
+
+    /* If encrypting in parallel, start the worker threads. */
+    if (this->nrThreads > 0 && this->writable)
+        this->workers = threadPoolNew(this->nrThreads);
 
     return this;
 }
@@ -126,18 +166,68 @@ size_t aeadFilterRead(AeadFilter *this, Byte *buf, size_t size, Error *error)
 {
     debug("aeadFilterRead: size=%zu  position=%llu maxWrite=%llu maxRead=%llu fileSize=%lld\n",
           size, this->position, this->maxWritePosition, this->maxReadPosition, (off_t)this->fileSize);
-    /* Read a block of downstream encrypted text into our buffer. */
-    size_t actual = passThroughReadAll(this, this->cipherBuf, this->encryptSize, error);
+    return aeadReadRecord(this, buf, size, false, 0, error);
+}
+
+
+/**
+ * Read the encrypted record at a block boundary, without seeking the downstream file.
+ */
+size_t aeadFilterPread(AeadFilter *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    debug("aeadFilterPread: size=%zu  offset=%lld\n", size, offset);
     if (isError(*error))
         return 0;
 
-    /* Extract the tag from the end of our buffer. */
-    Byte tag[EVP_MAX_MD_SIZE];
+    /* Reading just past a partial final block is EOF. */
+    if (offset % this->plainSize != 0 && offset == this->fileSize)
+        return setError(error, errorEOF);
+
+    /* Verify we are reading at a block boundary */
+    if (offset % this->plainSize != 0)
+        return ioStackError(error, "Must read at a block boundary");
+
+    /* Position ourselves at the block, as though we had seeked there. */
+    this->blockNr = offset / this->plainSize;
+    this->position = offset;
+
+    return aeadReadRecord(this, buf, size, true, this->headerSize + this->blockNr * this->encryptSize, error);
+}
+
+
+/*
+ * Read and decrypt the current record, either sequentially or from an explicit position in the encrypted file.
+ */
+static size_t aeadReadRecord(AeadFilter *this, Byte *buf, size_t size, bool positional, off_t cipherPosition, Error *error)
+{
+    /* Get a block of downstream encrypted text, borrowing it from the next filter when reading sequentially. */
+    Byte *record = this->cipherBuf;
+    size_t actual = (positional)
+        ? passThroughPreadAll(this, record, this->encryptSize, cipherPosition, error)
+        : passThroughBorrowAll(this, &record, this->encryptSize, error);
+
+    /*
+     * A complete file ends with a partial (possibly empty) record, so running out of records at a block boundary
+     * means the final record is missing. The exception is a file we are writing, whose final record comes when we close.
+     */
+    if (errorIsEOF(*error) && !aeadEndExpected(this))
+        return ioStackError(error, "Encrypted file truncated - missing final record");
+    if (isError(*error))
+        return 0;
+    if (actual < this->tagSize)
+    {
+        if (record != this->cipherBuf)
+            passThroughReturn(this, record, error);
+        return ioStackError(error, "Encrypted file truncated - final record is incomplete");
+    }
+
+    /* Decrypt the ciphertext, taking the tag from the end of the record. */
     size_t cipherTextSize = actual - this->tagSize;
-    memcpy(tag, this->cipherBuf + cipherTextSize, this->tagSize);
+    size_t plainSize = aead_decrypt(this, buf, size, NULL, 0, record, cipherTextSize, record + cipherTextSize, error);
 
-    /* Decrypt the ciphertext from our buffer. */
-    size_t plainSize = aead_decrypt(this, buf, size, NULL, 0, this->cipherBuf, cipherTextSize, tag, error);
+    /* Give back the record if we borrowed it. */
+    if (record != this->cipherBuf)
+        passThroughReturn(this, record, error);
     if (isError(*error))
         return 0;
 
@@ -150,7 +240,10 @@ size_t aeadFilterRead(AeadFilter *this, Byte *buf, size_t size, Error *error)
     /* If partial block, probe to make sure the file is really EOF. */
     if (plainSize < this->plainSize)
     {
-        passThroughRead(this, this->cipherBuf, 1, error);
+        if (positional)
+            passThroughPread(this, this->cipherBuf, 1, cipherPosition + actual, error);
+        else
+            passThroughRead(this, this->cipherBuf, 1, error);
         if (!errorIsEOF(*error))
             return ioStackError(error, "Encrypted file has extra data appended.");
         *error = errorOK;
@@ -171,6 +264,16 @@ size_t aeadFilterRead(AeadFilter *this, Byte *buf, size_t size, Error *error)
     return plainSize;
 }
 
+/*
+ * Are we at a known end of file which doesn't have its final record yet?
+ * That happens when we wrote up to here, or when we know the file ends here, and the final record will be added on close.
+ */
+static bool aeadEndExpected(AeadFilter *this)
+{
+    return (this->fileSize != FILE_END_POSITION && this->position >= this->fileSize)
+        || (this->maxWritePosition > 0 && this->position >= this->maxWritePosition);
+}
+
 /**
  * Encrypt data into our internal buffer and write to the output file.
  *   @param buf - data to be converted.
@@ -185,28 +288,196 @@ size_t aeadFilterWrite(AeadFilter *this, const Byte *buf, size_t size, Error *er
     if (isError(*error))
         return 0;
 
+    /* If writing several blocks, encrypt them as a vector, which does them in parallel or at least as a batch. */
+    if (size >= 2 * this->plainSize)
+        return aeadFilterWritev(this, &(struct iovec){.iov_base = (void *)buf, .iov_len = size}, 1, error);
+
     /* Encrypt one record of data into our buffer */
-    Byte tag[EVP_MAX_MD_SIZE];
     size_t plainSize = sizeMin(size, this->plainSize);
-    size_t cipherSize = aead_encrypt(this, buf, plainSize, NULL, 0, this->cipherBuf, this->encryptSize - this->tagSize, tag, error);
-
-    /* Append the tag to the encrypted data */
-    memcpy(this->cipherBuf + cipherSize, tag, this->tagSize);
-    cipherSize += this->tagSize;
+    size_t cipherSize = aeadEncryptRecord(this, buf, plainSize, this->cipherBuf, error);
 
     /* Write the encrypted block out */
     passThroughWriteAll(this, this->cipherBuf, cipherSize, error);
 
-    /* Track our position for EOF handling */
-    this->position += plainSize;
-    this->maxWritePosition = sizeMax(this->maxWritePosition, this->position);
-
     /* Partial write indicates EOF - is it true? */
     /* TODO: verify partial write is at end of file */
 
+    return plainSize;
+}
+
+
+/**
+ * Encrypt a vector of blocks, gathering the encrypted records so they are written
+ * in a few large requests rather than one request per record.
+ */
+size_t aeadFilterWritev(AeadFilter *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    debug("aeadFilterWritev: iovCnt=%zu  position=%llu\n", iovCnt, this->position);
+    size_t totalSize = 0;
+    size_t vecActual = 0;
+    for (size_t idx = 0; idx < iovCnt && !isError(*error); idx++)
+    {
+        const Byte *buf = iov[idx].iov_base;
+        size_t size = iov[idx].iov_len;
+        while (size > 0 && !isError(*error))
+        {
+            size_t actual;
+
+            /* Large runs of blocks are encrypted in parallel if we can, after writing what we've gathered so far. */
+            if (this->workers != NULL && size >= 2 * this->plainSize)
+            {
+                if (vecActual > 0)
+                    passThroughWriteAll(this, this->vecBuf, vecActual, error);
+                vecActual = 0;
+                actual = aeadParallelWrite(this, buf, size, error);
+            }
+
+            /* Otherwise, encrypt the next record into our gather buffer, writing it out when full. */
+            else
+            {
+                actual = sizeMin(size, this->plainSize);
+                vecActual += aeadEncryptRecord(this, buf, actual, this->vecBuf + vecActual, error);
+                if (vecActual + this->encryptSize > BLOCKS_PER_VECTOR * this->encryptSize)
+                {
+                    passThroughWriteAll(this, this->vecBuf, vecActual, error);
+                    vecActual = 0;
+                }
+            }
+
+            buf += actual;
+            size -= actual;
+            totalSize += actual;
+        }
+    }
+
+    /* Write out whatever is left over. */
+    if (vecActual > 0)
+        passThroughWriteAll(this, this->vecBuf, vecActual, error);
+
+    if (isError(*error))
+        return 0;
+    return totalSize;
+}
+
+
+/**
+ * Encrypt one record and write it at a block boundary, without seeking the downstream file.
+ */
+size_t aeadFilterPwrite(AeadFilter *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    debug("aeadFilterPwrite: size=%zu  offset=%lld\n", size, offset);
+    if (isError(*error))
+        return 0;
+
+    /* Verify we are writing at a block boundary */
+    if (offset % this->plainSize != 0)
+        return ioStackError(error, "Must write at a block boundary");
+
+    /* Position ourselves at the block, as though we had seeked there. */
+    this->blockNr = offset / this->plainSize;
+    this->position = offset;
+    off_t cipherPosition = this->headerSize + this->blockNr * this->encryptSize;
+
+    /* Encrypt one record of data into our buffer and write it out */
+    size_t plainSize = sizeMin(size, this->plainSize);
+    size_t cipherSize = aeadEncryptRecord(this, buf, plainSize, this->cipherBuf, error);
+    passThroughPwriteAll(this, this->cipherBuf, cipherSize, cipherPosition, error);
+
+    if (isError(*error))
+        return 0;
+    return plainSize;
+}
+
+
+/*
+ * Encrypt one record, placing the tag after the ciphertext, and advance to the next block.
+ *   @returns - the size of the encrypted record, including the tag.
+ */
+static size_t aeadEncryptRecord(AeadFilter *this, const Byte *plainText, size_t plainSize, Byte *record, Error *error)
+{
+    /* Encrypt the record, placing the tag directly after the ciphertext. */
+    size_t expectedSize = plainSize + paddingSize(this, plainSize);
+    size_t cipherSize = aead_encrypt(this, this->ctx, this->blockNr, plainText, plainSize, NULL, 0,
+                                     record, this->encryptSize - this->tagSize, record + expectedSize, error);
+    if (isError(*error))
+        return 0;
+    if (cipherSize != expectedSize)
+        return ioStackError(error, "Unexpected size of encrypted record");
+    cipherSize += this->tagSize;
+
+    /* Track our position and the file size for EOF handling */
+    this->position += plainSize;
+    this->maxWritePosition = sizeMax(this->maxWritePosition, this->position);
+    if (this->fileSize != FILE_END_POSITION)
+        this->fileSize = sizeMax(this->fileSize, this->position);
+
     /* We have just advanced to the next block. */
     this->blockNr++;
 
+    return cipherSize;
+}
+
+
+/* Background task which encrypts a run of full blocks, placing each tag after its ciphertext. */
+static void aeadEncryptTask(void *arg)
+{
+    AeadJob *job = arg;
+    AeadFilter *this = job->owner;
+
+    for (size_t idx = 0; idx < job->nrBlocks && !isError(job->error); idx++)
+    {
+        Byte *record = job->cipherText + idx * this->encryptSize;
+        size_t cipherSize = this->encryptSize - this->tagSize;
+        aead_encrypt(this, job->ctx, job->blockNr + idx, job->plainText + idx * this->plainSize, this->plainSize,
+                     NULL, 0, record, cipherSize, record + cipherSize, &job->error);
+    }
+}
+
+/*
+ * Encrypt a batch of full blocks in parallel, one run of blocks per thread,
+ * and write the encrypted records out in a single request.
+ *   @returns - number of plaintext bytes consumed, always a multiple of the block size.
+ */
+static size_t aeadParallelWrite(AeadFilter *this, const Byte *buf, size_t size, Error *error)
+{
+    /* Split the batch of blocks evenly between the threads. */
+    size_t nrBlocks = sizeMin(size / this->plainSize, this->batchBlocks);
+    size_t perJob = (nrBlocks + this->nrThreads - 1) / this->nrThreads;
+
+    /* Start a job for each run of blocks. */
+    size_t nrJobs = 0;
+    for (size_t first = 0; first < nrBlocks; first += perJob, nrJobs++)
+    {
+        AeadJob *job = &this->jobs[nrJobs];
+        job->owner = this;
+        job->plainText = buf + first * this->plainSize;
+        job->cipherText = this->batchBuf + first * this->encryptSize;
+        job->blockNr = this->blockNr + first;
+        job->nrBlocks = sizeMin(perJob, nrBlocks - first);
+        job->error = errorOK;
+        threadPoolSubmit(this->workers, &job->task, aeadEncryptTask, job);
+    }
+
+    /* Wait for all of them to finish, collecting errors. */
+    for (size_t idx = 0; idx < nrJobs; idx++)
+    {
+        threadPoolWait(this->workers, &this->jobs[idx].task);
+        setError(error, this->jobs[idx].error);
+    }
+    if (isError(*error))
+        return 0;
+
+    /* Write the encrypted records out, in order. */
+    passThroughWriteAll(this, this->batchBuf, nrBlocks * this->encryptSize, error);
+
+    /* Track our position and the file size for EOF handling */
+    size_t plainSize = nrBlocks * this->plainSize;
+    this->position += plainSize;
+    this->maxWritePosition = sizeMax(this->maxWritePosition, this->position);
+    if (this->fileSize != FILE_END_POSITION)
+        this->fileSize = sizeMax(this->fileSize, this->position);
+    this->blockNr += nrBlocks;
+
     return plainSize;
 }
 
@@ -231,6 +502,10 @@ void aeadFilterClose(AeadFilter *this, Error *error)
     else if (this->fileSize != FILE_END_POSITION && this->fileSize > this->maxWritePosition)
         ;
 
+    /* CASE: YES. We wrote the end of the file, and it was a full block. No need to look at the file. */
+    else if (this->fileSize != FILE_END_POSITION && this->maxWritePosition > 0)
+        aeadFilterPwrite(this, NULL, 0, this->maxWritePosition, error);
+
     else
     {
         /* CASE: NO. downstream file size is bigger than our highest write. (PADDING PROBLEMS!)*/
@@ -239,9 +514,9 @@ void aeadFilterClose(AeadFilter *this, Error *error)
         if (actualSize > expectedSize)
             ;
 
-        /* OTHERWISE: YES. Add an empty block to the end. (Final record is full, since partials processed earlier) */
+        /* OTHERWISE: YES. Add an empty block after our last write. (Final record is full, since partials processed earlier) */
         else
-            aeadFilterWrite(this, NULL, 0, error);
+            aeadFilterPwrite(this, NULL, 0, this->maxWritePosition, error);
     }
 
     /* Notify the downstream file it must close as well. */
@@ -252,10 +527,22 @@ void aeadFilterClose(AeadFilter *this, Error *error)
         free(this->cipherBuf);
     if (this->plainBuf != NULL)
         free(this->plainBuf);
+    if (this->vecBuf != NULL)
+        free(this->vecBuf);
     if (this->ctx != NULL)
         EVP_CIPHER_CTX_free(this->ctx);
     if (this->cipher != NULL)
         EVP_CIPHER_free(this->cipher);
+    if (this->workers != NULL)
+        threadPoolFree(this->workers);
+    if (this->jobs != NULL)
+    {
+        for (size_t idx = 0; idx < this->nrThreads; idx++)
+            EVP_CIPHER_CTX_free(this->jobs[idx].ctx);
+        free(this->jobs);
+    }
+    if (this->batchBuf != NULL)
+        free(this->batchBuf);
     free(this);
 }
 
@@ -273,28 +560,64 @@ off_t aeadFilterSeek(AeadFilter *this, off_t plainPosition, Error *error)
     /* If seeking to the end, ... */
     if (plainPosition == FILE_END_POSITION)
     {
-        /* Get the file size */
-        size_t cipherSize = passThroughSeek(this, FILE_END_POSITION, error);
-        size_t dataSize = cipherSize - this->headerSize;
-        if (dataSize == 0)
-            return ioStackError(error, "Encrypted file truncated - missing final record");
+        /* If we already know the file size, because we created the file or found its size earlier, we don't need to look. */
+        if (this->fileSize != FILE_END_POSITION)
+        {
+            this->blockNr = this->fileSize / this->plainSize;
+            partialSize = this->fileSize % this->plainSize;
+        }
 
-        /* Position self at beginning of last record */
-        if (dataSize % this->plainSize == 0)
-            dataSize = dataSize - this->encryptSize;
-        dataSize = sizeRoundDown(dataSize, this->encryptSize);
-        passThroughSeek(this, this->headerSize + dataSize, error);
-
-        /* update our plaintext position. */
-        this->blockNr = dataSize / this->encryptSize;
-        this->position = this->blockNr * this->plainSize;
-
-        /* Read and decrypt the last record. Because of possible padding, we need to decrypt to determine size. */
-        partialSize = aeadFilterRead(this, this->plainBuf, this->plainSize, error);
-
-        /* If the last record was size 0, then we just got an EOF.  Ignore it. */
-        if (errorIsEOF(*error))
-            *error = errorOK;
+        else
+        {
+            /* Get the file size. Anything short of a header and a final record means the file was truncated. */
+            off_t cipherSize = passThroughSeek(this, FILE_END_POSITION, error);
+            if (isError(*error))
+                return 0;
+            if (cipherSize <= (off_t)this->headerSize)
+                return ioStackError(error, "Encrypted file truncated - missing final record");
+            size_t dataSize = cipherSize - this->headerSize;
+
+            /*
+             * Without padding, the final (partial) record is its plaintext plus a tag, so we know its size without decrypting.
+             * If the file ends with a full record, we are still writing it and the final record comes on close, so it's as though it were empty.
+             */
+            if (!this->hasPadding)
+            {
+                size_t finalSize = dataSize % this->encryptSize;
+                if (finalSize > 0 && finalSize < this->tagSize)
+                    return ioStackError(error, "Encrypted file truncated - final record is incomplete");
+                this->blockNr = dataSize / this->encryptSize;
+
+                /* Ending on a full record is only expected if we wrote that far ourselves. Otherwise the final record was lost. */
+                if (finalSize == 0 && this->maxWritePosition < (off_t)(this->blockNr * this->plainSize))
+                    return ioStackError(error, "Encrypted file truncated - missing final record");
+                partialSize = (finalSize == 0)? 0: finalSize - this->tagSize;
+
+                /* Track the file size for EOF handling, as though we had read the final record. */
+                this->fileSize = this->blockNr * this->plainSize + partialSize;
+                this->maxReadPosition = sizeMax(this->maxReadPosition, this->fileSize);
+            }
+
+            else
+            {
+                /* Position self at beginning of last record */
+                if (dataSize % this->plainSize == 0)
+                    dataSize = dataSize - this->encryptSize;
+                dataSize = sizeRoundDown(dataSize, this->encryptSize);
+                passThroughSeek(this, this->headerSize + dataSize, error);
+
+                /* update our plaintext position. */
+                this->blockNr = dataSize / this->encryptSize;
+                this->position = this->blockNr * this->plainSize;
+
+                /* Read and decrypt the last record. Because of padding, we need to decrypt to determine size. */
+                partialSize = aeadFilterRead(this, this->plainBuf, this->plainSize, error);
+
+                /* If the last record was size 0, then we just got an EOF.  Ignore it. */
+                if (errorIsEOF(*error))
+                    *error = errorOK;
+            }
+        }
 
         /* Now we know the position we really want - end of last full block. */
         /*  and we know the size of the last partial block */
@@ -333,6 +656,17 @@ size_t aeadFilterBlockSize(AeadFilter *this, size_t plainSize, Error *error)
     /* Allocate buffers to hold records of encrypted/decrypted data. */
     this->cipherBuf = malloc(this->encryptSize);
     this->plainBuf = malloc(this->plainSize); /* Big enough to hold header */
+    this->vecBuf = malloc(BLOCKS_PER_VECTOR * this->encryptSize);
+
+    /* If encrypting in parallel, allocate a batch buffer and a cipher context for each thread. */
+    if (this->workers != NULL)
+    {
+        this->batchBlocks = this->nrThreads * BLOCKS_PER_THREAD;
+        this->batchBuf = malloc(this->batchBlocks * this->encryptSize);
+        this->jobs = malloc(this->nrThreads * sizeof(AeadJob));
+        for (size_t idx = 0; idx < this->nrThreads; idx++)
+            this->jobs[idx].ctx = aeadContextNew(this, error);
+    }
 
     /* Tell the previous stage they must accommodate our plaintext block size. */
     return this->plainSize;
@@ -342,14 +676,23 @@ size_t aeadFilterBlockSize(AeadFilter *this, size_t plainSize, Error *error)
  * Abstract interface for the encryption filter.
  */
 FilterInterface aeadFilterInterface = {
+        .name = "AeadFilter",
         .fnOpen = (FilterOpen) aeadFilterOpen,
         .fnRead = (FilterRead) aeadFilterRead,
         .fnWrite = (FilterWrite)aeadFilterWrite,
         .fnClose = (FilterClose) aeadFilterClose,
         .fnSeek = (FilterSeek) aeadFilterSeek,
         .fnBlockSize = (FilterBlockSize) aeadFilterBlockSize,
+        .fnWritev = (FilterWritev) aeadFilterWritev,
+        .fnPread = (FilterPread) aeadFilterPread,
+        .fnPwrite = (FilterPwrite) aeadFilterPwrite,
 };
 
+/**
+ * Create an encryption filter.
+ *   @param cipherName - libcrypto name of the cipher for new files, say "AES-256-GCM" or "ChaCha20-Poly1305",
+ *                       or "auto" to pick whichever is faster on this CPU.
+ */
 AeadFilter *aeadFilterNew(char *cipherName, size_t recordSize, Byte *key, size_t keySize, void *next)
 {
     AeadFilter *this = malloc(sizeof(AeadFilter));
@@ -362,11 +705,25 @@ AeadFilter *aeadFilterNew(char *cipherName, size_t recordSize, Byte *key, size_t
     /* Save defaults for creating a new file. Otherwise, we'll read them from file header. */
     strlcpy(this->cipherName, cipherName, sizeof(this->cipherName));
     this->plainSize = recordSize;
+    this->nrThreads = 0;
 
     return filterInit(this, &aeadFilterInterface, next);
 }
 
 
+/**
+ * Create an encryption filter which encrypts large, multi-block writes in parallel.
+ * Each block has its own nonce, so the blocks can be encrypted independently.
+ *   @param nrThreads - number of encryption threads.
+ */
+AeadFilter *aeadFilterParallelNew(char *cipherName, size_t recordSize, Byte *key, size_t keySize, size_t nrThreads, void *next)
+{
+    AeadFilter *this = aeadFilterNew(cipherName, recordSize, key, keySize, next);
+    this->nrThreads = nrThreads;
+    return this;
+}
+
+
 /*
  * Configure encryption, whether creating or reading.
  */
@@ -378,11 +735,12 @@ void aeadConfigure(AeadFilter *this,  Error *error)
     /* Try to read an existing header */
     aeadHeaderRead(this, error);
 
-    /* If empty file, then try to write a new header */
+    /* If empty file, then try to write a new header. The new file is empty, so we know its size. */
     if (this->writable && errorIsEOF(*error))
     {
         *error = errorOK;
         aeadHeaderWrite(this, error);
+        this->fileSize = 0;
     }
     else if (isError(*error))
 		ioStackError(error, "AEAD encryption can't read header");
@@ -455,7 +813,7 @@ void aeadHeaderRead(AeadFilter *this, Error *error)
 
     /* Validate the header after removing the empty block and tag. */
     Byte plainEmpty[0];
-    size_t validateSize = this->headerSize - this->tagSize - 1 - emptySize - 1;
+    size_t validateSize = headerSize - this->tagSize - 1 - emptySize - 1;
     aead_decrypt(this, plainEmpty, sizeof(plainEmpty),
          header, validateSize, emptyBlock, emptySize, tag, error);
 
@@ -498,7 +856,7 @@ void aeadHeaderWrite(AeadFilter *this, Error *error)
     Byte emptyCiphertext[EVP_MAX_BLOCK_LENGTH];
     Byte emptyPlaintext[0];
     Byte tag[EVP_MAX_MD_SIZE];
-    size_t emptyCipherSize = aead_encrypt(this, emptyPlaintext, 0, header, end-header,
+    size_t emptyCipherSize = aead_encrypt(this, this->ctx, this->blockNr, emptyPlaintext, 0, header, bp-header,
                                           emptyCiphertext, sizeof(emptyCiphertext), tag, error);
     if (emptyCipherSize != paddingSize(this, 0) || emptyCipherSize > 256)
         return (void) ioStackError(error, "Size of cipher padding for empty record was miscalculated");
@@ -531,8 +889,9 @@ void aeadCipherSetup(AeadFilter *this, char *cipherName, Error *error)
     if (this->cipherName != cipherName) /* comparing pointers */
         strlcpy(this->cipherName, cipherName, sizeof(this->cipherName));
 
-    /* Create an OpenSSL cipher context. */
-    this->ctx = EVP_CIPHER_CTX_new();
+    /* "auto" picks a cipher for this machine. The file header records the cipher we actually use. */
+    if (strcmp(this->cipherName, "auto") == 0)
+        strlcpy(this->cipherName, aeadAutoCipher(), sizeof(this->cipherName));
 
     /* Lookup cipher by name. */
     this->cipher = EVP_CIPHER_fetch(NULL, this->cipherName, NULL);
@@ -547,8 +906,41 @@ void aeadCipherSetup(AeadFilter *this, char *cipherName, Error *error)
     if (this->keySize != EVP_CIPHER_key_length(this->cipher))
         return (void) ioStackError(error, "Cipher key is the wrong size");
     this->cipherBlockSize = EVP_CIPHER_block_size(this->cipher);
-    this->hasPadding = (this->cipherBlockSize != 1);
+    /* AEAD modes like GCM, OCB and ChaCha20-Poly1305 are stream modes, so their records aren't padded. */
+    bool isAead = (EVP_CIPHER_get_flags(this->cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) != 0;
+    this->hasPadding = (this->cipherBlockSize != 1 && !isAead);
     this->tagSize = 16;  /* TODO: EVP_CIPHER_CTX_get_tag_length(this->ctx); But only after initialized. */
+
+    /* Create an OpenSSL cipher context. */
+    this->ctx = aeadContextNew(this, error);
+}
+
+
+/*
+ * Choose the faster cipher for this CPU. AES-GCM is fastest with AES-NI and carry-less multiply,
+ * but without them, software AES is several times slower than ChaCha20-Poly1305.
+ * Both take a 32 byte key.
+ */
+static const char *aeadAutoCipher(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("pclmul"))
+        return "ChaCha20-Poly1305";
+#endif
+    return "AES-256-GCM";
+}
+
+
+/*
+ * Create a cipher context holding our key. Expanding the key (and for GCM, building the GHASH tables)
+ * is done once here, so encrypting or decrypting a block only has to set the nonce.
+ */
+static EVP_CIPHER_CTX *aeadContextNew(AeadFilter *this, Error *error)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!EVP_CipherInit_ex2(ctx, this->cipher, this->key, NULL, 1, NULL))
+        openSSLError(error);
+    return ctx;
 }
 
 
@@ -566,6 +958,8 @@ size_t paddingSize(AeadFilter *this, size_t recordSize)
 /*
  * Encrypt one record of plain text, generating one (slightly larger) record of cipher text.
  *  @param this - aaed converter
+ *  @param ctx - the cipher context, so multiple threads can encrypt at once.
+ *  @param blockNr - the sequence number of the record, used to generate the nonce.
  *  @param plainText - the text to be encrypted.
  *  @param plainSize - size of the text to be encrypted
  *  @param header - text to be authenticated but not encrypted.
@@ -577,7 +971,7 @@ size_t paddingSize(AeadFilter *this, size_t recordSize)
  *  @return - the actual size of the encrypted ciphertext.
  */
 size_t
-aead_encrypt(AeadFilter *this,
+aead_encrypt(AeadFilter *this, EVP_CIPHER_CTX *ctx, size_t blockNr,
              const Byte *plainText, size_t plainSize,
              Byte *header, size_t headerSize,
              Byte *cipherText, size_t cipherSize,
@@ -587,24 +981,21 @@ aead_encrypt(AeadFilter *this,
     //debug("Encrypt: plainText='%.*s' plainSize=%zu  cipher=%s\n", (int)sizeMin(plainSize,64), plainText, plainSize, this->cipherName);
     debug("Encrypt: plainSize=%zu  cipher=%s plainText='%.*s'\n",
           plainSize, this->cipherName, (int)plainSize, plainText);
-    /* Reinitialize the encryption context to start a new record */
-    EVP_CIPHER_CTX_reset(this->ctx);
-
     /* Generate nonce by XOR'ing the initialization vector with the sequence number */
     Byte nonce[EVP_MAX_IV_LENGTH];
-    generateNonce(nonce, this->iv, this->ivSize, this->blockNr);
+    generateNonce(nonce, this->iv, this->ivSize, blockNr);
     debug("Encrypt: iv=%s  blockNr=%zu  nonce=%s  key=%s\n",
-          asHex(this->iv, this->ivSize), this->blockNr, asHex(nonce, this->ivSize), asHex(this->key, this->keySize));
+          asHex(this->iv, this->ivSize), blockNr, asHex(nonce, this->ivSize), asHex(this->key, this->keySize));
 
-    /* Configure the cipher with the key and nonce */
-    if (!EVP_CipherInit_ex2(this->ctx, this->cipher, this->key, nonce, 1, NULL))
+    /* Start a new record by setting the nonce. The context already holds the key. */
+    if (!EVP_CipherInit_ex2(ctx, NULL, NULL, nonce, 1, NULL))
         return openSSLError(error);
 
     /* Include the header, if any, in the digest */
     if (headerSize > 0)
     {
         int zero = 0;
-        if (!EVP_CipherUpdate(this->ctx, NULL, &zero, header, (int)headerSize))
+        if (!EVP_CipherUpdate(ctx, NULL, &zero, header, (int)headerSize))
             return openSSLError(error);
     }
 
@@ -613,17 +1004,17 @@ aead_encrypt(AeadFilter *this,
     if (plainSize > 0)
     {
         cipherUpdateSize = (int)cipherSize;
-        if (!EVP_CipherUpdate(this->ctx, (Byte *)cipherText, &cipherUpdateSize, plainText, (int)plainSize))
+        if (!EVP_CipherUpdate(ctx, (Byte *)cipherText, &cipherUpdateSize, plainText, (int)plainSize))
             return openSSLError(error);
     }
 
     /* Finalise the plaintext encryption. This can generate data, usually padding, even if there is no plain text. */
     int cipherFinalSize = (int)cipherSize - cipherUpdateSize;
-    if (!EVP_CipherFinal_ex(this->ctx, (Byte *)cipherText + cipherUpdateSize, &cipherFinalSize))
+    if (!EVP_CipherFinal_ex(ctx, (Byte *)cipherText + cipherUpdateSize, &cipherFinalSize))
         return openSSLError(error);
 
     /* Get the authentication tag  */
-    if (!EVP_CIPHER_CTX_ctrl(this->ctx, EVP_CTRL_AEAD_GET_TAG, (int)this->tagSize, tag))
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, (int)this->tagSize, tag))
         return openSSLError(error);
 
     debug("Encrypt: tag=%s encryptSize=%d cipherText=%.128s \n", asHex(tag, this->tagSize), cipherUpdateSize+cipherFinalSize, asHex(cipherText, cipherUpdateSize + cipherFinalSize));
@@ -652,17 +1043,14 @@ aead_decrypt(AeadFilter *this,
              Byte *tag, Error *error)
 {
     debug("Decrypt:  encryptSize=%zu  cipher=%s  cipherText=%.128s \n", cipherSize, this->cipherName,  asHex(cipherText, cipherSize));
-    /* Reinitialize the encryption context to start a new record */
-    EVP_CIPHER_CTX_reset(this->ctx);
-
     /* Generate nonce by XOR'ing the initialization vector with the sequence number */
     Byte nonce[EVP_MAX_IV_LENGTH];
     generateNonce(nonce, this->iv, this->ivSize, this->blockNr);
     debug("Decrypt: iv=%s  blockNr=%zu  nonce=%s  key=%s  tag=%s\n",
           asHex(this->iv, this->ivSize), this->blockNr, asHex(nonce, this->ivSize), asHex(this->key, this->keySize), asHex(tag, this->tagSize));
 
-    /* Configure the cipher with key and initialization vector */
-    if (!EVP_CipherInit_ex2(this->ctx, this->cipher, this->key, nonce, 0, NULL))
+    /* Start a new record by setting the nonce. The context already holds the key. */
+    if (!EVP_CipherInit_ex2(this->ctx, NULL, NULL, nonce, 0, NULL))
         return openSSLError(error);
 
     /* Set the MAC tag we need to match */
@@ -686,10 +1074,10 @@ aead_decrypt(AeadFilter *this,
             return openSSLError(error);
     }
 
-    /* Finalise the decryption. This can, but probably won't, generate plaintext. */
+    /* Finalise the decryption, which verifies the tag. This can, but probably won't, generate plaintext. */
     int plainFinalSize = (int)plainSize - plainUpdateSize;
-    if (!EVP_CipherFinal_ex(this->ctx, plainText + plainUpdateSize, &plainFinalSize) && ERR_get_error() != 0)
-        return openSSLError(error);
+    if (!EVP_CipherFinal_ex(this->ctx, plainText + plainUpdateSize, &plainFinalSize))
+        return setError(error, errorBadDecryption);
 
     /* Output plaintext size combines the update part of the encryption and the finalization. */
     size_t plainActual = plainUpdateSize + plainFinalSize;
@@ -7,5 +7,6 @@
 
 typedef struct AeadFilter AeadFilter;
 AeadFilter *aeadFilterNew(char *cipherName, size_t blockSize, Byte *key, size_t keyLen, void *next);
+AeadFilter *aeadFilterParallelNew(char *cipherName, size_t blockSize, Byte *key, size_t keyLen, size_t nrThreads, void *next);
 
 #endif //FILTER_AEAD_H
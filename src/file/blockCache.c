@@ -0,0 +1,300 @@
+/**
+ * A filter which keeps a number of recently read blocks in memory, so blocks which are
+ * revisited don't have to be read, decrypted or decompressed again. It is meant to sit
+ * above a filter which does expensive work per block, like AeadFilter or Lz4Compress,
+ * and below a Buffered filter which converts the byte stream into whole blocks.
+ *
+ * The blocks are held in a BufferPool. By default each open file gets a private pool sized
+ * for nrBlocks blocks, but many files can instead share one pool with a global memory budget.
+ * Blocks are keyed by (file, block number), where the file is identified by its device and inode,
+ * so handles open on the same file share its blocks. When the pool is full the CLOCK algorithm
+ * chooses which block to replace, so the blocks of idle files are given up first.
+ *
+ * Writes go straight through to the next filter, and the blocks they touch are dropped from the cache,
+ * so other handles on the file don't see stale data. That includes a block another handle was reading
+ * while the write happened, which the pool won't let it publish. Changes made outside the pool aren't noticed.
+ * Seeks are lazy. We only position the next filter when we actually need to read or write it,
+ * so reads served from the cache never move the file underneath us.
+ */
+//#define DEBUG
+#include <stdlib.h>
+#include <sys/fcntl.h>
+#include "common/debug.h"
+#include "common/passThrough.h"
+#include "common/bufferPool.h"
+#include "file/blockCache.h"
+
+#define UNKNOWN_POSITION ((off_t)-1)
+
+struct BlockCache {
+    Filter filter;         /* Common to all filters */
+    size_t nrFrames;       /* Configured number of blocks to cache in a private pool */
+    size_t blockSize;      /* Negotiated block size */
+
+    BufferPool *pool;      /* Where the cached blocks are kept */
+    bool shared;           /* Is the pool shared with other files, or is it ours to free? */
+    PoolFile file;         /* Identifies our file's blocks in the pool */
+
+    off_t position;        /* Our current position */
+    off_t nextPosition;    /* Where the next filter is positioned, or UNKNOWN_POSITION */
+};
+
+static BlockCache *blockCacheClone(BlockCache *pipe, void *next);
+static void forgetBlocks(BlockCache *this, off_t position, size_t size);
+static void seekNext(BlockCache *this, off_t position, Error *error);
+
+
+BlockCache *blockCacheOpen(BlockCache *pipe, const char *path, int oflags, int perm, Error *error)
+{
+    /* Open the downstream file and clone ourselves */
+    Filter *next = passThroughOpen(pipe, path, oflags, perm, error);
+    BlockCache *this = blockCacheClone(pipe, next);
+    if (isError(*error))
+        return this;
+
+    /* Find our file's blocks. If the file was truncated, any blocks left over from earlier are no longer valid. */
+    this->file = bufferPoolFile(pipe, path, this);
+    if (this->shared && (oflags & O_TRUNC) != 0)
+        bufferPoolForgetFile(this->pool, &this->file);
+
+    /* The file starts out positioned at the beginning. */
+    this->position = 0;
+    this->nextPosition = 0;
+
+    return this;
+}
+
+
+/**
+ * Read from the current block, either from the cache or by bringing the block into the cache.
+ */
+size_t blockCacheRead(BlockCache *this, Byte *buf, size_t size, Error *error)
+{
+    debug("blockCacheRead: position=%lld size=%zu\n", this->position, size);
+    if (isError(*error))
+        return 0;
+
+    /* Look for the block in the cache. */
+    size_t blockNr = this->position / this->blockSize;
+    PoolFrame *frame = bufferPoolPin(this->pool, &this->file, blockNr);
+
+    /* If not there, read it from the next filter. Note its generation first, in case a write overtakes our read. */
+    if (frame == NULL)
+    {
+        off_t blockPosition = blockNr * this->blockSize;
+        uint64_t generation = bufferPoolGeneration(this->pool, &this->file, blockNr);
+        seekNext(this, blockPosition, error);
+        frame = bufferPoolAllocate(this->pool, &this->file, blockNr, this->blockSize);
+        size_t blockActual = passThroughReadAll(this, frame->data, this->blockSize, error);
+
+        /* On EOF or error, we don't know where the next filter ended up. */
+        if (isError(*error))
+        {
+            bufferPoolDiscard(this->pool, frame);
+            this->nextPosition = UNKNOWN_POSITION;
+            return 0;
+        }
+
+        this->nextPosition = blockPosition + blockActual;
+        bufferPoolPublish(this->pool, frame, blockActual, generation);
+    }
+
+    /* Copy out from the cached block. If past the end of a partial block, we are at EOF. */
+    size_t offset = this->position % this->blockSize;
+    size_t actual = 0;
+    if (offset >= frame->actual)
+        setError(error, errorEOF);
+    else
+    {
+        actual = sizeMin(size, frame->actual - offset);
+        memcpy(buf, frame->data + offset, actual);
+    }
+    bufferPoolUnpin(this->pool, frame);
+
+    this->position += actual;
+    return actual;
+}
+
+
+/**
+ * Write through to the next filter, dropping the blocks we overwrite from the cache.
+ */
+size_t blockCacheWrite(BlockCache *this, const Byte *buf, size_t size, Error *error)
+{
+    debug("blockCacheWrite: position=%lld size=%zu\n", this->position, size);
+    seekNext(this, this->position, error);
+    size_t actual = passThroughWrite(this, buf, size, error);
+
+    forgetBlocks(this, this->position, actual);
+    this->position += actual;
+    this->nextPosition = isError(*error)? UNKNOWN_POSITION: this->position;
+
+    return actual;
+}
+
+
+/**
+ * Read from an explicit position. Served from the cache when possible, without moving the next filter.
+ */
+size_t blockCachePread(BlockCache *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    this->position = offset;
+    return blockCacheRead(this, buf, size, error);
+}
+
+
+/**
+ * Write to an explicit position.
+ */
+size_t blockCachePwrite(BlockCache *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    this->position = offset;
+    return blockCacheWrite(this, buf, size, error);
+}
+
+
+/**
+ * Seek to a new position. We don't position the next filter until we have to,
+ * except when seeking to the end, where we need it to tell us the file size.
+ */
+off_t blockCacheSeek(BlockCache *this, off_t position, Error *error)
+{
+    if (isError(*error))
+        return this->position;
+
+    if (position == FILE_END_POSITION)
+    {
+        /* The next filter may end up at the start of the final block rather than at the end. */
+        this->position = passThroughSeek(this, FILE_END_POSITION, error);
+        this->nextPosition = UNKNOWN_POSITION;
+    }
+    else
+        this->position = position;
+
+    return this->position;
+}
+
+
+void blockCacheClose(BlockCache *this, Error *error)
+{
+    passThroughClose(this, error);
+
+    /* Leave our blocks in a shared pool for other handles on the file, unless nobody else could find them. Free a private pool. */
+    if (this->shared && this->file.pipeline == this)
+        bufferPoolForgetFile(this->pool, &this->file);
+    else if (!this->shared && this->pool != NULL)
+        bufferPoolFree(this->pool);
+    free(this);
+}
+
+
+/**
+ * Delete a file, dropping its blocks first so a new file which reuses the inode won't find them.
+ */
+void blockCacheDelete(BlockCache *this, char *path, Error *error)
+{
+    if (this->shared)
+    {
+        PoolFile file = bufferPoolFile(this, path, this);
+        bufferPoolForgetFile(this->pool, &file);
+    }
+
+    passThroughDelete(this, path, error);
+}
+
+
+/**
+ * We keep whole blocks of the next filter's size, but a bigger block is fine if our caller asks for it.
+ */
+size_t blockCacheBlockSize(BlockCache *this, size_t prevSize, Error *error)
+{
+    size_t nextSize = passThroughBlockSize(this, prevSize, error);
+    if (isError(*error))
+        return 0;
+    this->blockSize = sizeRoundUp(sizeMax(prevSize, nextSize), nextSize);
+
+    /* Now that we know the block size, we can size a private pool. */
+    if (!this->shared && this->pool == NULL)
+        this->pool = bufferPoolNew(this->nrFrames * this->blockSize);
+
+    return this->blockSize;
+}
+
+
+/*
+ * Drop any cached blocks overlapping a range of the file.
+ */
+static void forgetBlocks(BlockCache *this, off_t position, size_t size)
+{
+    if (size == 0)
+        return;
+
+    bufferPoolForget(this->pool, &this->file, position / this->blockSize, (position + size - 1) / this->blockSize);
+}
+
+
+/*
+ * Position the next filter, but only if it isn't there already.
+ */
+static void seekNext(BlockCache *this, off_t position, Error *error)
+{
+    if (this->nextPosition != position)
+        passThroughSeek(this, position, error);
+    this->nextPosition = isError(*error)? UNKNOWN_POSITION: position;
+}
+
+
+FilterInterface blockCacheInterface = (FilterInterface) {
+    .name = "BlockCache",
+    .fnOpen = (FilterOpen)blockCacheOpen,
+    .fnRead = (FilterRead)blockCacheRead,
+    .fnWrite = (FilterWrite)blockCacheWrite,
+    .fnPread = (FilterPread)blockCachePread,
+    .fnPwrite = (FilterPwrite)blockCachePwrite,
+    .fnSeek = (FilterSeek)blockCacheSeek,
+    .fnClose = (FilterClose)blockCacheClose,
+    .fnDelete = (FilterDelete)blockCacheDelete,
+    .fnBlockSize = (FilterBlockSize)blockCacheBlockSize,
+};
+
+
+/**
+ * Create a filter which caches up to nrBlocks blocks from the next filter.
+ * Each open file has its own cache.
+ */
+BlockCache *blockCacheNew(size_t nrBlocks, void *next)
+{
+    BlockCache *this = malloc(sizeof(BlockCache));
+    *this = (BlockCache) {
+        .nrFrames = sizeMax(nrBlocks, 1),
+    };
+
+    return filterInit(this, &blockCacheInterface, next);
+}
+
+
+/**
+ * Create a filter which caches blocks in a pool shared by all files opened through it,
+ * and by any other filters given the same pool. The pool must outlive the files.
+ */
+BlockCache *blockCacheSharedNew(BufferPool *pool, void *next)
+{
+    BlockCache *this = malloc(sizeof(BlockCache));
+    *this = (BlockCache) {
+        .pool = pool,
+        .shared = true,
+    };
+
+    return filterInit(this, &blockCacheInterface, next);
+}
+
+
+/*
+ * Create a filter for a newly opened file, configured the same as the pipeline it was opened through.
+ */
+static BlockCache *blockCacheClone(BlockCache *pipe, void *next)
+{
+    return pipe->shared
+        ? blockCacheSharedNew(pipe->pool, next)
+        : blockCacheNew(pipe->nrFrames, next);
+}
@@ -0,0 +1,15 @@
+/* */
+/* Filter which keeps recently read blocks in memory. */
+/* */
+
+#ifndef FILTER_BlockCache_H
+#define FILTER_BlockCache_H
+
+#include "common/filter.h"
+#include "common/bufferPool.h"
+
+typedef struct BlockCache BlockCache;
+BlockCache *blockCacheNew(size_t nrBlocks, void *next);
+BlockCache *blockCacheSharedNew(BufferPool *pool, void *next);
+
+#endif /*FILTER_BlockCache_H */
@@ -19,6 +19,29 @@
  *
  *  One goal is to ensure purely sequential reads/writes do not require Seek operations.
  *
+ * Optionally, Buffered can read ahead when scanning sequentially. A background thread
+ * reads the next few blocks from our successor, so they are ready by the time we need them.
+ * While blocks are being read ahead, the actual file is positioned after the last of them.
+ * Before doing anything else with the actual file, we wait for the background reads
+ * and reestablish assertion 3.
+ *
+ * Similarly, Buffered can write behind. Dirty blocks are copied into a ring and written
+ * to our successor by the background thread, in order, while the caller keeps producing data.
+ * Before reading, seeking, syncing or closing the actual file, we wait for the writes to finish.
+ * Errors from the background writes are reported by a later request.
+ *
+ * Our blocks, including the ones read ahead or written behind, are frames from a BufferPool.
+ * By default each open file has a private pool, but files can share one pool under a global
+ * memory budget. Then clean blocks are published in the pool, keyed by (file, block number),
+ * so handles open on the same file find each other's blocks rather than reading them again,
+ * and blocks stay cached after we move on until the pool needs the memory for something else.
+ * A shared frame is never changed. Before we modify a block we take a private copy, and once
+ * the data is written out, it replaces the older version of the block in the pool.
+ * A block found in the pool leaves the actual file where it was, so we seek it lazily,
+ * before we next read or write it.
+ * Between requests we don't keep a clean block pinned. We find it in the pool again on the
+ * next request, so the blocks of idle handles can be replaced like any other cached block.
+ *
  * TODO: Open should return a new instance each time, so we can open multiple files at once.
  */
 #include <stdlib.h>
@@ -28,11 +51,25 @@
 #include "iostack_error.h"
 #include "common/passThrough.h"
 #include "common/debug.h"
+#include "common/threadPool.h"
+#include "common/bufferPool.h"
 
 #include "file/buffered.h"
 
 #define palloc malloc
 
+/* A block being read or written in the background. */
+typedef struct BlockSlot
+{
+    Task task;            /* The background task reading or writing the block */
+    Buffered *owner;      /* The Buffered filter we are working for */
+    PoolFrame *frame;     /* Frame holding the block. When read ahead, swapped with the Buffered frame */
+    size_t position;      /* Byte position of the block */
+    size_t actual;        /* Nr of bytes actually read, or to be written */
+    uint64_t generation;  /* Generation of the block in a shared pool when we started reading it */
+    Error error;          /* Error status of the read or write */
+} BlockSlot;
+
 /**
  * Structure containing the state of the stream, including its buffer.
  */
@@ -42,9 +79,16 @@ struct Buffered
     size_t suggestedSize; /* The suggested buffer size. We may make it a bit bigger */
 
     size_t blockSize;     /* The size of blocks we read/write to our successor. */
-    Byte *buf;            /* Local buffer, precisely one block in size. */
+    Byte *buf;            /* Local buffer, precisely one block in size. The data of our frame. */
     bool dirty;           /* Does the buffer contain dirty data? */
 
+    BufferPool *pool;     /* Where our blocks come from */
+    bool shared;          /* Is the pool shared with other files, or is it ours to free? */
+    PoolFile file;        /* Identifies our file's blocks in a shared pool */
+    PoolFrame *frame;     /* Pinned frame holding our buffer. If published, other handles may be using it too. */
+    bool nextStale;       /* Did a block from the pool leave the actual file out of step with assertion 3? */
+    uint64_t generation;  /* Generation of our block in a shared pool when we started reading it */
+
     size_t position;      /* Current byte position in the file. */
     size_t bufPosition;   /* Byte position of the beginning of the buffer */
     size_t bufActual;     /* Nr of actual bytes in the buffer */
@@ -54,6 +98,17 @@ struct Buffered
 
     bool readable;        /* Opened for reading */
     bool writeable;       /* Opened for writing */
+
+    size_t readAhead;     /* Number of blocks to read ahead. Zero if not reading ahead. */
+    size_t writeBehind;   /* Number of blocks to write behind. Zero if not writing behind. */
+    ThreadPool *worker;   /* Background thread which reads ahead or writes behind */
+    BlockSlot *slots;     /* Ring of blocks being read or written in the background */
+    size_t nrSlots;       /* Number of blocks in the ring */
+    size_t slotHead;      /* Index of the oldest block in flight */
+    size_t nrInFlight;    /* Number of blocks in flight */
+    bool writingBehind;   /* Are the blocks in flight being written rather than read? */
+    size_t aheadPosition; /* Byte position of the next block to read ahead */
+    bool aheadEof;        /* Reading ahead has reached the end of file */
 };
 
 
@@ -63,8 +118,22 @@ static size_t copyOut(Buffered *this, Byte *buf, size_t size);
 static size_t copyIn(Buffered *this, const Byte *buf, size_t size);
 static bool flushBuffer(Buffered *this, Error *error);
 static bool fillBuffer(Buffered *this, Error *error);
+static bool nextBuffer(Buffered *this, Error *error);
 size_t directWrite(Buffered *this, const Byte *buf, size_t size, Error *error);
 size_t directRead(Buffered *this, Byte *buf, size_t size, Error *error);
+static bool readAheadFill(Buffered *this, Error *error);
+static void readAheadWait(Buffered *this);
+static void readAheadCancel(Buffered *this, Error *error);
+static void writeBehindFlush(Buffered *this, Error *error);
+static void writeBehindWait(Buffered *this, Error *error);
+static void privateBuffer(Buffered *this, bool keepData);
+static void shareBuffer(Buffered *this, bool written);
+static bool poolFill(Buffered *this);
+static void seekNext(Buffered *this, size_t position, Error *error);
+static void syncNext(Buffered *this, Error *error);
+static void forgetBlocks(Buffered *this, size_t position, size_t size);
+static void acquireBuffer(Buffered *this);
+static void releaseBuffer(Buffered *this);
 
 /**
  * Open a buffered file, reading, writing or both.
@@ -78,9 +147,19 @@ Buffered *bufferedOpen(Buffered *pipe, const char *path, int oflags, int perm, E
     /* Open the downstream file and clone ourselves */
     Filter *next = passThroughOpen(pipe, path, oflags, perm, error);
     Buffered *this = bufferedNew(pipe->suggestedSize, next);
+    this->readAhead = pipe->readAhead;
+    this->writeBehind = pipe->writeBehind;
+    this->pool = pipe->pool;
+    this->shared = pipe->shared;
     if (isError(*error))
         return this;
 
+    /* Find our file's blocks in a shared pool. If the file was truncated, any blocks left over from earlier are no longer valid. */
+    if (this->shared)
+        this->file = bufferPoolFile(pipe, path, this);
+    if (this->shared && (oflags & O_TRUNC) != 0)
+        bufferPoolForgetFile(this->pool, &this->file);
+
     /* Are we read/writing or both? */
     this->readable = (oflags & O_ACCMODE) != O_WRONLY;
     this->writeable = (oflags & O_ACCMODE) != O_RDONLY;
@@ -100,6 +179,11 @@ Buffered *bufferedOpen(Buffered *pipe, const char *path, int oflags, int perm, E
     /* We don't know block size yet, so we will allocate buffer in the Size event */
     this->buf = NULL;
 
+    /* If reading ahead or writing behind, start a background thread to do the I/O. */
+    this->nrSlots = sizeMax(this->readAhead, this->writeBehind);
+    if (this->nrSlots > 0)
+        this->worker = threadPoolNew(1);
+
     return this;
 }
 
@@ -114,6 +198,10 @@ size_t bufferedWrite(Buffered *this, const Byte *buf, size_t size, Error* error)
     if (isError(*error))
         return 0;
 
+    /* Writing invalidates any blocks we read ahead. */
+    readAheadCancel(this, error);
+    acquireBuffer(this);
+
     /* If we are at end of current buffer. */
     if (this->position == this->bufPosition + this->blockSize)
     {
@@ -125,24 +213,47 @@ size_t bufferedWrite(Buffered *this, const Byte *buf, size_t size, Error* error)
         this->bufActual = 0;
     }
 
-    /* If buffer is empty, position is aligned, and the data exceeds block size, write direct to next stage */
-    if (this->bufActual == 0 && this->position == this->bufPosition && size >= this->blockSize)
-        return directWrite(this, buf, size, error);
+    /* If buffer is empty, position is aligned, and the data exceeds block size, write direct to next stage. (Not if writing behind.) */
+    if (this->bufActual == 0 && this->position == this->bufPosition && size >= this->blockSize && this->writeBehind == 0)
+    {
+        size_t actual = directWrite(this, buf, size, error);
+        releaseBuffer(this);
+        return actual;
+    }
+
+    /* If the buffer is known to be past the end of file, the next stage is still positioned at the buffer. */
+    bool pastEnd = this->bufActual == 0 && this->sizeConfirmed && this->bufPosition >= this->fileSize && !this->nextStale;
 
     /* If buffer is empty ... */
+    bool atEnd = false;
     if (this->bufActual == 0 && this->readable)
     {
         /* Fill the buffer, ignoring EOF */
         fillBuffer(this, error);
-        if (errorIsEOF(*error))
+        atEnd = errorIsEOF(*error);
+        if (atEnd)
             *error = errorOK;
     }
 
-    /* If we are dirtying a clean buffer, then seek backwards to the start of buffer */
-    if (!this->dirty)
-        passThroughSeek(this, this->bufPosition, error);
+    /* If we are dirtying a clean buffer, then seek backwards to the start of buffer. */
+    if (!this->dirty && !pastEnd)
+    {
+        writeBehindWait(this, error);
+        seekNext(this, this->bufPosition, error);
+
+        /*
+         * Reading at the end may have moved the actual file, eg. past an encrypted file's empty final record,
+         * so only now do we know it is positioned at the end. Later blocks can skip reading and seeking.
+         */
+        if (atEnd && !isError(*error))
+        {
+            this->fileSize = this->bufPosition;
+            this->sizeConfirmed = true;
+        }
+    }
 
-    /* Copy data in and update position */
+    /* Copy data in and update position, changing a private copy of the block. */
+    privateBuffer(this, true);
     size_t actual = copyIn(this, buf, size);
     this->dirty = true;
     this->position += actual;
@@ -159,12 +270,15 @@ size_t bufferedWrite(Buffered *this, const Byte *buf, size_t size, Error* error)
 size_t directWrite(Buffered *this, const Byte *buf, size_t size, Error *error)
 {
     /* Write out multiple blocks, but no partials */
+    syncNext(this, error);
     size_t alignedSize = sizeRoundDown(size, this->blockSize);
     size_t actual = passThroughWriteAll(this, buf, alignedSize, error);
+    forgetBlocks(this, this->position, actual);
 
     /* Update positions */
     this->position += actual;
     this->bufPosition = sizeRoundDown(this->position, this->blockSize);
+    this->fileSize = sizeMax(this->fileSize, this->position);
 
     return actual;
 }
@@ -178,13 +292,90 @@ size_t bufferedRead(Buffered *this, Byte *buf, size_t size, Error *error)
     debug("bufferedRead: position=%zu size=%zu encryptSize=%zu\n", this->position, size, this->blockSize);
     if (!errorIsOK(*error))
         return 0;
+    acquireBuffer(this);
+
+    size_t actual = 0;
+    if (nextBuffer(this, error))
+        ;
+
+    /* Optimization. See if we can skip our buffer and talk directly to the next stage. (Not if reading ahead.) */
+    else if (this->position == this->bufPosition && size > this->blockSize && this->bufActual == 0 && this->readAhead == 0)
+        actual = directRead(this, buf, size, error);
+
+    /* If our buffer is empty fill it in, possibly from blocks read ahead.  Exit on error or EOF */
+    else if (this->bufActual == 0 && (this->readAhead > 0? readAheadFill(this, error): fillBuffer(this, error)))
+        ;
+
+    /* If we read a partial block again after the pool gave it up, we may already be at its end. */
+    else if (nextBuffer(this, error))
+        ;
+
+    /* Copy bytes out from our internal buffer. */
+    else
+    {
+        actual = copyOut(this, buf, size);
+        this->position += actual;
+    }
+
+    releaseBuffer(this);
+
+    /* Return the number of bytes transferred. */
+    debug("bufferedRead: actual=%zu\n", actual);
+    return actual;
+}
+
+
+/**
+ * Lend out bytes from our internal buffer rather than copying them.
+ * The caller must return them before making any other request.
+ */
+size_t bufferedBorrow(Buffered *this, Byte **buf, size_t size, Error *error)
+{
+    debug("bufferedBorrow: position=%zu size=%zu\n", this->position, size);
+    if (!errorIsOK(*error))
+        return 0;
+    acquireBuffer(this);
 
-    /* If we are at the end of the current (non-empty) buffer */
+    /* If our buffer is empty fill it in, possibly from blocks read ahead.  Exit on error or EOF, when nothing is lent out. */
+    if (nextBuffer(this, error) ||
+        (this->bufActual == 0 && (this->readAhead > 0? readAheadFill(this, error): fillBuffer(this, error))) ||
+        nextBuffer(this, error))
+    {
+        releaseBuffer(this);
+        return 0;
+    }
+
+    /* Point to the bytes in our internal buffer. */
+    size_t offset = this->position - this->bufPosition;
+    size_t actual = sizeMin(this->bufActual - offset, size);
+    *buf = this->buf + offset;
+    this->position += actual;
+
+    debug("bufferedBorrow: actual=%zu\n", actual);
+    return actual;
+}
+
+
+/**
+ * Take back bytes we lent out. They were never copied, so all we do is let go of the block.
+ */
+void bufferedReturn(Buffered *this, Byte *buf, Error *error)
+{
+    releaseBuffer(this);
+}
+
+
+/**
+ * If we are at the end of the current (non-empty) buffer, advance to the next one.
+ * @return true if the current buffer is partial, meaning we are at EOF.
+ */
+static bool nextBuffer(Buffered *this, Error *error)
+{
     if (this->position == this->bufPosition + this->bufActual && this->bufActual > 0)
     {
         /* If the buffer is partial, then we are EOF */
         if (this->bufActual < this->blockSize)
-            return setError(error, errorEOF);
+            return (setError(error, errorEOF), true);
 
         /* Clean the buffer if dirty */
         flushBuffer(this, error);
@@ -194,45 +385,41 @@ size_t bufferedRead(Buffered *this, Byte *buf, size_t size, Error *error)
         this->bufActual = 0;
     }
 
-    /* Optimization. See if we can skip our buffer and talk directly to the next stage */
-    if (this->position == this->bufPosition && size > this->blockSize && this->bufActual == 0)
-        return directRead(this, buf, size, error);
-
-        /* If our buffer is empty fill it in.  Exit on error or EOF */
-    if (this->bufActual == 0 && fillBuffer(this, error))
-        return 0;
-
-    /* Copy bytes out from our internal buffer. */
-    size_t actual = copyOut(this, buf, size);
-    this->position += actual;
-
-    /* Return the number of bytes transferred. */
-    debug("bufferedRead: actual=%zu\n", actual);
-    return actual;
+    return false;
 }
 
 
 size_t directRead(Buffered *this, Byte *buf, size_t size, Error *error)
 {
     debug("directRead: size=%zu  position=%zu encryptSize=%zu\n", size, this->position, this->blockSize);
+    writeBehindWait(this, error);
+    syncNext(this, error);
+
     /* Read multiple blocks, but no partials */
     size_t alignedSize = sizeRoundDown(size, this->blockSize);
     size_t actual = passThroughReadAll(this, buf, alignedSize, error);
 
-    /* If we read a partial block, claw it back from the caller's buffer */
+    /* Update positions past the full blocks */
     size_t actualPartial = actual % this->blockSize;
     size_t actualBlock = actual - actualPartial;
-    if (actualPartial > 0)
-        copyIn(this, buf+actualBlock, actualPartial);
-
-    /* Update positions */
     this->position += actualBlock;
     this->bufPosition += actualBlock;
+
+    /*
+     * A partial block is the last one, so we know the file size. The caller gets it too,
+     * since we may not hold on to our copy until the next request. Our copy tells us we are at EOF.
+     */
     if (actualPartial > 0)
-        this->fileSize = this->position + actual;
+    {
+        privateBuffer(this, false);
+        copyIn(this, buf+actualBlock, actualPartial);
+        this->position += actualPartial;
+        this->fileSize = this->position;
+        this->sizeConfirmed = true;
+    }
 
-    debug("directRead: actual=0x%zu\n", actualBlock);
-    return actualBlock;
+    debug("directRead: actual=0x%zu\n", actual);
+    return actual;
 }
 
 
@@ -245,15 +432,20 @@ size_t bufferedSeek(Buffered *this, size_t position, Error *error)
     if (isError(*error))
         return this->position;
 
+    /* Seeking invalidates any blocks we read ahead. */
+    readAheadCancel(this, error);
+
     /* If seeking to end, ... */
     if (position == FILE_END_POSITION)
     {
         /* Clean our buffer if needed. TODO: KLUDGE get file size without losing the dirty data */
         flushBuffer(this, error);
+        writeBehindWait(this, error);
         this->bufPosition = FILE_END_POSITION;  /* An invalid position so we will always seek */
 
         /* Get the actual file size, and position ourselves at end of last full block */
         this->fileSize = passThroughSeek(this, FILE_END_POSITION, error);
+        this->nextStale = false;
         position = this->fileSize;
     }
 
@@ -264,33 +456,76 @@ size_t bufferedSeek(Buffered *this, size_t position, Error *error)
     {
         /* If dirty, flush current block. */
         flushBuffer(this, error);
+        writeBehindWait(this, error);
 
         /* Position to new block in file. */
-        passThroughSeek(this, newBlock, error);
+        seekNext(this, newBlock, error);
         this->bufPosition = newBlock;
         this->bufActual = 0;
     }
 
     /* Update position */
     this->position = position;
+    releaseBuffer(this);
 
     return position;
 }
 
+/**
+ * Read from an explicit position. We only seek if we aren't there already,
+ * and seeking within the current block doesn't involve the next stage at all.
+ */
+size_t bufferedPread(Buffered *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if ((size_t)offset != this->position)
+        bufferedSeek(this, offset, error);
+    return bufferedRead(this, buf, size, error);
+}
+
+
+/**
+ * Write to an explicit position, seeking only if we aren't there already.
+ */
+size_t bufferedPwrite(Buffered *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if ((size_t)offset != this->position)
+        bufferedSeek(this, offset, error);
+    return bufferedWrite(this, buf, size, error);
+}
+
+
 /**
  * Close the buffered file.
  */
 void bufferedClose(Buffered *this, Error *error)
 {
-    /* Flush our buffers. */
+    /* Stop reading ahead and flush our buffers. */
+    readAheadWait(this);
     flushBuffer(this, error);
+    writeBehindWait(this, error);
 
     /* Pass on the close request., */
     passThroughClose(this, error);
 
     this->readable = this->writeable = false;
-    if (this->buf != NULL)
-        free(this->buf);
+    if (this->worker != NULL)
+        threadPoolFree(this->worker);
+
+    /* Give back our frames. Blocks we published stay in a shared pool for other handles, unless nobody else could find them. */
+    if (this->frame != NULL && this->frame->published)
+        bufferPoolUnpin(this->pool, this->frame);
+    else if (this->frame != NULL)
+        bufferPoolDiscard(this->pool, this->frame);
+    if (this->slots != NULL)
+    {
+        for (size_t idx = 0; idx < this->nrSlots; idx++)
+            bufferPoolDiscard(this->pool, this->slots[idx].frame);
+        free(this->slots);
+    }
+    if (this->shared && this->file.pipeline == this)
+        bufferPoolForgetFile(this->pool, &this->file);
+    else if (!this->shared && this->pool != NULL)
+        bufferPoolFree(this->pool);
     free(this);
 
 }
@@ -301,11 +536,14 @@ void bufferedClose(Buffered *this, Error *error)
  */
 void bufferedSync(Buffered *this, Error *error)
 {
-    /* Flush our buffers. */
+    /* Stop reading ahead and flush our buffers. */
+    readAheadCancel(this, error);
     flushBuffer(this, error);
+    writeBehindWait(this, error);
 
-    /* Pass on the sync request */
+    /* Pass on the sync request. Our block is clean now, so we don't need to hold on to it. */
     passThroughSync(this, error);
+    releaseBuffer(this);
 }
 
 
@@ -326,17 +564,46 @@ size_t bufferedBlockSize(Buffered *this, size_t prevSize, Error *error)
     /* Our actual size will be a multiple of the requested size */
     this->blockSize = sizeRoundUp(suggestedSize, requestedSize);
 
+    /* Unless sharing a pool, our blocks come from a private pool just big enough to hold them. */
+    if (!this->shared)
+        this->pool = bufferPoolNew((1 + this->nrSlots) * this->blockSize);
+
     /* Allocate a buffer of the negotiated size. */
-    this->buf = malloc(this->blockSize);
+    this->frame = bufferPoolAllocate(this->pool, &this->file, 0, this->blockSize);
+    this->buf = this->frame->data;
     this->bufActual = 0;
 
+    /* If reading ahead or writing behind, allocate a ring of blocks as well */
+    if (this->nrSlots > 0)
+    {
+        this->slots = malloc(this->nrSlots * sizeof(BlockSlot));
+        for (size_t idx = 0; idx < this->nrSlots; idx++)
+            this->slots[idx] = (BlockSlot){.owner = this, .frame = bufferPoolAllocate(this->pool, &this->file, 0, this->blockSize)};
+    }
+
     /* We are buffering, so tell the caller we can accept any size. */
     return 1;
 }
 
 
+/**
+ * Delete a file, dropping its blocks from a shared pool so a new file which reuses the inode won't find them.
+ */
+void bufferedDelete(Buffered *this, char *path, Error *error)
+{
+    if (this->shared)
+    {
+        PoolFile file = bufferPoolFile(this, path, this);
+        bufferPoolForgetFile(this->pool, &file);
+    }
+
+    passThroughDelete(this, path, error);
+}
+
+
 FilterInterface bufferedInterface = (FilterInterface)
     {
+         .name = "Buffered",
          .fnOpen = (FilterOpen)bufferedOpen,
          .fnWrite = (FilterWrite)bufferedWrite,
          .fnClose = (FilterClose)bufferedClose,
@@ -344,6 +611,11 @@ FilterInterface bufferedInterface = (FilterInterface)
          .fnSync = (FilterSync)bufferedSync,
          .fnBlockSize = (FilterBlockSize)bufferedBlockSize,
          .fnSeek = (FilterSeek)bufferedSeek,
+         .fnDelete = (FilterDelete)bufferedDelete,
+         .fnPread = (FilterPread)bufferedPread,
+         .fnPwrite = (FilterPwrite)bufferedPwrite,
+         .fnBorrow = (FilterBorrow)bufferedBorrow,
+         .fnReturn = (FilterReturn)bufferedReturn,
     } ;
 
 
@@ -366,6 +638,48 @@ Buffered *bufferedNew(size_t suggestedSize, void *next)
 }
 
 
+/**
+ Create a new buffer filter object which reads ahead when scanning sequentially.
+ @param suggestedSize - suggested block size, defaulting to 16Kb.
+ @param nrBlocks - number of blocks to read ahead in a background thread.
+ */
+Buffered *bufferedReadAheadNew(size_t suggestedSize, size_t nrBlocks, void *next)
+{
+    Buffered *this = bufferedNew(suggestedSize, next);
+    this->readAhead = nrBlocks;
+    return this;
+}
+
+
+/**
+ Create a new buffer filter object which writes behind, doing the downstream writes in a background thread.
+ @param suggestedSize - suggested block size, defaulting to 16Kb.
+ @param nrBlocks - number of dirty blocks which can be waiting to be written.
+ */
+Buffered *bufferedWriteBehindNew(size_t suggestedSize, size_t nrBlocks, void *next)
+{
+    Buffered *this = bufferedNew(suggestedSize, next);
+    this->writeBehind = nrBlocks;
+    return this;
+}
+
+
+
+/**
+ Create a new buffer filter object whose blocks come from a pool shared with other files.
+ Handles open on the same file share their clean blocks, and the pool must outlive the files.
+ @param suggestedSize - suggested block size, defaulting to 16Kb.
+ @param pool - the pool holding our blocks.
+ */
+Buffered *bufferedSharedNew(size_t suggestedSize, BufferPool *pool, void *next)
+{
+    Buffered *this = bufferedNew(suggestedSize, next);
+    this->pool = pool;
+    this->shared = true;
+    return this;
+}
+
+
 
 /*
  * Clean a dirty buffer by writing it to disk. Does not change the contents of the buffer.
@@ -374,9 +688,21 @@ static bool flushBuffer(Buffered *this, Error *error)
 {
     debug("flushBuffer: position=%zu  bufActual=%zu  dirty=%d\n", this->position, this->bufActual, this->dirty);
 
+    /* Count the flush if gathering statistics. */
+    if (filterStatsEnabled && this->dirty && this->bufActual > 0)
+        this->filter.stats.flushes++;
+
     /* if the buffer is dirty, flush it. We reestablish assertion 3a */
     if (this->dirty && this->bufActual > 0)
+        syncNext(this, error);
+    if (this->dirty && this->bufActual > 0 && this->writeBehind > 0)
+        writeBehindFlush(this, error);
+    else if (this->dirty && this->bufActual > 0)
         passThroughWriteAll(this, this->buf, this->bufActual, error);
+
+    /* Once written, the block replaces any older version other handles might find. */
+    if (this->dirty && this->bufActual > 0 && !isError(*error))
+        shareBuffer(this, true);
     this->dirty = false;
 
     /* Update file size */
@@ -395,18 +721,188 @@ static bool fillBuffer (Buffered *this, Error *error)
           this->bufActual, this->bufPosition, this->sizeConfirmed, this->fileSize);
 
     /* Quick check for EOF (without system calls) */
-    /* TODO */
+    if (this->sizeConfirmed && this->bufPosition >= this->fileSize)
+    {
+        this->bufActual = 0;
+        setError(error, errorEOF);
+        return true;
+    }
+
+    /* If another handle on the file already has the block, use theirs. */
+    if (poolFill(this))
+        return false;
+
+    /* Make sure the background writes are done before reading. */
+    writeBehindWait(this, error);
+    syncNext(this, error);
 
     /* Read in the current buffer */
+    if (filterStatsEnabled)
+        this->filter.stats.fills++;
+    privateBuffer(this, false);
+    if (this->shared)
+        this->generation = bufferPoolGeneration(this->pool, &this->file, this->bufPosition / this->blockSize);
     this->bufActual = passThroughReadAll(this, this->buf, this->blockSize, error);
+    if (!isError(*error))
+        shareBuffer(this, false);
 
-    /* if EOF or partial read, update the known file size */
-    /* TODO: */
+    /* If partial read, we now know the file size. Later blocks can skip reading, and writes to them can skip the seek. */
+    if (!isError(*error) && this->bufActual < this->blockSize)
+    {
+        this->fileSize = this->bufPosition + this->bufActual;
+        this->sizeConfirmed = true;
+    }
 
     return isError(*error);
 }
 
 
+/*
+ * Make sure we can change our buffer. If it is shared through the pool, switch to a private copy.
+ */
+static void privateBuffer(Buffered *this, bool keepData)
+{
+    if (!this->frame->published)
+        return;
+
+    PoolFrame *frame = bufferPoolAllocate(this->pool, &this->file, 0, this->blockSize);
+    if (keepData)
+        memcpy(frame->data, this->buf, this->bufActual);
+    bufferPoolUnpin(this->pool, this->frame);
+    this->frame = frame;
+    this->buf = frame->data;
+}
+
+
+/*
+ * Let other handles on the file find the block in our buffer. A block we read is shared
+ * only if nobody beat us to it and nobody wrote it while we were reading, but a block
+ * we wrote replaces whatever version they had.
+ */
+static void shareBuffer(Buffered *this, bool written)
+{
+    if (!this->shared || this->frame->published || this->bufActual == 0)
+        return;
+
+    bufferPoolRename(this->pool, this->frame, &this->file, this->bufPosition / this->blockSize);
+    if (written)
+        bufferPoolReplace(this->pool, this->frame, this->bufActual);
+    else
+        bufferPoolPublish(this->pool, this->frame, this->bufActual, this->generation);
+}
+
+
+/*
+ * Fill our buffer with a block another handle shared through the pool, rather than reading it.
+ * @return true if the pool had the block.
+ */
+static bool poolFill(Buffered *this)
+{
+    if (!this->shared)
+        return false;
+
+    PoolFrame *frame = bufferPoolPin(this->pool, &this->file, this->bufPosition / this->blockSize);
+    if (frame == NULL)
+        return false;
+
+    /* Use their frame instead of ours. */
+    if (this->frame->published)
+        bufferPoolUnpin(this->pool, this->frame);
+    else
+        bufferPoolDiscard(this->pool, this->frame);
+    this->frame = frame;
+    this->buf = frame->data;
+    this->bufActual = frame->actual;
+
+    /* We didn't read the actual file, so it isn't where assertion 3 says it is. */
+    this->nextStale = true;
+    return true;
+}
+
+
+/*
+ * Before a request, get back the block we let go of after the previous one.
+ * If the block isn't what we had, the actual file may be out of step with assertion 3.
+ */
+static void acquireBuffer(Buffered *this)
+{
+    if (this->frame != NULL)
+        return;
+
+    /* Look for our block in the pool. */
+    if (this->bufActual > 0)
+        this->frame = bufferPoolPin(this->pool, &this->file, this->bufPosition / this->blockSize);
+    if (this->frame != NULL)
+    {
+        if (this->frame->actual != this->bufActual)
+            this->nextStale = true;
+        this->bufActual = this->frame->actual;
+        this->buf = this->frame->data;
+        return;
+    }
+
+    /* The pool replaced it, so start over with an empty buffer. At the end of a full block, we were moving on anyway. */
+    this->frame = bufferPoolAllocate(this->pool, &this->file, 0, this->blockSize);
+    this->buf = this->frame->data;
+    if (this->bufActual == this->blockSize && this->position == this->bufPosition + this->blockSize)
+        this->bufPosition += this->blockSize;
+    else if (this->bufActual > 0)
+        this->nextStale = true;
+    this->bufActual = 0;
+}
+
+
+/*
+ * After a request, let go of a clean block in a shared pool. Only dirty blocks stay pinned between requests.
+ * A private pool is sized for our blocks alone, so there is nothing to gain by giving them back.
+ */
+static void releaseBuffer(Buffered *this)
+{
+    if (!this->shared || this->frame == NULL || this->dirty)
+        return;
+
+    if (this->frame->published)
+        bufferPoolUnpin(this->pool, this->frame);
+    else
+        bufferPoolDiscard(this->pool, this->frame);
+    this->frame = NULL;
+    this->buf = NULL;
+}
+
+
+/*
+ * Position the actual file, which also brings it back in step with us.
+ */
+static void seekNext(Buffered *this, size_t position, Error *error)
+{
+    passThroughSeek(this, position, error);
+    this->nextStale = false;
+}
+
+
+/*
+ * Before using the actual file, reestablish assertion 3 if a block from the pool left it behind.
+ */
+static void syncNext(Buffered *this, Error *error)
+{
+    if (!this->nextStale)
+        return;
+
+    size_t position = (this->bufActual == this->blockSize && !this->dirty)? this->bufPosition + this->blockSize: this->bufPosition;
+    seekNext(this, position, error);
+}
+
+
+/*
+ * Drop blocks we wrote directly to the actual file, so other handles won't find older versions of them.
+ */
+static void forgetBlocks(Buffered *this, size_t position, size_t size)
+{
+    if (this->shared && size > 0)
+        bufferPoolForget(this->pool, &this->file, position / this->blockSize, (position + size - 1) / this->blockSize);
+}
+
+
 /* Copy user data from the user, respecting boundaries */
 static size_t copyIn(Buffered *this, const Byte *buf, size_t size)
 {
@@ -436,3 +932,173 @@ static size_t copyOut(Buffered *this, Byte *buf, size_t size)
           size, this->bufPosition, this->bufActual, offset, actual);
     return actual;
 }
+
+
+/* Background task which reads a block from our successor. */
+static void readAheadTask(void *arg)
+{
+    BlockSlot *slot = arg;
+    slot->actual = passThroughReadAll(slot->owner, slot->frame->data, slot->owner->blockSize, &slot->error);
+}
+
+
+/*
+ * Keep the ring of blocks full by queuing reads for the blocks following the ones in flight.
+ */
+static void readAheadStart(Buffered *this)
+{
+    while (this->nrInFlight < this->readAhead && !this->aheadEof)
+    {
+        BlockSlot *slot = &this->slots[(this->slotHead + this->nrInFlight) % this->nrSlots];
+        slot->position = this->aheadPosition;
+        slot->actual = 0;
+        slot->error = errorOK;
+        if (this->shared)
+            slot->generation = bufferPoolGeneration(this->pool, &this->file, slot->position / this->blockSize);
+        threadPoolSubmit(this->worker, &slot->task, readAheadTask, slot);
+
+        this->aheadPosition += this->blockSize;
+        this->nrInFlight++;
+    }
+}
+
+
+/*
+ * Fill the buffer with the oldest block read ahead, and start reading another.
+ */
+static bool readAheadFill(Buffered *this, Error *error)
+{
+    /* Make sure the background writes are done before reading. */
+    writeBehindWait(this, error);
+
+    /* If we aren't reading ahead from the current block, then start now. The actual file is already positioned there. */
+    if (this->nrInFlight == 0 || this->slots[this->slotHead].position != this->bufPosition)
+    {
+        readAheadCancel(this, error);
+        syncNext(this, error);
+        this->aheadPosition = this->bufPosition;
+        this->aheadEof = false;
+        readAheadStart(this);
+    }
+
+    /* Wait for the oldest block to arrive. */
+    if (filterStatsEnabled)
+        this->filter.stats.fills++;
+    BlockSlot *slot = &this->slots[this->slotHead];
+    threadPoolWait(this->worker, &slot->task);
+    this->slotHead = (this->slotHead + 1) % this->nrSlots;
+    this->nrInFlight--;
+
+    /* Swap frames with it, so we don't have to copy. A frame shared through the pool isn't ours to give away. */
+    PoolFrame *frame = this->frame;
+    if (frame->published)
+    {
+        bufferPoolUnpin(this->pool, frame);
+        frame = bufferPoolAllocate(this->pool, &this->file, 0, this->blockSize);
+    }
+    this->frame = slot->frame;
+    this->buf = this->frame->data;
+    slot->frame = frame;
+    this->bufActual = slot->actual;
+    this->generation = slot->generation;
+    setError(error, slot->error);
+    if (!isError(*error))
+        shareBuffer(this, false);
+
+    /* Once we see a partial block, there is no point reading further. */
+    if (this->bufActual < this->blockSize || isError(*error))
+        this->aheadEof = true;
+
+    /* Keep the background thread busy while our caller consumes this block */
+    readAheadStart(this);
+
+    return isError(*error);
+}
+
+
+/*
+ * Wait for all the background reads to finish, discarding the blocks they read.
+ */
+static void readAheadWait(Buffered *this)
+{
+    if (this->writingBehind)
+        return;
+
+    for (; this->nrInFlight > 0; this->nrInFlight--)
+    {
+        threadPoolWait(this->worker, &this->slots[this->slotHead].task);
+        this->slotHead = (this->slotHead + 1) % this->nrSlots;
+    }
+}
+
+
+/*
+ * Discard any blocks read ahead, and reestablish assertion 3 for the actual file.
+ */
+static void readAheadCancel(Buffered *this, Error *error)
+{
+    /* If no reads are in flight, the actual file is where it would be without reading ahead. */
+    if (this->nrInFlight == 0 || this->writingBehind)
+        return;
+    readAheadWait(this);
+
+    /* Position after a full block, otherwise at the start of our buffer. */
+    size_t position = (this->bufActual == this->blockSize)? this->bufPosition + this->blockSize: this->bufPosition;
+    seekNext(this, position, error);
+}
+
+
+/* Background task which writes a block to our successor. */
+static void writeBehindTask(void *arg)
+{
+    BlockSlot *slot = arg;
+    passThroughWriteAll(slot->owner, slot->frame->data, slot->actual, &slot->error);
+}
+
+
+/*
+ * Copy the dirty buffer into the ring and have the background thread write it out.
+ */
+static void writeBehindFlush(Buffered *this, Error *error)
+{
+    /* If the ring is full, wait for the oldest write to finish. */
+    if (this->nrInFlight == this->writeBehind)
+    {
+        BlockSlot *oldest = &this->slots[this->slotHead];
+        threadPoolWait(this->worker, &oldest->task);
+        setError(error, oldest->error);
+        this->slotHead = (this->slotHead + 1) % this->nrSlots;
+        this->nrInFlight--;
+    }
+
+    /* Copy the buffer into the next slot. We keep our buffer, since it still holds valid data. */
+    BlockSlot *slot = &this->slots[(this->slotHead + this->nrInFlight) % this->nrSlots];
+    memcpy(slot->frame->data, this->buf, this->bufActual);
+    slot->position = this->bufPosition;
+    slot->actual = this->bufActual;
+    slot->error = errorOK;
+
+    /* Queue the write. Writes complete in order, so the actual file stays in sync with us. */
+    threadPoolSubmit(this->worker, &slot->task, writeBehindTask, slot);
+    this->nrInFlight++;
+    this->writingBehind = true;
+}
+
+
+/*
+ * Wait for all the background writes to finish, reporting any errors.
+ */
+static void writeBehindWait(Buffered *this, Error *error)
+{
+    if (!this->writingBehind)
+        return;
+
+    for (; this->nrInFlight > 0; this->nrInFlight--)
+    {
+        BlockSlot *slot = &this->slots[this->slotHead];
+        threadPoolWait(this->worker, &slot->task);
+        setError(error, slot->error);
+        this->slotHead = (this->slotHead + 1) % this->nrSlots;
+    }
+    this->writingBehind = false;
+}
@@ -6,8 +6,12 @@
 #define UNTITLED1_BufferFile_H
 
 #include "common/filter.h"
+#include "common/bufferPool.h"
 
 typedef struct Buffered Buffered;
 Buffered *bufferedNew(size_t blockSize, void *next);
+Buffered *bufferedReadAheadNew(size_t blockSize, size_t nrBlocks, void *next);
+Buffered *bufferedWriteBehindNew(size_t blockSize, size_t nrBlocks, void *next);
+Buffered *bufferedSharedNew(size_t blockSize, BufferPool *pool, void *next);
 
 #endif /*UNTITLED1_ByteStream_H */
@@ -81,6 +81,55 @@ size_t fileSystemRead(FileSystemBottom *this, Byte *buf, size_t size, Error *err
 }
 
 
+/**
+ * Write a vector of buffers with a single system call.
+ */
+size_t fileSystemWritev(FileSystemBottom *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    if (errorIsOK(*error) && !this->writable)
+        *error = errorCantWrite;
+
+    return sys_writev(this->fd, iov, iovCnt, error);
+}
+
+
+/**
+ * Read a vector of buffers with a single system call.
+ */
+size_t fileSystemReadv(FileSystemBottom *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    if (isError(*error))                 ;
+    else if (!this->readable)            *error = errorCantRead;
+    else if (this->eof)                  *error = errorEOF;
+
+    return sys_readv(this->fd, iov, iovCnt, error);
+}
+
+
+/**
+ * Write data at an absolute position with a single system call.
+ */
+size_t fileSystemPwrite(FileSystemBottom *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (errorIsOK(*error) && !this->writable)
+        *error = errorCantWrite;
+
+    return sys_pwrite(this->fd, buf, size, offset, error);
+}
+
+
+/**
+ * Read data from an absolute position with a single system call.
+ */
+size_t fileSystemPread(FileSystemBottom *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (isError(*error))                 ;
+    else if (!this->readable)            *error = errorCantRead;
+
+    return sys_pread(this->fd, buf, size, offset, error);
+}
+
+
 /**
  * Close a Posix file.
  */
@@ -145,6 +194,7 @@ void fileSystemDelete(FileSystemBottom *this, char *path, Error *error)
 
 FilterInterface fileSystemInterface = (FilterInterface)
 {
+    .name = "FileSystemBottom",
     .fnOpen = (FilterOpen)fileSystemOpen,
     .fnWrite = (FilterWrite)fileSystemWrite,
     .fnRead = (FilterRead)fileSystemRead,
@@ -153,7 +203,11 @@ FilterInterface fileSystemInterface = (FilterInterface)
     .fnBlockSize = (FilterBlockSize)fileSystemBlockSize,
     .fnAbort = (FilterAbort)fileSystemAbort,
     .fnSeek = (FilterSeek)fileSystemSeek,
-    .fnDelete = (FilterDelete)fileSystemDelete
+    .fnDelete = (FilterDelete)fileSystemDelete,
+    .fnReadv = (FilterReadv)fileSystemReadv,
+    .fnWritev = (FilterWritev)fileSystemWritev,
+    .fnPread = (FilterPread)fileSystemPread,
+    .fnPwrite = (FilterPwrite)fileSystemPwrite,
 };
 
 
@@ -64,6 +64,46 @@ size_t fileRead(IoStack *this, Byte *buf, size_t size, Error *error)
 }
 
 
+/**
+ * Write a vector of blocks to a file.
+ */
+size_t fileWritev(IoStack *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    return passThroughWritevAll(this, iov, iovCnt, error);
+}
+
+
+/**
+ * Read a vector of blocks from a file.
+ */
+size_t fileReadv(IoStack *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    return passThroughReadvAll(this, iov, iovCnt, error);
+}
+
+
+/**
+ * Write data at an explicit position, without a separate seek.
+ * Like every request on a handle, it must not run concurrently with others on the same handle.
+ * Afterwards, the file must be positioned with fileSeek before doing sequential I/O.
+ */
+size_t fileWriteAt(IoStack *this, const Byte *buf, size_t bufSize, off_t offset, Error *error)
+{
+    return passThroughPwriteAll(this, buf, bufSize, offset, error);
+}
+
+
+/**
+ * Read data from an explicit position, without a separate seek.
+ * Like every request on a handle, it must not run concurrently with others on the same handle.
+ * Afterwards, the file must be positioned with fileSeek before doing sequential I/O.
+ */
+size_t fileReadAt(IoStack *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    return passThroughPreadAll(this, buf, size, offset, error);
+}
+
+
 /*
  * Seek to the last partial block in the file, or EOF if all blocks
  * are full sized. (Think of EOF as a final, empty block.)
@@ -92,6 +132,33 @@ void fileDelete(IoStack *this, char *path, Error *error)
 }
 
 
+/**
+ * Get the statistics for each stage of an open file, in pipeline order.
+ * Returns the number of stages, which may be more than maxStats.
+ */
+size_t fileStats(IoStack *this, FileStats *stats, size_t maxStats)
+{
+    size_t count = 0;
+    for (Filter *filter = this->filter.next; filter != NULL; filter = filter->next, count++)
+        if (count < maxStats)
+        {
+            stats[count] = filter->stats;
+            stats[count].name = filter->iface->name;
+        }
+
+    return count;
+}
+
+
+/**
+ * Turn statistics gathering on or off for all files.
+ */
+void fileStatsEnable(bool enable)
+{
+    filterStatsEnabled = enable;
+}
+
+
 /**
  * Create a new File Source for generating File events. Since this is the
  * first element in a pipeline of filters, it is the handle for the entire pipeline.
@@ -0,0 +1,586 @@
+/**
+ * IoUringBottom is an alternative to FileSystemBottom which sends reads, writes and
+ * datasyncs through a Linux io_uring rather than issuing one system call per request.
+ *
+ * Writes are copied into a set of registered buffers and queued, but they are not
+ * submitted until every buffer is in use. At that point the whole batch is submitted,
+ * and we wait for at least one write to complete, all in a single system call.
+ * Reads, syncs and seeks to end of file must see the data written so far, so they
+ * first wait for all queued writes to complete. So does a write which overlaps one
+ * still pending, since io_uring could otherwise complete them in either order.
+ *
+ * Since io_uring requests carry their own file offset, we track the file position
+ * ourselves and seeks do not need a system call.
+ *
+ * Because writes complete asynchronously, a write error may be reported by a later request.
+ *
+ * We talk to the kernel interface directly rather than depend on liburing.
+ */
+//#define DEBUG
+#include <stdlib.h>
+#include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "common/debug.h"
+#include "common/syscall.h"
+#include "common/passThrough.h"
+#include "file/ioUringBottom.h"
+
+#define DEFAULT_QUEUE_DEPTH 32
+#define DEFAULT_BUFFER_SIZE (64*1024)
+
+/* The shared memory rings we use to talk to the kernel. */
+typedef struct IoUring
+{
+    int fd;                        /* The io_uring file descriptor */
+    size_t entries;                /* Number of submission queue entries */
+
+    void *sqRing;                  /* Mapped submission ring */
+    size_t sqRingSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;     /* Mapped submission queue entries */
+
+    void *cqRing;                  /* Mapped completion ring. May be the same mapping as sqRing */
+    size_t cqRingSize;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+} IoUring;
+
+/* One registered buffer and the write it currently holds. */
+typedef struct WriteSlot
+{
+    Byte *buf;                     /* Registered buffer of bufferSize bytes */
+    off_t offset;                  /* File offset of the write */
+    size_t size;                   /* Number of bytes in the write */
+    bool busy;                     /* Is the write still in progress? */
+} WriteSlot;
+
+struct IoUringBottom {
+    Filter filter;                 /* first in every Filter. */
+
+    /* Configuration */
+    size_t queueDepth;             /* Max number of writes in flight. */
+    size_t bufferSize;             /* Size of each registered write buffer. */
+
+    /* File state */
+    int fd;                        /* The file descriptor for the currently open file. */
+    bool writable;                 /* Can we write to the file? */
+    bool readable;                 /* Can we read from the file? */
+    bool eof;                      /* Has the currently open file read past eof? */
+    off_t position;                /* Our current file position. */
+    off_t fileSize;                /* Size of the file, including writes still in flight. */
+
+    /* Ring state */
+    IoUring ring;                  /* The kernel rings */
+    WriteSlot *slots;              /* One slot for each registered buffer */
+    Byte *buffers;                 /* Memory for all the registered buffers */
+    size_t nrQueued;               /* Entries prepared but not yet submitted */
+    size_t nrPending;              /* Writes submitted or queued, but not yet completed. */
+    Error asyncError;              /* First error from a write which completed in the background. */
+};
+
+static Error errorCantWrite = (Error){.code=errorCodeIoStack, .msg="Writing to file opened as readonly"};
+static Error errorCantRead = (Error){.code=errorCodeIoStack, .msg="Reading from file opened as writeonly"};
+
+/* Forward references */
+static void ringSetup(IoUring *ring, size_t entries, Error *error);
+static void ringFree(IoUring *ring);
+static struct io_uring_sqe *ringGetSqe(IoUringBottom *this);
+static int ringSubmitAndWait(IoUringBottom *this, size_t waitCount, Error *error);
+static void drainWrites(IoUringBottom *this, Error *error);
+static WriteSlot *getFreeSlot(IoUringBottom *this, Error *error);
+static bool overlapsPendingWrite(IoUringBottom *this, off_t offset, size_t size);
+static inline Error ringError(int res) {errno = -res; return systemError();}
+
+
+/**
+ * Open a file and create an io_uring for it.
+ */
+IoUringBottom *ioUringOpen(IoUringBottom *sink, const char *path, int oflags, int perm, Error *error)
+{
+    /* Clone ourself. */
+    IoUringBottom *this = ioUringBottomNew(sink->queueDepth, sink->bufferSize);
+
+    /* Check the oflags we are opening the file in. */
+    this->writable = (oflags & O_ACCMODE) != O_RDONLY;
+    this->readable = (oflags & O_ACCMODE) != O_WRONLY;
+    this->eof = false;
+
+    /* Default file permission when creating a file. */
+    if (perm == 0)
+        perm = 0666;
+
+    /* Open the file and find out how big it is, so we can detect seeks past the end. */
+    this->fd = sys_open(path, oflags, perm, error);
+    struct stat st;
+    if (errorIsOK(*error) && fstat(this->fd, &st) == -1)
+        *error = systemError();
+    this->fileSize = isError(*error)? 0: st.st_size;
+    this->position = 0;
+    if (isError(*error))
+        return this;
+
+    /* Create the ring, with one submission entry for each write buffer. */
+    ringSetup(&this->ring, this->queueDepth, error);
+    if (isError(*error))
+        return this;
+
+    /* Allocate the write buffers and register them with the kernel. */
+    this->buffers = malloc(this->queueDepth * this->bufferSize);
+    this->slots = malloc(this->queueDepth * sizeof(WriteSlot));
+    struct iovec iov[this->queueDepth];
+    for (size_t idx = 0; idx < this->queueDepth; idx++)
+    {
+        this->slots[idx] = (WriteSlot){.buf = this->buffers + idx * this->bufferSize};
+        iov[idx] = (struct iovec){.iov_base = this->slots[idx].buf, .iov_len = this->bufferSize};
+    }
+    if (syscall(__NR_io_uring_register, this->ring.fd, IORING_REGISTER_BUFFERS, iov, this->queueDepth) == -1)
+        *error = systemError();
+
+    return this;
+}
+
+
+/**
+ * Queue data to be written to the file. The data is copied into a registered buffer,
+ * so the caller may reuse its buffer as soon as we return.
+ */
+size_t ioUringWrite(IoUringBottom *this, const Byte *buf, size_t bufSize, Error *error)
+{
+    /* Check for errors, including any left over from earlier writes. */
+    if (errorIsOK(*error) && !this->writable)
+        *error = errorCantWrite;
+    setError(error, this->asyncError);
+    if (isError(*error))
+        return 0;
+
+    /* io_uring does not order requests, so an earlier write to the same bytes must finish first. */
+    size_t size = sizeMin(bufSize, this->bufferSize);
+    if (overlapsPendingWrite(this, this->position, size))
+        drainWrites(this, error);
+
+    /* Find a free buffer, waiting for an earlier write to complete if necessary. */
+    WriteSlot *slot = getFreeSlot(this, error);
+    if (isError(*error))
+        return 0;
+
+    /* Copy the data into the registered buffer. */
+    memcpy(slot->buf, buf, size);
+    *slot = (WriteSlot){.buf = slot->buf, .offset = this->position, .size = size, .busy = true};
+
+    /* Prepare a write, but don't submit it yet. */
+    struct io_uring_sqe *sqe = ringGetSqe(this);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = this->fd;
+    sqe->addr = (uint64_t)(uintptr_t)slot->buf;
+    sqe->len = (uint32_t)size;
+    sqe->off = (uint64_t)slot->offset;
+    sqe->buf_index = (uint16_t)(slot - this->slots);
+    sqe->user_data = (uint64_t)(slot - this->slots);
+    this->nrPending++;
+
+    /* Update our position and the (eventual) size of the file. */
+    this->position += (off_t)size;
+    if (this->position > this->fileSize)
+        this->fileSize = this->position;
+
+    debug("ioUringWrite: fd=%d size=%zu position=%lld pending=%zu\n", this->fd, size, (long long)this->position, this->nrPending);
+    return size;
+}
+
+
+/**
+ * Read data from a file, checking for EOF. The data goes directly into the caller's buffer.
+ */
+size_t ioUringRead(IoUringBottom *this, Byte *buf, size_t size, Error *error)
+{
+    /* Check for errors. */
+    if (isError(*error))                 return 0;
+    else if (!this->readable)            return setError(error, errorCantRead);
+    else if (this->eof)                  return setError(error, errorEOF);
+
+    /* io_uring does not order requests, so make sure we see everything written so far. */
+    drainWrites(this, error);
+    if (isError(*error))
+        return 0;
+
+    /* Read into the caller's buffer. */
+    struct io_uring_sqe *sqe = ringGetSqe(this);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = this->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)sizeMin(size, UINT32_MAX);
+    sqe->off = (uint64_t)this->position;
+    sqe->user_data = (uint64_t)-1;
+    int res = ringSubmitAndWait(this, 1, error);
+
+    /* Check the result and update our position. */
+    if (isError(*error))
+        return 0;
+    if (res < 0)
+        return setError(error, ringError(res));
+    if (res == 0)
+        return setError(error, errorEOF);
+
+    this->position += res;
+    debug("ioUringRead: fd=%d size=%zu actual=%d\n", this->fd, size, res);
+    return (size_t)res;
+}
+
+
+/**
+ * Push data which has been written out to persistent storage.
+ */
+void ioUringSync(IoUringBottom *this, Error *error)
+{
+    /* Error if file was readonly. */
+    if (errorIsOK(*error) && !this->writable)
+        *error = errorCantWrite;
+    if (!this->writable)
+        return;
+
+    /* The sync is not ordered with respect to writes, so wait for the writes to complete. */
+    drainWrites(this, error);
+    if (isError(*error))
+        return;
+
+    /* Sync the data, but not the metadata. */
+    struct io_uring_sqe *sqe = ringGetSqe(this);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = this->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (uint64_t)-1;
+    int res = ringSubmitAndWait(this, 1, error);
+    if (res < 0)
+        setError(error, ringError(res));
+}
+
+
+/**
+ * Seek to a new position. Since our requests carry their own offsets,
+ * this is a purely local operation unless we are seeking to the end.
+ */
+off_t ioUringSeek(IoUringBottom *this, off_t position, Error *error)
+{
+    if (isError(*error))
+        return (off_t)-1;
+
+    /* If seeking to the end, get the actual file size, since others may have extended the file. */
+    if (position == FILE_END_POSITION)
+    {
+        drainWrites(this, error);
+        struct stat st;
+        if (errorIsOK(*error) && fstat(this->fd, &st) == -1)
+            *error = systemError();
+        if (isError(*error))
+            return (off_t)-1;
+        if (st.st_size > this->fileSize)
+            this->fileSize = st.st_size;
+        position = this->fileSize;
+    }
+
+    /* We don't allow holes. */
+    else if (position > this->fileSize)
+        return (ioStackError(error, "Seeking beyond end of file - holes not allowed"), (off_t)-1);
+
+    this->position = position;
+    this->eof = false;
+
+    debug("ioUringSeek: fd=%d position=%lld\n", this->fd, (long long)position);
+    return position;
+}
+
+
+/**
+ * Close the file, waiting for any writes still in progress.
+ */
+void ioUringClose(IoUringBottom *this, Error *error)
+{
+    /* Finish any writes, and report errors they may have had. */
+    if (this->ring.fd != -1)
+    {
+        Error drainError = errorOK;
+        drainWrites(this, &drainError);
+        setError(error, drainError);
+        setError(error, this->asyncError);
+    }
+
+    /* Close the fd if it was opened earlier, and release the ring. */
+    sys_close(this->fd, error);
+    ringFree(&this->ring);
+
+    if (this->buffers != NULL)
+        free(this->buffers);
+    if (this->slots != NULL)
+        free(this->slots);
+    free(this);
+}
+
+
+/**
+ * We can deal with any size.
+ */
+size_t ioUringBlockSize(IoUringBottom *this, size_t prevSize, Error *error)
+{
+    return 1;
+}
+
+
+/**
+ * Abort file access. Not currently implemented.
+ */
+void ioUringAbort(IoUringBottom *this, Error *error)
+{
+    abort(); /* TODO: not implemented. */
+}
+
+
+void ioUringDelete(IoUringBottom *this, char *path, Error *error)
+{
+    /* Unlink the file, even if we've already had an error */
+    Error tempError = errorOK;
+    sys_unlink(path, &tempError);
+    setError(error, tempError);
+}
+
+
+FilterInterface ioUringInterface = (FilterInterface)
+{
+    .name = "IoUringBottom",
+    .fnOpen = (FilterOpen)ioUringOpen,
+    .fnWrite = (FilterWrite)ioUringWrite,
+    .fnRead = (FilterRead)ioUringRead,
+    .fnClose = (FilterClose)ioUringClose,
+    .fnSync = (FilterSync)ioUringSync,
+    .fnBlockSize = (FilterBlockSize)ioUringBlockSize,
+    .fnAbort = (FilterAbort)ioUringAbort,
+    .fnSeek = (FilterSeek)ioUringSeek,
+    .fnDelete = (FilterDelete)ioUringDelete
+};
+
+
+/**
+ * Create a new io_uring Sink.
+ * @param queueDepth - maximum number of writes in flight (default 32)
+ * @param bufferSize - size of each registered write buffer (default 64K)
+ */
+IoUringBottom *ioUringBottomNew(size_t queueDepth, size_t bufferSize)
+{
+    IoUringBottom *this = malloc(sizeof(IoUringBottom));
+    *this = (IoUringBottom)
+    {
+        .queueDepth = (queueDepth == 0)? DEFAULT_QUEUE_DEPTH: queueDepth,
+        .bufferSize = (bufferSize == 0)? DEFAULT_BUFFER_SIZE: bufferSize,
+        .fd = -1,
+        .ring = (IoUring){.fd = -1},
+        .asyncError = errorOK,
+        .filter = (Filter){
+            .iface=&ioUringInterface,
+            .next=NULL}
+    };
+    return this;
+}
+
+
+/*
+ * Find a free write buffer. If all are busy, submit the queued writes
+ * and wait for one to complete.
+ */
+static WriteSlot *getFreeSlot(IoUringBottom *this, Error *error)
+{
+    for (;;)
+    {
+        for (size_t idx = 0; idx < this->queueDepth; idx++)
+            if (!this->slots[idx].busy)
+                return &this->slots[idx];
+
+        ringSubmitAndWait(this, 1, error);
+        setError(error, this->asyncError);
+        if (isError(*error))
+            return NULL;
+    }
+}
+
+
+/*
+ * Does the range [offset, offset+size) overlap a write which hasn't completed yet?
+ */
+static bool overlapsPendingWrite(IoUringBottom *this, off_t offset, size_t size)
+{
+    for (size_t idx = 0; idx < this->queueDepth; idx++)
+    {
+        WriteSlot *slot = &this->slots[idx];
+        if (slot->busy && offset < slot->offset + (off_t)slot->size && slot->offset < offset + (off_t)size)
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Submit all queued writes and wait for them to complete.
+ */
+static void drainWrites(IoUringBottom *this, Error *error)
+{
+    while (this->nrPending > 0 && errorIsOK(*error))
+        ringSubmitAndWait(this, this->nrPending, error);
+    setError(error, this->asyncError);
+}
+
+
+/*
+ * Complete a write. A short write is finished off synchronously.
+ */
+static void completeWrite(IoUringBottom *this, WriteSlot *slot, int res)
+{
+    if (res >= 0 && res < slot->size)
+    {
+        /* Rare. Write the rest of the buffer directly. */
+        for (size_t done = res; done < slot->size && res >= 0; done += res)
+            res = (int)pwrite(this->fd, slot->buf + done, slot->size - done, slot->offset + (off_t)done);
+        if (res < 0)
+            res = -errno;
+    }
+
+    if (res < 0)
+        setError(&this->asyncError, ringError(res));
+
+    slot->busy = false;
+    this->nrPending--;
+}
+
+
+/*
+ * Submit all queued entries and wait for at least waitCount completions.
+ * Completed writes release their buffers. Returns the result of the last non-write
+ * completion, which is the request our caller is waiting for.
+ */
+static int ringSubmitAndWait(IoUringBottom *this, size_t waitCount, Error *error)
+{
+    int result = 0;
+    size_t completed = 0;
+    IoUring *ring = &this->ring;
+
+    while (completed < waitCount)
+    {
+        /* Submit everything queued, and wait for completions in the same system call. */
+        long ret = syscall(__NR_io_uring_enter, ring->fd, (unsigned)this->nrQueued,
+                           (unsigned)(waitCount - completed), IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return (*error = systemError(), -errno);
+        this->nrQueued -= (size_t)ret;
+
+        /* Harvest the completions */
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, completed++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            if (cqe->user_data == (uint64_t)-1)
+                result = cqe->res;
+            else
+                completeWrite(this, &this->slots[cqe->user_data], cqe->res);
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return result;
+}
+
+
+/*
+ * Get the next free submission entry. There is always room since the number of
+ * entries matches the number of write buffers, plus the one request we wait for.
+ */
+static struct io_uring_sqe *ringGetSqe(IoUringBottom *this)
+{
+    IoUring *ring = &this->ring;
+    unsigned tail = *ring->sqTail;
+    unsigned idx = tail & *ring->sqMask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[idx] = idx;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    this->nrQueued++;
+    return sqe;
+}
+
+
+/*
+ * Create an io_uring and map its rings into our address space.
+ */
+static void ringSetup(IoUring *ring, size_t entries, Error *error)
+{
+    /* Leave room for one extra request beyond the writes in flight. */
+    struct io_uring_params params = {0};
+    ring->fd = (int)syscall(__NR_io_uring_setup, (unsigned)entries + 1, &params);
+    if (ring->fd == -1)
+        return (void) (*error = systemError());
+    ring->entries = params.sq_entries;
+
+    /* Figure out how big the rings are. Newer kernels map both rings together. */
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        ring->sqRingSize = ring->cqRingSize = sizeMax(ring->sqRingSize, ring->cqRingSize);
+
+    /* Map the submission ring */
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+        return (void) (ring->sqRing = NULL, *error = systemError());
+
+    /* Map the completion ring, unless it is shared with the submission ring. */
+    ring->cqRing = single
+        ? ring->sqRing
+        : mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED)
+        return (void) (ring->cqRing = NULL, *error = systemError());
+
+    /* Map the submission entries */
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return (void) (ring->sqes = NULL, *error = systemError());
+
+    /* Point to the fields within the rings */
+    Byte *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+
+/*
+ * Unmap the rings and close the io_uring.
+ */
+static void ringFree(IoUring *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd != -1)
+        close(ring->fd);
+    *ring = (IoUring){.fd = -1};
+}
@@ -0,0 +1,13 @@
+/* */
+/* Sink which sends file system requests through a Linux io_uring. */
+/* */
+
+#ifndef FILTER_IoUringBottom_H
+#define FILTER_IoUringBottom_H
+
+#include "common/filter.h"
+
+typedef struct IoUringBottom IoUringBottom;
+IoUringBottom *ioUringBottomNew(size_t queueDepth, size_t bufferSize);
+
+#endif /*FILTER_IoUringBottom_H */
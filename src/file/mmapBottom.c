@@ -0,0 +1,288 @@
+/**
+ * MmapBottom is an alternative to FileSystemBottom for files which are mostly read.
+ * The file is mapped into memory, and reads copy directly out of the mapping
+ * without a system call. Since we track the file position ourselves,
+ * seeks only move an offset.
+ *
+ * Writes go through pwrite. The mapping is shared, so it sees the new data,
+ * and it is extended the next time we read past its end.
+ * FileSystemBottom remains the better choice for files which are mostly written.
+ */
+//#define DEBUG
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common/debug.h"
+#include "common/syscall.h"
+#include "common/passThrough.h"
+#include "file/mmapBottom.h"
+
+struct MmapBottom {
+    Filter filter;   /* first in every Filter. */
+    int fd;          /* The file descriptor for the currently open file. */
+    bool writable;   /* Can we write to the file? */
+    bool readable;   /* Can we read from the file? */
+    Byte *map;       /* The mapped file, NULL if not mapped yet. */
+    size_t mapSize;  /* Number of bytes mapped. */
+    off_t position;  /* Our current file position. */
+    off_t fileSize;  /* Size of the file, including our own writes. */
+};
+
+static Error errorCantWrite = (Error){.code=errorCodeIoStack, .msg="Writing to file opened as readonly"};
+static Error errorCantRead = (Error){.code=errorCodeIoStack, .msg="Reading from file opened as writeonly"};
+
+static void mapFile(MmapBottom *this, Error *error);
+static void unmapFile(MmapBottom *this);
+size_t mmapPread(MmapBottom *this, Byte *buf, size_t size, off_t offset, Error *error);
+size_t mmapPwrite(MmapBottom *this, const Byte *buf, size_t size, off_t offset, Error *error);
+
+
+/**
+ * Open a file. We don't map it until we actually read from it.
+ */
+MmapBottom *mmapOpen(MmapBottom *sink, const char *path, int oflags, int perm, Error *error)
+{
+    /* Clone ourself. */
+    MmapBottom *this = mmapBottomNew();
+
+    /* Check the oflags we are opening the file in. */
+    this->writable = (oflags & O_ACCMODE) != O_RDONLY;
+    this->readable = (oflags & O_ACCMODE) != O_WRONLY;
+
+    /* Default file permission when creating a file. */
+    if (perm == 0)
+        perm = 0666;
+
+    /* Open the file and get its size. */
+    this->fd = sys_open(path, oflags, perm, error);
+    struct stat statBuf;
+    if (errorIsOK(*error) && fstat(this->fd, &statBuf) == -1)
+        *error = systemError();
+    this->fileSize = isError(*error)? 0: statBuf.st_size;
+    this->position = 0;
+
+    return this;
+}
+
+
+/**
+ * Read data by copying it out of the mapping.
+ */
+size_t mmapRead(MmapBottom *this, Byte *buf, size_t size, Error *error)
+{
+    size_t actual = mmapPread(this, buf, size, this->position, error);
+    this->position += actual;
+    return actual;
+}
+
+
+/**
+ * Read data from an explicit position by copying it out of the mapping.
+ */
+size_t mmapPread(MmapBottom *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    /* Check for errors. */
+    if (isError(*error))                 return 0;
+    else if (!this->readable)            return (*error = errorCantRead, 0);
+    else if (offset >= this->fileSize)   return (*error = errorEOF, 0);
+
+    /* Make sure the mapping covers the whole file. */
+    mapFile(this, error);
+    if (isError(*error))
+        return 0;
+
+    /* Copy the data out of the mapping. */
+    size_t actual = sizeMin(size, this->fileSize - offset);
+    memcpy(buf, this->map + offset, actual);
+
+    debug("mmapPread: size=%zu  offset=%lld  actual=%zu\n", size, offset, actual);
+    return actual;
+}
+
+
+/**
+ * Lend out data directly from the mapping, without copying.
+ * The mapping stays in place until the caller makes another request, so it can't move while lent out.
+ */
+size_t mmapBorrow(MmapBottom *this, Byte **buf, size_t size, Error *error)
+{
+    /* Check for errors. */
+    if (isError(*error))                       return 0;
+    else if (!this->readable)                  return (*error = errorCantRead, 0);
+    else if (this->position >= this->fileSize) return (*error = errorEOF, 0);
+
+    /* Make sure the mapping covers the whole file. */
+    mapFile(this, error);
+    if (isError(*error))
+        return 0;
+
+    /* Point to the data in the mapping. */
+    size_t actual = sizeMin(size, this->fileSize - this->position);
+    *buf = this->map + this->position;
+    this->position += actual;
+
+    debug("mmapBorrow: size=%zu  actual=%zu\n", size, actual);
+    return actual;
+}
+
+
+/**
+ * Take back data we lent out. It is part of the mapping, so there is nothing to do.
+ */
+void mmapReturn(MmapBottom *this, Byte *buf, Error *error)
+{
+}
+
+
+/**
+ * Write data to a file. The mapping is shared, so it sees the new data.
+ */
+size_t mmapWrite(MmapBottom *this, const Byte *buf, size_t size, Error *error)
+{
+    size_t actual = mmapPwrite(this, buf, size, this->position, error);
+    this->position += actual;
+    return actual;
+}
+
+
+/**
+ * Write data at an explicit position.
+ */
+size_t mmapPwrite(MmapBottom *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (errorIsOK(*error) && !this->writable)
+        *error = errorCantWrite;
+
+    size_t actual = sys_pwrite(this->fd, buf, size, offset, error);
+    this->fileSize = sizeMax(this->fileSize, offset + actual);
+
+    return actual;
+}
+
+
+/**
+ * Seek just moves our position, except we don't allow holes.
+ */
+off_t mmapSeek(MmapBottom *this, off_t position, Error *error)
+{
+    if (isError(*error))
+        return (off_t)-1;
+
+    if (position == FILE_END_POSITION)
+        position = this->fileSize;
+    else if (position > this->fileSize)
+        return ioStackError(error, "Seeking beyond end of file - holes not allowed");
+
+    this->position = position;
+    return position;
+}
+
+
+/**
+ * Push data which has been written out to persistent storage.
+ */
+void mmapSync(MmapBottom *this, Error *error)
+{
+    /* Error if file was readonly. */
+    if (errorIsOK(*error) && !this->writable)
+        *error = errorCantWrite;
+
+    /* Go sync it. */
+    if (this->writable)
+        sys_datasync(this->fd, error);
+}
+
+
+/**
+ * Close the file, releasing the mapping.
+ */
+void mmapClose(MmapBottom *this, Error *error)
+{
+    unmapFile(this);
+    sys_close(this->fd, error);
+    free(this);
+}
+
+
+/**
+ * We can deal with any block size.
+ */
+size_t mmapBlockSize(MmapBottom *this, size_t prevSize, Error *error)
+{
+    return 1;
+}
+
+
+void mmapDelete(MmapBottom *this, char *path, Error *error)
+{
+    /* Unlink the file, even if we've already had an error */
+    Error tempError = errorOK;
+    sys_unlink(path, &tempError);
+    setError(error, tempError);
+}
+
+
+/*
+ * Map the entire file, remapping if the file has grown since we last mapped it.
+ */
+static void mapFile(MmapBottom *this, Error *error)
+{
+    if (isError(*error) || this->mapSize == this->fileSize)
+        return;
+
+    unmapFile(this);
+    void *map = mmap(NULL, this->fileSize, PROT_READ, MAP_SHARED, this->fd, 0);
+    if (map == MAP_FAILED)
+        return (void) (*error = systemError());
+
+    this->map = map;
+    this->mapSize = this->fileSize;
+    debug("mapFile: fd=%d  mapSize=%zu\n", this->fd, this->mapSize);
+}
+
+
+static void unmapFile(MmapBottom *this)
+{
+    if (this->map != NULL)
+        munmap(this->map, this->mapSize);
+    this->map = NULL;
+    this->mapSize = 0;
+}
+
+
+FilterInterface mmapInterface = (FilterInterface)
+{
+    .name = "MmapBottom",
+    .fnOpen = (FilterOpen)mmapOpen,
+    .fnWrite = (FilterWrite)mmapWrite,
+    .fnRead = (FilterRead)mmapRead,
+    .fnClose = (FilterClose)mmapClose,
+    .fnSync = (FilterSync)mmapSync,
+    .fnBlockSize = (FilterBlockSize)mmapBlockSize,
+    .fnSeek = (FilterSeek)mmapSeek,
+    .fnDelete = (FilterDelete)mmapDelete,
+    .fnPread = (FilterPread)mmapPread,
+    .fnPwrite = (FilterPwrite)mmapPwrite,
+    .fnBorrow = (FilterBorrow)mmapBorrow,
+    .fnReturn = (FilterReturn)mmapReturn,
+};
+
+
+/**
+ * Create a new memory mapped file Sink.
+ */
+MmapBottom *mmapBottomNew()
+{
+    MmapBottom *this = malloc(sizeof(MmapBottom));
+    *this = (MmapBottom)
+    {
+        .fd = -1,
+        .filter = (Filter){
+            .iface=&mmapInterface,
+            .next=NULL}
+    };
+    return this;
+}
@@ -0,0 +1,13 @@
+/* */
+/* Sink which reads files through a memory mapping. */
+/* */
+
+#ifndef FILTER_MmapBottom_H
+#define FILTER_MmapBottom_H
+
+#include "common/filter.h"
+
+typedef struct MmapBottom MmapBottom;
+MmapBottom *mmapBottomNew();
+
+#endif /*FILTER_MmapBottom_H */
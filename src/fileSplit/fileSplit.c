@@ -131,6 +131,34 @@ size_t fileSplitRead(FileSplit *this, Byte *buf, size_t size, Error *error)
     return actual;
 }
 
+/**
+ * Read from an explicit position, switching segments only when needed.
+ */
+size_t fileSplitPread(FileSplit *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (isError(*error)) return 0;
+
+    /* If the position is in a different segment, then open the new segment */
+    off_t oldPosition = this->position;
+    this->position = offset;
+    if (sizeRoundDown(offset, this->segmentSize) != sizeRoundDown(oldPosition, this->segmentSize))
+        openCurrentSegment(this, error);
+
+    /* If crossing segment boundary, truncate to the end of segment. */
+    size_t start = offset % this->segmentSize;
+    size_t truncSize = sizeMin(this->segmentSize - start, size);
+
+    /* Read the possibly truncated buffer from the segment. */
+    size_t actual = fileReadAt(this->file, buf, truncSize, start, error);
+    this->position += actual;
+
+    /* If we just finished reading an entire segment, advance to the next segment. */
+    if (start + actual == this->segmentSize)
+        openCurrentSegment(this, error);
+
+    return actual;
+}
+
 off_t fileSplitSeek(FileSplit *this, off_t position, Error *error)
 {
     /* Special case for seeking to end */
@@ -202,6 +230,34 @@ size_t fileSplitWrite(FileSplit *this, const Byte *buf, size_t size, Error *erro
     return actual;
 }
 
+/**
+ * Write to an explicit position, switching segments only when needed.
+ */
+size_t fileSplitPwrite(FileSplit *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    if (isError(*error)) return 0;
+
+    /* If the position is in a different segment, then open the new segment */
+    off_t oldPosition = this->position;
+    this->position = offset;
+    if (sizeRoundDown(offset, this->segmentSize) != sizeRoundDown(oldPosition, this->segmentSize))
+        openCurrentSegment(this, error);
+
+    /* If crossing segment boundary, then truncate write at the end of segment. */
+    size_t start = offset % this->segmentSize;
+    size_t truncSize = sizeMin(this->segmentSize - start, size);
+
+    /* Write the possibly truncated buffer to the segment. */
+    size_t actual = fileWriteAt(this->file, buf, truncSize, start, error);
+    this->position += actual;
+
+    /* If we have filled the current segment, then open up the next segment. */
+    if (start + actual == this->segmentSize)
+        openCurrentSegment(this, error);
+
+    return actual;
+}
+
 /**
  * Close the group of files.
  */
@@ -263,13 +319,16 @@ size_t fileSplitBlockSize(FileSplit *this, size_t blockSize, Error *error)
 }
 
 static FilterInterface fileSplitInterface = {
+    .name = "FileSplit",
     .fnClose = (FilterClose)fileSplitClose,
     .fnOpen = (FilterOpen)fileSplitOpen,
     .fnRead = (FilterRead)fileSplitRead,
     .fnWrite = (FilterWrite)fileSplitWrite,
     .fnSeek = (FilterSeek)fileSplitSeek,
     .fnBlockSize = (FilterBlockSize)fileSplitBlockSize,
-    .fnDelete = (FilterDelete)fileSplitDelete
+    .fnDelete = (FilterDelete)fileSplitDelete,
+    .fnPread = (FilterPread)fileSplitPread,
+    .fnPwrite = (FilterPwrite)fileSplitPwrite,
 };
 
 /**
@@ -286,7 +345,8 @@ FileSplit *fileSplitNew(size_t suggestedSize, PathGetter getPath, void *pathData
     *this = (FileSplit) {
         .getPath = getPath,
         .pathData = pathData,
-        .suggestedSize = suggestedSize
+        .suggestedSize = suggestedSize,
+        .segmentSize = suggestedSize,  /* Until the block size is negotiated, since we open the first segment before then. */
     };
     return filterInit(this, &fileSplitInterface, next);
 }
@@ -5,20 +5,48 @@
 #ifndef FILTER_IoStack_H
 #define FILTER_IoStack_H
 
+#include <sys/uio.h>
 #include "iostack_error.h"
 
 typedef struct IoStack IoStack;
 
+/* Statistics for one stage of a pipeline, gathered while statistics are enabled. */
+typedef struct FileStats {
+    const char *name;       /* Which filter this stage is */
+    uint64_t calls;         /* Events handled by this stage */
+    uint64_t bytesRead;     /* Bytes passed up to the previous stage */
+    uint64_t bytesWritten;  /* Bytes accepted from the previous stage */
+    uint64_t nanoseconds;   /* Time spent in this stage, not counting later stages */
+    uint64_t seeks;
+    uint64_t fills;         /* Buffers read in */
+    uint64_t flushes;       /* Buffers written out */
+} FileStats;
+
 IoStack *ioStackNew(void *next);
 
 /* The basic requests handled by an I/O Stack */
 IoStack *fileOpen(IoStack *this, const char *path, int oflags, int perm, Error *error);
-size_t fileWrite(IoStack *this, Byte *buf, size_t bufSize, Error *error);
+size_t fileWrite(IoStack *this, const Byte *buf, size_t bufSize, Error *error);
 size_t fileRead(IoStack *this, Byte *buf, size_t bufSize, Error *error);
+size_t fileWritev(IoStack *this, const struct iovec *iov, size_t iovCnt, Error *error);
+size_t fileReadv(IoStack *this, const struct iovec *iov, size_t iovCnt, Error *error);
+
+/*
+ * Positional I/O saves a separate seek, but it is not thread safe like pread/pwrite.
+ * Filters keep per-handle state, like a buffer or the current position, so a handle must
+ * not be used by more than one thread at a time. Threads doing I/O concurrently should open
+ * handles of their own. Afterwards, the sequential position is unspecified until fileSeek.
+ */
+size_t fileWriteAt(IoStack *this, const Byte *buf, size_t bufSize, off_t offset, Error *error);
+size_t fileReadAt(IoStack *this, Byte *buf, size_t bufSize, off_t offset, Error *error);
 void fileClose(IoStack *this, Error *error);
 off_t fileSeek(IoStack *this, off_t position, Error *error);
 void fileDelete(IoStack *this, char *name, Error *error);
 
+/* Per stage statistics of an open file. Statistics are off until enabled. */
+size_t fileStats(IoStack *this, FileStats *stats, size_t maxStats);
+void fileStatsEnable(bool enable);
+
 /* Helper function for formatted output */
 bool filePrintf(void *this, Error *error, char *format, ...);
 
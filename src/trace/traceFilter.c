@@ -0,0 +1,425 @@
+/**
+ * A transparent filter which records the Open, Read, Write, Seek, Sync and Close events
+ * passing through it, along with their size, position and latency. Since it doesn't change
+ * the data, it can be inserted between any two stages of a pipeline, showing how long the
+ * stages below it take to respond.
+ *
+ * The vectored, positional and borrowing events are recorded and passed on as they are,
+ * so inserting a trace point doesn't turn them into plain reads and writes.
+ *
+ * Records go into a ring which can be shared by many trace filters, possibly on different threads.
+ * A filter claims a slot with an atomic increment and publishes the record by storing its sequence number,
+ * so recording an event never takes a lock. When the ring wraps around, the oldest records are overwritten.
+ * A dump skips any record which is being rewritten while it is copied.
+ *
+ * The ring can be dumped as Chrome trace JSON (chrome://tracing or Perfetto), where each open file is
+ * its own track, or as a compact binary log:
+ *     header:  "IOTRACE1" count(8)
+ *     record:  start(8) duration(8) position(8) size(8) actual(8) error(4) track(4) event(1) stageLen(1) stage
+ * All integers are big endian and times are in nanoseconds since the ring was created.
+ * For Seek, "size" is the requested position and "actual" is the resulting position.
+ * For Pread and Pwrite, "position" is the explicit offset. Returning a borrowed buffer is not recorded.
+ */
+#include <stdlib.h>
+#include <sys/fcntl.h>
+#include "common/passThrough.h"
+#include "file/fileSystemBottom.h"
+#include "trace/traceFilter.h"
+#include "iostack.h"
+
+typedef enum TraceEvent {traceOpen, traceRead, traceWrite, traceSeek, traceSync, traceClose,
+                        traceReadv, traceWritev, tracePread, tracePwrite, traceBorrow} TraceEvent;
+static const char *eventNames[] = {"Open", "Read", "Write", "Seek", "Sync", "Close",
+                                   "Readv", "Writev", "Pread", "Pwrite", "Borrow"};
+
+typedef struct TraceRecord {
+    uint64_t seq;          /* Ticket+1 once the record is complete, zero while being written */
+    uint64_t start;        /* Nanoseconds since the ring was created */
+    uint64_t duration;
+    int64_t position;      /* File position when the event started */
+    int64_t size;          /* Bytes requested */
+    int64_t actual;        /* Bytes transferred */
+    int32_t error;         /* Error code of the event, zero if OK */
+    uint32_t track;        /* Which open file recorded the event */
+    TraceEvent event;
+    const char *stage;     /* Name of the filter below the trace point */
+} TraceRecord;
+
+struct TraceRing {
+    uint64_t head;         /* Number of tickets handed out so far */
+    uint64_t mask;         /* Capacity-1, where capacity is a power of two */
+    uint64_t epoch;        /* When the ring was created */
+    TraceRecord *records;
+};
+
+struct TraceFilter {
+    Filter filter;         /* Common to all filters */
+    TraceRing *ring;       /* Where we record events */
+    uint32_t track;        /* Identifies this trace point */
+    const char *stage;     /* Name of the filter below us */
+    off_t position;        /* Our current file position */
+};
+
+static uint32_t nextTrack = 0;
+
+static void traceRecord(TraceFilter *this, TraceEvent event, uint64_t start, off_t size, off_t actual, Error *error);
+static size_t traceSnapshot(TraceRing *ring, TraceRecord *copy);
+static size_t iovSize(const struct iovec *iov, size_t iovCnt);
+
+
+/**
+ * Open a file, giving the newly opened file its own track.
+ */
+TraceFilter *traceFilterOpen(TraceFilter *pipe, const char *path, int oflags, int perm, Error *error)
+{
+    uint64_t start = statsNow();
+    Filter *next = passThroughOpen(pipe, path, oflags, perm, error);
+
+    TraceFilter *this = traceFilterNew(pipe->ring, next);
+    traceRecord(this, traceOpen, start, 0, 0, error);
+
+    return this;
+}
+
+
+size_t traceFilterRead(TraceFilter *this, Byte *buf, size_t size, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughRead(this, buf, size, error);
+    traceRecord(this, traceRead, start, size, actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+size_t traceFilterWrite(TraceFilter *this, const Byte *buf, size_t size, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughWrite(this, buf, size, error);
+    traceRecord(this, traceWrite, start, size, actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+size_t traceFilterReadv(TraceFilter *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughReadv(this, iov, iovCnt, error);
+    traceRecord(this, traceReadv, start, iovSize(iov, iovCnt), actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+size_t traceFilterWritev(TraceFilter *this, const struct iovec *iov, size_t iovCnt, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughWritev(this, iov, iovCnt, error);
+    traceRecord(this, traceWritev, start, iovSize(iov, iovCnt), actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+size_t traceFilterPread(TraceFilter *this, Byte *buf, size_t size, off_t offset, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughPread(this, buf, size, offset, error);
+    this->position = offset;
+    traceRecord(this, tracePread, start, size, actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+size_t traceFilterPwrite(TraceFilter *this, const Byte *buf, size_t size, off_t offset, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughPwrite(this, buf, size, offset, error);
+    this->position = offset;
+    traceRecord(this, tracePwrite, start, size, actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+size_t traceFilterBorrow(TraceFilter *this, Byte **buf, size_t size, Error *error)
+{
+    uint64_t start = statsNow();
+    size_t actual = passThroughBorrow(this, buf, size, error);
+    traceRecord(this, traceBorrow, start, size, actual, error);
+
+    this->position += actual;
+    return actual;
+}
+
+
+void traceFilterReturn(TraceFilter *this, Byte *buf, Error *error)
+{
+    passThroughReturn(this, buf, error);
+}
+
+
+off_t traceFilterSeek(TraceFilter *this, off_t position, Error *error)
+{
+    uint64_t start = statsNow();
+    off_t actual = passThroughSeek(this, position, error);
+    traceRecord(this, traceSeek, start, position, actual, error);
+
+    this->position = actual;
+    return actual;
+}
+
+
+void traceFilterSync(TraceFilter *this, Error *error)
+{
+    uint64_t start = statsNow();
+    passThroughSync(this, error);
+    traceRecord(this, traceSync, start, 0, 0, error);
+}
+
+
+void traceFilterClose(TraceFilter *this, Error *error)
+{
+    uint64_t start = statsNow();
+    passThroughClose(this, error);
+    traceRecord(this, traceClose, start, 0, 0, error);
+
+    free(this);
+}
+
+
+/**
+ * We don't transform data, so we just agree with the block sizes of our neighbors.
+ */
+size_t traceFilterBlockSize(TraceFilter *this, size_t prevSize, Error *error)
+{
+    return passThroughBlockSize(this, prevSize, error);
+}
+
+
+/*
+ * Record an event in the ring without taking a lock.
+ */
+static void traceRecord(TraceFilter *this, TraceEvent event, uint64_t start, off_t size, off_t actual, Error *error)
+{
+    TraceRing *ring = this->ring;
+    uint64_t end = statsNow();
+
+    /* Claim a slot, marking it in progress so a concurrent dump won't use a half written record. */
+    uint64_t ticket = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    TraceRecord *record = &ring->records[ticket & ring->mask];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    /* Fill it in. */
+    record->start = start - ring->epoch;
+    record->duration = end - start;
+    record->position = this->position;
+    record->size = size;
+    record->actual = actual;
+    record->error = error->code;
+    record->track = this->track;
+    record->event = event;
+    record->stage = this->stage;
+
+    /* Publish it. */
+    __atomic_store_n(&record->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Total size of the buffers in a vector.
+ */
+static size_t iovSize(const struct iovec *iov, size_t iovCnt)
+{
+    size_t size = 0;
+    for (size_t idx = 0; idx < iovCnt; idx++)
+        size += iov[idx].iov_len;
+    return size;
+}
+
+
+/*
+ * Copy the completed records out of the ring, oldest first, skipping any which are being rewritten.
+ */
+static size_t traceSnapshot(TraceRing *ring, TraceRecord *copy)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t capacity = ring->mask + 1;
+    uint64_t first = (head > capacity)? head - capacity: 0;
+
+    size_t count = 0;
+    for (uint64_t ticket = first; ticket < head; ticket++)
+    {
+        TraceRecord *record = &ring->records[ticket & ring->mask];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != ticket + 1)
+            continue;
+
+        /* Keep the copy only if the record didn't change while we were copying it. */
+        copy[count] = *record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == ticket + 1)
+            count++;
+    }
+
+    return count;
+}
+
+
+/**
+ * Dump the ring as Chrome trace JSON.
+ */
+bool traceDumpJson(TraceRing *ring, const char *path, Error *error)
+{
+    TraceRecord *records = malloc((ring->mask + 1) * sizeof(TraceRecord));
+    size_t count = traceSnapshot(ring, records);
+
+    FileSystemBottom *bottom = fileSystemBottomNew();
+    IoStack *pipe = ioStackNew(bottom);
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, error);
+
+    filePrintf(file, error, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (size_t idx = 0; idx < count && !isError(*error); idx++)
+    {
+        TraceRecord *r = &records[idx];
+        filePrintf(file, error,
+                   "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+                   "\"ts\": %.3f, \"dur\": %.3f, "
+                   "\"args\": {\"position\": %lld, \"size\": %lld, \"actual\": %lld, \"error\": %d}}",
+                   (idx == 0)? "": ",", eventNames[r->event], r->stage, r->track,
+                   r->start / 1000.0, r->duration / 1000.0,
+                   (long long)r->position, (long long)r->size, (long long)r->actual, r->error);
+    }
+    filePrintf(file, error, "\n]}\n");
+
+    fileClose(file, error);
+    free(pipe);
+    free(bottom);
+    free(records);
+
+    return isError(*error);
+}
+
+
+/**
+ * Dump the ring as a compact binary log.
+ */
+bool traceDumpBinary(TraceRing *ring, const char *path, Error *error)
+{
+    TraceRecord *records = malloc((ring->mask + 1) * sizeof(TraceRecord));
+    size_t count = traceSnapshot(ring, records);
+
+    FileSystemBottom *bottom = fileSystemBottomNew();
+    IoStack *pipe = ioStackNew(bottom);
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, error);
+
+    /* Header */
+    if (!isError(*error))
+        fileWrite(file, (Byte *)"IOTRACE1", 8, error);
+    filePut8(file, count, error);
+
+    /* Records */
+    for (size_t idx = 0; idx < count && !isError(*error); idx++)
+    {
+        TraceRecord *r = &records[idx];
+        size_t stageLen = sizeMin(strlen(r->stage), 255);
+        filePut8(file, r->start, error);
+        filePut8(file, r->duration, error);
+        filePut8(file, r->position, error);
+        filePut8(file, r->size, error);
+        filePut8(file, r->actual, error);
+        filePut4(file, r->error, error);
+        filePut4(file, r->track, error);
+        filePut1(file, r->event, error);
+        filePut1(file, stageLen, error);
+        fileWrite(file, (const Byte *)r->stage, stageLen, error);
+    }
+
+    fileClose(file, error);
+    free(pipe);
+    free(bottom);
+    free(records);
+
+    return isError(*error);
+}
+
+
+/**
+ * Create a ring to hold trace records. The capacity is rounded up to a power of two.
+ */
+TraceRing *traceRingNew(size_t capacity)
+{
+    size_t actualCapacity = 1;
+    while (actualCapacity < capacity)
+        actualCapacity *= 2;
+
+    TraceRing *ring = malloc(sizeof(TraceRing));
+    *ring = (TraceRing){
+        .mask = actualCapacity - 1,
+        .epoch = statsNow(),
+        .records = calloc(actualCapacity, sizeof(TraceRecord)),
+    };
+
+    return ring;
+}
+
+
+void traceRingFree(TraceRing *ring)
+{
+    free(ring->records);
+    free(ring);
+}
+
+
+/**
+ * The number of events recorded so far, including those which have been overwritten.
+ */
+size_t traceRingCount(TraceRing *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+
+FilterInterface traceFilterInterface = (FilterInterface) {
+    .name = "TraceFilter",
+    .fnOpen = (FilterOpen)traceFilterOpen,
+    .fnRead = (FilterRead)traceFilterRead,
+    .fnWrite = (FilterWrite)traceFilterWrite,
+    .fnSeek = (FilterSeek)traceFilterSeek,
+    .fnSync = (FilterSync)traceFilterSync,
+    .fnClose = (FilterClose)traceFilterClose,
+    .fnBlockSize = (FilterBlockSize)traceFilterBlockSize,
+    .fnReadv = (FilterReadv)traceFilterReadv,
+    .fnWritev = (FilterWritev)traceFilterWritev,
+    .fnPread = (FilterPread)traceFilterPread,
+    .fnPwrite = (FilterPwrite)traceFilterPwrite,
+    .fnBorrow = (FilterBorrow)traceFilterBorrow,
+    .fnReturn = (FilterReturn)traceFilterReturn,
+};
+
+
+/**
+ * Create a trace point which records events into the given ring as they pass through to the next filter.
+ */
+TraceFilter *traceFilterNew(TraceRing *sink, void *next)
+{
+    TraceFilter *this = malloc(sizeof(TraceFilter));
+    *this = (TraceFilter) {
+        .ring = sink,
+        .track = __atomic_fetch_add(&nextTrack, 1, __ATOMIC_RELAXED),
+        .position = 0,
+    };
+
+    filterInit(this, &traceFilterInterface, next);
+    this->stage = this->filter.next->iface->name;
+
+    return this;
+}
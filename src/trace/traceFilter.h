@@ -0,0 +1,24 @@
+/* */
+/* Transparent filter which records the events passing through it. */
+/* */
+
+#ifndef FILTER_TraceFilter_H
+#define FILTER_TraceFilter_H
+
+#include "common/filter.h"
+
+typedef struct TraceFilter TraceFilter;
+typedef struct TraceRing TraceRing;
+
+/* A ring of trace records, shared by any number of trace filters and threads. */
+TraceRing *traceRingNew(size_t capacity);
+void traceRingFree(TraceRing *ring);
+size_t traceRingCount(TraceRing *ring);
+
+/* Dump the records currently in the ring, oldest first. */
+bool traceDumpJson(TraceRing *ring, const char *path, Error *error);
+bool traceDumpBinary(TraceRing *ring, const char *path, Error *error);
+
+TraceFilter *traceFilterNew(TraceRing *sink, void *next);
+
+#endif /*FILTER_TraceFilter_H */
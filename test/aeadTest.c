@@ -1,15 +1,138 @@
 /*  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "file/buffered.h"
 #include "file/fileSystemBottom.h"
+#include "file/mmapBottom.h"
 #include "encrypt/libcrypto/aead.h"
 #include "iostack.h"
 
 #include "framework/fileFramework.h"
 #include "framework/unitTest.h"
 
+/* Create a file with the "auto" cipher and verify the header names a real cipher. */
+static void autoCipherTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    fileWrite(file, (Byte *)"Hello, world", 12, &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* The header is a sized record holding the record size, then the length and name of the cipher. */
+    Byte header[64];
+    FILE *raw = fopen(path, "r");
+    PG_ASSERT(raw != NULL);
+    size_t actual = fread(header, 1, sizeof(header), raw);
+    PG_ASSERT_EQ(sizeof(header), actual);
+    fclose(raw);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", header[8], (char *)header + 9);
+    PG_ASSERT(strcmp(name, "AES-256-GCM") == 0 || strcmp(name, "ChaCha20-Poly1305") == 0);
+}
+
+
+/* The file size comes from the size of the encrypted file, so it doesn't depend on decrypting the final record. */
+static void sizeWithoutDecryptingTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[2500] = {0};
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    fileWrite(file, buf, sizeof(buf), &error);
+
+    /* Having created the file, we know its size without looking. */
+    off_t written = fileSeek(file, FILE_END_POSITION, &error);
+    PG_ASSERT_EQ(sizeof(buf), written);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* Damage the final record's tag. */
+    FILE *raw = fopen(path, "r+");
+    PG_ASSERT(raw != NULL);
+    fseek(raw, -1, SEEK_END);
+    int last = fgetc(raw);
+    fseek(raw, -1, SEEK_END);
+    fputc(last ^ 1, raw);
+    fclose(raw);
+
+    /* We still get the size, but reading the final record fails. */
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    off_t size = fileSeek(file, FILE_END_POSITION, &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(sizeof(buf), size);
+
+    fileSeek(file, 2048, &error);
+    fileRead(file, buf, sizeof(buf), &error);
+    PG_ASSERT(isError(error) && !errorIsEOF(error));
+    error = errorOK;
+    fileClose(file, &error);
+}
+
+
+/* Create new files without O_TRUNC, which the file framework always passes, and read them back. */
+static void createWithoutTruncateTest(IoStack *pipe, char *path)
+{
+    int modes[] = {O_RDWR, O_WRONLY};
+    for (size_t idx = 0; idx < sizeof(modes) / sizeof(modes[0]); idx++)
+    {
+        Error error = errorOK;
+        unlink(path);
+        IoStack *file = fileOpen(pipe, path, modes[idx]|O_CREAT, 0666, &error);
+        size_t actual = fileWrite(file, (Byte *)"Hello", 5, &error);
+        PG_ASSERT_OK(error);
+        PG_ASSERT_EQ(5, actual);
+        fileClose(file, &error);
+        PG_ASSERT_OK(error);
+
+        Byte buf[16];
+        file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+        actual = fileRead(file, buf, sizeof(buf), &error);
+        PG_ASSERT_OK(error);
+        PG_ASSERT_EQ(5, actual);
+        PG_ASSERT(memcmp(buf, "Hello", 5) == 0);
+        fileClose(file, &error);
+        PG_ASSERT_OK(error);
+    }
+}
+
+
+/* A file which lost its final record is reported as truncated, rather than ending early. */
+static void missingFinalRecordTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[2048] = {0};
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* The file ends with an empty record, which is only a tag. Cut it off. */
+    struct stat st;
+    stat(path, &st);
+    PG_ASSERT_EQ(0, truncate(path, st.st_size - 16));
+
+    /* Asking for the size fails. */
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    fileSeek(file, FILE_END_POSITION, &error);
+    PG_ASSERT(isError(error) && !errorIsEOF(error));
+    error = errorOK;
+    fileClose(file, &error);
+
+    /* So does reading to the end. */
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    while (!isError(error))
+        fileRead(file, buf, sizeof(buf), &error);
+    PG_ASSERT(!errorIsEOF(error));
+    error = errorOK;
+    fileClose(file, &error);
+}
+
+
 void testMain()
 {
     system("rm -rf " TEST_DIR "encryption; mkdir -p " TEST_DIR "encryption");
@@ -23,4 +146,59 @@ void testMain()
 
     //singleSeekTest(stream, TEST_DIR "encryption/testfile_%u_%u.dat", 64, 1024);
     seekTest(stream, TEST_DIR "encryption/testfile_%u_%u.dat");
+    sizeWithoutDecryptingTest(stream, TEST_DIR "encryption/size.dat");
+    missingFinalRecordTest(stream, TEST_DIR "encryption/missing.dat");
+    createWithoutTruncateTest(stream, TEST_DIR "encryption/created.dat");
+
+    beginTestGroup("ChaCha20-Poly1305 Encrypted Files");
+    IoStack *chacha =
+        ioStackNew(
+            bufferedNew(1024,
+                aeadFilterNew("ChaCha20-Poly1305", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                    fileSystemBottomNew())));
+    seekTest(chacha, TEST_DIR "encryption/chacha_%u_%u.dat");
+
+    beginTestGroup("Encrypted Files with the Cipher Chosen Automatically");
+    IoStack *automatic =
+        ioStackNew(
+            bufferedNew(1024,
+                aeadFilterNew("auto", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                    fileSystemBottomNew())));
+    autoCipherTest(automatic, TEST_DIR "encryption/auto.dat");
+    seekTest(automatic, TEST_DIR "encryption/auto_%u_%u.dat");
+
+    beginTestGroup("AES Encrypted Files in Parallel");
+    IoStack *parallel =
+        ioStackNew(
+            bufferedNew(1024,
+                aeadFilterParallelNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32, 4,
+                    fileSystemBottomNew())));
+    seekTest(parallel, TEST_DIR "encryption/parallel_%u_%u.dat");
+
+    beginTestGroup("AES Encrypted Files with Vectored I/O");
+    IoStack *vector =
+        ioStackNew(
+            aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                fileSystemBottomNew()));
+    vectorTest(vector, TEST_DIR "encryption/vector_%u_%u.dat");
+
+    beginTestGroup("AES Encrypted Files with Positional I/O");
+    positionalTest(vector, TEST_DIR "encryption/positional_%u_%u.dat");
+    positionalTest(stream, TEST_DIR "encryption/bufferedPositional_%u_%u.dat");
+
+    beginTestGroup("AES Encrypted Files Borrowing Buffers");
+    IoStack *mapped =
+        ioStackNew(
+            bufferedNew(1024,
+                aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                    mmapBottomNew())));
+    seekTest(mapped, TEST_DIR "encryption/mapped_%u_%u.dat");
+
+    IoStack *lent =
+        ioStackNew(
+            bufferedNew(1024,
+                aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                    bufferedNew(16*1024,
+                        fileSystemBottomNew()))));
+    seekTest(lent, TEST_DIR "encryption/lent_%u_%u.dat");
 }
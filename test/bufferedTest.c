@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/fcntl.h>
+#include <unistd.h>
 #include "iostack.h"
 #include "file/fileSystemBottom.h"
 #include "file/buffered.h"
@@ -9,6 +10,68 @@
 #include "framework/fileFramework.h"
 #include "framework/unitTest.h"
 
+/* Write and read back a file with statistics enabled, checking what each stage saw. */
+static void statsTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[100] = {0};
+    size_t fileSize = 104 * sizeof(buf);  /* 10 full blocks and a partial one */
+    FileStats stats[4];
+    fileStatsEnable(true);
+
+    /* Write the file in small pieces. Only full blocks reach the file system before closing. */
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &error);
+    for (size_t position = 0; position < fileSize; position += sizeof(buf))
+        fileWrite(file, buf, sizeof(buf), &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(2, fileStats(file, stats, 4));
+    PG_ASSERT_EQ_STR("Buffered", stats[0].name);
+    PG_ASSERT_EQ_STR("FileSystemBottom", stats[1].name);
+    PG_ASSERT_EQ(fileSize, stats[0].bytesWritten);
+    PG_ASSERT_EQ(10, stats[0].flushes);
+    PG_ASSERT_EQ(10*1024, stats[1].bytesWritten);
+    PG_ASSERT(stats[0].nanoseconds > 0 && stats[1].nanoseconds > 0);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* Read it back, one buffer fill per block. */
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    while (fileRead(file, buf, sizeof(buf), &error) > 0)
+        ;
+    PG_ASSERT_EOF(error);
+    PG_ASSERT_EQ(2, fileStats(file, stats, 4));
+    PG_ASSERT_EQ(fileSize, stats[0].bytesRead);
+    PG_ASSERT_EQ(11, stats[0].fills);
+    PG_ASSERT_EQ(fileSize, stats[1].bytesRead);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    fileStatsEnable(false);
+}
+
+
+/* Extend a new file opened without O_TRUNC. Once the first fill finds the end, later blocks neither read nor seek. */
+static void extendTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[1000] = {0};
+    FileStats stats[2];
+    unlink(path);
+    fileStatsEnable(true);
+
+    IoStack *file = fileOpen(pipe, path, O_RDWR|O_CREAT, 0666, &error);
+    for (int idx = 0; idx < 1000; idx++)
+        fileWrite(file, buf, sizeof(buf), &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(2, fileStats(file, stats, 2));
+    PG_ASSERT(stats[0].fills <= 1);
+    PG_ASSERT(stats[1].seeks <= 1);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    fileStatsEnable(false);
+}
+
 
 void testMain()
 {
@@ -21,6 +84,21 @@ void testMain()
 
     seekTest(stream, TEST_DIR "buffered/testfile_%u_%u.dat");
 
+    beginTestGroup("Buffered Files with Read Ahead");
+    IoStack *readAhead = ioStackNew(bufferedReadAheadNew(1024, 4, fileSystemBottomNew()));
+    seekTest(readAhead, TEST_DIR "buffered/readahead_%u_%u.dat");
+
+    beginTestGroup("Buffered Files with Write Behind");
+    IoStack *writeBehind = ioStackNew(bufferedWriteBehindNew(1024, 4, fileSystemBottomNew()));
+    seekTest(writeBehind, TEST_DIR "buffered/writebehind_%u_%u.dat");
+
+    beginTestGroup("Buffered Files with Positional I/O");
+    positionalTest(stream, TEST_DIR "buffered/positional_%u_%u.dat");
+
+    beginTestGroup("Buffered File Statistics");
+    statsTest(stream, TEST_DIR "buffered/stats.dat");
+    extendTest(ioStackNew(bufferedWriteBehindNew(4096, 4, fileSystemBottomNew())), TEST_DIR "buffered/extend.dat");
+
     // open/close/read/write errors.
 
    
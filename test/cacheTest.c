@@ -0,0 +1,233 @@
+/*  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/fcntl.h>
+#include <limits.h>
+#include "iostack.h"
+#include "file/fileSystemBottom.h"
+#include "file/buffered.h"
+#include "file/blockCache.h"
+#include "encrypt/libcrypto/aead.h"
+#include "compress/lz4/lz4.h"
+
+#include "framework/fileFramework.h"
+#include "framework/unitTest.h"
+
+
+/* Bounce between two blocks and verify only the first visit to each reaches the encryption filter. */
+static void hitTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[1024] = {0};
+    FileStats stats[4];
+
+    /* Create a file of four blocks. */
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &error);
+    for (int idx = 0; idx < 4; idx++)
+        fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* Alternate between the first and last blocks. */
+    fileStatsEnable(true);
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    for (int idx = 0; idx < 10; idx++)
+    {
+        fileReadAt(file, buf, sizeof(buf), 0, &error);
+        fileReadAt(file, buf, sizeof(buf), 3 * sizeof(buf), &error);
+    }
+    PG_ASSERT_OK(error);
+
+    /* Stages are Buffered, BlockCache, AeadFilter, FileSystemBottom. */
+    PG_ASSERT_EQ(4, fileStats(file, stats, 4));
+    PG_ASSERT_EQ_STR("AeadFilter", stats[2].name);
+    PG_ASSERT_EQ(2 * sizeof(buf), stats[2].bytesRead);
+
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+    fileStatsEnable(false);
+}
+
+
+/* Two handles on the same file share blocks through the pool, and see each other's writes. */
+static void sharingTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte old[1024], new[1024], buf[1024];
+    FileStats stats[3];
+    memset(old, 'o', sizeof(old));
+    memset(new, 'n', sizeof(new));
+
+    /* Create a file of four blocks, and read the second one through a reader. */
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &error);
+    for (int idx = 0; idx < 4; idx++)
+        fileWrite(file, old, sizeof(old), &error);
+    fileClose(file, &error);
+    IoStack *reader = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    fileReadAt(reader, buf, sizeof(buf), sizeof(buf), &error);
+    PG_ASSERT_OK(error);
+
+    /* A second handle finds the block in the pool, so it doesn't reach the encryption filter. */
+    IoStack *writer = fileOpen(pipe, path, O_RDWR, 0, &error);
+    fileStatsEnable(true);
+    fileReadAt(writer, buf, sizeof(buf), sizeof(buf), &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(3, fileStats(writer, stats, 3));
+    PG_ASSERT_EQ_STR("AeadFilter", stats[1].name);
+    PG_ASSERT_EQ(0, stats[1].bytesRead);
+    PG_ASSERT(memcmp(buf, old, sizeof(buf)) == 0);
+    fileStatsEnable(false);
+
+    /* Rewrite the block. Once written, the reader sees the new data when it comes back to the block. */
+    fileWriteAt(writer, new, sizeof(new), sizeof(new), &error);
+    fileSeek(writer, 0, &error);
+    fileReadAt(reader, buf, sizeof(buf), 0, &error);
+    fileReadAt(reader, buf, sizeof(buf), sizeof(buf), &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT(memcmp(buf, new, sizeof(buf)) == 0);
+
+    fileClose(writer, &error);
+    fileClose(reader, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+/* A block read while another handle overwrote it isn't published, so nobody finds the old data. */
+static void staleTest(void)
+{
+    BufferPool *pool = bufferPoolNew(4 * 1024);
+    PoolFile file = {.pipeline = pool, .device = 1, .inode = 2};
+
+    /* The reader notes the generation and starts reading, then a writer invalidates the block. */
+    uint64_t generation = bufferPoolGeneration(pool, &file, 3);
+    PoolFrame *frame = bufferPoolAllocate(pool, &file, 3, 1024);
+    bufferPoolForget(pool, &file, 3, 3);
+    bufferPoolPublish(pool, frame, 1024, generation);
+    bufferPoolUnpin(pool, frame);
+    PG_ASSERT(bufferPoolPin(pool, &file, 3) == NULL);
+
+    /* Read again with nothing in the way, and the block is published. */
+    generation = bufferPoolGeneration(pool, &file, 3);
+    frame = bufferPoolAllocate(pool, &file, 3, 1024);
+    bufferPoolPublish(pool, frame, 1024, generation);
+    bufferPoolUnpin(pool, frame);
+    frame = bufferPoolPin(pool, &file, 3);
+    PG_ASSERT(frame != NULL);
+    bufferPoolUnpin(pool, frame);
+
+    bufferPoolFree(pool);
+}
+
+
+/* Idle handles let go of their blocks, so many open files stay within the pool's limit. */
+static void idleTest(IoStack *pipe, BufferPool *pool, size_t limit, char *nameFmt)
+{
+    Error error = errorOK;
+    Byte buf[1024] = {0};
+    char path[PATH_MAX];
+    IoStack *files[8];
+
+    /* Create the files, one block each. */
+    for (int idx = 0; idx < 8; idx++)
+    {
+        snprintf(path, sizeof(path), nameFmt, idx);
+        IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &error);
+        fileWrite(file, buf, sizeof(buf), &error);
+        fileClose(file, &error);
+    }
+    PG_ASSERT_OK(error);
+
+    /* Open them all at once and read a bit of each. Once idle, none of them hold a block. */
+    for (int idx = 0; idx < 8; idx++)
+    {
+        snprintf(path, sizeof(path), nameFmt, idx);
+        files[idx] = fileOpen(pipe, path, O_RDONLY, 0, &error);
+        fileRead(files[idx], buf, 100, &error);
+    }
+    PG_ASSERT_OK(error);
+    PG_ASSERT(bufferPoolMemoryUsed(pool) <= limit);
+
+    for (int idx = 0; idx < 8; idx++)
+        fileClose(files[idx], &error);
+    PG_ASSERT_OK(error);
+}
+
+
+/* Several threads, each working on their own files through a pipeline sharing one pool. */
+static IoStack *sharedPipe;
+
+static void *sharedThread(void *arg)
+{
+    char nameFmt[64];
+    snprintf(nameFmt, sizeof(nameFmt), TEST_DIR "cache/thread%zu_%%u_%%u.dat", (size_t)arg);
+    singleSeekTest(sharedPipe, nameFmt, 64 * 1024, 1024);
+    return NULL;
+}
+
+static void threadTest(IoStack *pipe)
+{
+    pthread_t threads[4];
+    sharedPipe = pipe;
+    for (size_t idx = 0; idx < 4; idx++)
+        pthread_create(&threads[idx], NULL, sharedThread, (void *)idx);
+    for (size_t idx = 0; idx < 4; idx++)
+        pthread_join(threads[idx], NULL);
+}
+
+
+void testMain()
+{
+    system("rm -rf " TEST_DIR "cache; mkdir -p " TEST_DIR "cache");
+
+    beginTestGroup("Cached Encrypted Files");
+    IoStack *encrypted =
+        ioStackNew(
+            bufferedNew(1024,
+                blockCacheNew(8,
+                    aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                        fileSystemBottomNew()))));
+    hitTest(encrypted, TEST_DIR "cache/hits.dat");
+    seekTest(encrypted, TEST_DIR "cache/encrypted_%u_%u.dat");
+
+    beginTestGroup("Cached Compressed Files");
+    IoStack *compressed =
+        ioStackNew(
+            bufferedNew(1024,
+                blockCacheNew(8,
+                    lz4CompressNew(1024,
+                        bufferedNew(1024,
+                            fileSystemBottomNew())))));
+    readSeekTest(compressed, TEST_DIR "cache/compressed_%u_%u.lz4");
+
+    /* A pool smaller than the files, so blocks are constantly replaced. */
+    beginTestGroup("Shared Cache Encrypted Files");
+    BufferPool *pool = bufferPoolNew(16 * 1024);
+    IoStack *shared =
+        ioStackNew(
+            bufferedNew(1024,
+                blockCacheSharedNew(pool,
+                    aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                        fileSystemBottomNew()))));
+    staleTest();
+    hitTest(shared, TEST_DIR "cache/sharedHits.dat");
+    seekTest(shared, TEST_DIR "cache/shared_%u_%u.dat");
+    threadTest(shared);
+
+    /* Buffered takes its blocks from the pool, so handles on the same file share them. */
+    beginTestGroup("Shared Buffered Encrypted Files");
+    BufferPool *bufferedPool = bufferPoolNew(16 * 1024);
+    IoStack *sharedBuffered =
+        ioStackNew(
+            bufferedSharedNew(1024, bufferedPool,
+                aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                    fileSystemBottomNew())));
+    sharingTest(sharedBuffered, TEST_DIR "cache/sharing.dat");
+
+    /* A pool too small to give every open file a block of its own. */
+    BufferPool *smallPool = bufferPoolNew(4 * 1024);
+    idleTest(ioStackNew(bufferedSharedNew(1024, smallPool, fileSystemBottomNew())), smallPool, 4 * 1024, TEST_DIR "cache/idle_%d.dat");
+    seekTest(sharedBuffered, TEST_DIR "cache/sharedBuffered_%u_%u.dat");
+    threadTest(sharedBuffered);
+}
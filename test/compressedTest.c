@@ -0,0 +1,78 @@
+/*  */
+#include <stdio.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include "common/filter.h"
+#include "iostack_error.h"
+#include "file/fileSystemBottom.h"
+#include "file/buffered.h"
+#include "compress/compressed.h"
+#include "iostack.h"
+
+#include "framework/fileFramework.h"
+#include "framework/unitTest.h"
+
+
+static IoStack *compressedStackNew(char *codecName, size_t blockSize)
+{
+    return ioStackNew(
+                bufferedNew(blockSize,
+                    compressedFilterNew(codecName, blockSize,
+                        bufferedNew(1024,
+                            fileSystemBottomNew()))));
+}
+
+
+/* Write a file with one codec and read it back through a filter configured for another. */
+static void codecHeaderTest(IoStack *writer, IoStack *reader, char *path)
+{
+    Error error = errorOK;
+    Byte buf[3000];
+    for (size_t idx = 0; idx < sizeof(buf); idx++)
+        buf[idx] = (Byte)(idx % 7);
+
+    IoStack *file = fileOpen(writer, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* The codec and block size come from the file header. */
+    file = fileOpen(reader, path, O_RDONLY, 0, &error);
+    off_t size = fileSeek(file, FILE_END_POSITION, &error);
+    PG_ASSERT_EQ(sizeof(buf), size);
+    fileSeek(file, 0, &error);
+
+    Byte readBuf[sizeof(buf) + 1];
+    size_t total = 0;
+    while (!isError(error) && total < sizeof(readBuf))
+        total += fileRead(file, readBuf + total, sizeof(readBuf) - total, &error);
+    PG_ASSERT_EOF(error);
+    PG_ASSERT_EQ(sizeof(buf), total);
+    PG_ASSERT(memcmp(buf, readBuf, sizeof(buf)) == 0);
+    error = errorOK;
+
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+void testMain()
+{
+    system("rm -rf " TEST_DIR "compressed_codec; mkdir -p " TEST_DIR "compressed_codec");
+
+    beginTestGroup("Compression with the LZ4 Codec");
+    IoStack *lz4 = compressedStackNew("lz4", 1024);
+    readSeekTest(lz4, TEST_DIR "compressed_codec/lz4_%u_%u.dat");
+
+    beginTestGroup("Compression with the Zstd Codec");
+    IoStack *zstd = compressedStackNew("zstd", 1024);
+    readSeekTest(zstd, TEST_DIR "compressed_codec/zstd_%u_%u.dat");
+
+    beginTestGroup("Compression with no Codec");
+    IoStack *none = compressedStackNew("none", 1024);
+    readSeekTest(none, TEST_DIR "compressed_codec/none_%u_%u.dat");
+
+    beginTestGroup("Codec Recorded in File Header");
+    IoStack *zstdLarge = compressedStackNew("zstd", 2048);
+    codecHeaderTest(zstdLarge, lz4, TEST_DIR "compressed_codec/header.dat");
+}
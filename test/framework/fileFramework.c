@@ -343,3 +343,195 @@ void readSeekTest(IoStack *pipe, char *nameFmt)
         for (int bufIdx = 0; bufIdx<countof(bufSize); bufIdx++)
             singleStreamTest(pipe, nameFmt, fileSize[fileIdx], bufSize[bufIdx]);
 }
+
+
+#define BLOCKS_PER_VECTOR 8
+
+/*
+ * Create a file using vectored writes, each vector holding several blocks.
+ */
+void generateVectorFile(IoStack *pipe, char *path, size_t fileSize, size_t blockSize)
+{
+    debug("generateVectorFile: path=%s\n", path);
+    Error error = errorOK;
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &error);
+    PG_ASSERT_OK(error);
+    Byte *buf = malloc(BLOCKS_PER_VECTOR * blockSize);
+
+    for (size_t position = 0; position < fileSize; )
+    {
+        /* Build a vector of blocks, the last of which may be partial. */
+        struct iovec iov[BLOCKS_PER_VECTOR];
+        size_t iovCnt, expected = 0;
+        for (iovCnt = 0; iovCnt < BLOCKS_PER_VECTOR && position + expected < fileSize; iovCnt++)
+        {
+            iov[iovCnt].iov_base = buf + iovCnt * blockSize;
+            iov[iovCnt].iov_len = sizeMin(blockSize, fileSize - position - expected);
+            generateBuffer(position + expected, iov[iovCnt].iov_base, iov[iovCnt].iov_len);
+            expected += iov[iovCnt].iov_len;
+        }
+
+        size_t actual = fileWritev(file, iov, iovCnt, &error);
+        PG_ASSERT_OK(error);
+        PG_ASSERT_EQ(actual, expected);
+        position += actual;
+    }
+
+    free(buf);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+/* Verify a file has the correct data, reading it with vectored reads */
+void verifyVectorFile(IoStack *pipe, char *path, size_t fileSize, size_t blockSize)
+{
+    debug("verifyVectorFile: path=%s\n", path);
+    Error error = errorOK;
+    IoStack *file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    PG_ASSERT_OK(error);
+    Byte *buf = malloc(BLOCKS_PER_VECTOR * blockSize);
+
+    struct iovec iov[BLOCKS_PER_VECTOR];
+    for (size_t idx = 0; idx < BLOCKS_PER_VECTOR; idx++)
+        iov[idx] = (struct iovec){.iov_base = buf + idx * blockSize, .iov_len = blockSize};
+
+    for (size_t actual, position = 0; position < fileSize; position += actual)
+    {
+        size_t expected = sizeMin(BLOCKS_PER_VECTOR * blockSize, fileSize - position);
+        actual = fileReadv(file, iov, BLOCKS_PER_VECTOR, &error);
+        PG_ASSERT_OK(error);
+        PG_ASSERT_EQ(expected, actual);
+        PG_ASSERT(verifyBuffer(position, buf, actual));
+    }
+
+    // Read a final EOF.
+    fileReadv(file, iov, BLOCKS_PER_VECTOR, &error);
+    PG_ASSERT_EOF(error);
+
+    free(buf);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+/* Run a vectored I/O test on a single configuration determined by file size and block size */
+void singleVectorTest(IoStack *pipe, char *nameFmt, size_t fileSize, size_t blockSize)
+{
+    char fileName[PATH_MAX];
+    snprintf(fileName, sizeof(fileName), nameFmt, fileSize, blockSize);
+    beginTest(fileName);
+
+    generateVectorFile(pipe, fileName, fileSize, blockSize);
+    verifyVectorFile(pipe, fileName, fileSize, blockSize);
+    verifyFile(pipe, fileName, fileSize, blockSize);
+
+    /* Clean things up */
+    deleteFile(pipe, fileName);
+}
+
+
+/* run a matrix of vectored tests. Block sizes are multiples of 1K so they suit any pipeline. */
+void vectorTest(IoStack *pipe, char *nameFmt)
+{
+    size_t fileSize[] = {1024, 0, 64, 1027, 1, 1024*1024, 16*1024*1024 + 127};
+    size_t blockSize[] = {1024, 4*1024};
+
+    for (int fileIdx = 0; fileIdx<countof(fileSize); fileIdx++)
+        for (int blockIdx = 0; blockIdx<countof(blockSize); blockIdx++)
+            singleVectorTest(pipe, nameFmt, fileSize[fileIdx], blockSize[blockIdx]);
+}
+
+
+/*
+ * Overwrite an allocated file with known data, using positional writes in a random order.
+ */
+void generatePositionalFile(IoStack *pipe, char *path, size_t fileSize, size_t blockSize)
+{
+    debug("generatePositionalFile: path=%s\n", path);
+    size_t nrBlocks = (fileSize + blockSize - 1) / blockSize;
+    PG_ASSERT( nrBlocks == 0 || (nrBlocks % prime) != 0);
+
+    Error error = errorOK;
+    IoStack *file = fileOpen(pipe, path, O_RDWR, 0, &error);
+    PG_ASSERT_OK(error);
+    Byte *buf = malloc(blockSize);
+
+    for (size_t idx = 0; idx < nrBlocks; idx++)
+    {
+        /* Pick a pseudo-random block and write it in place */
+        size_t position = ((idx * prime) % nrBlocks) * blockSize;
+        size_t expected = sizeMin(blockSize, fileSize - position);
+        generateBuffer(position, buf, expected);
+        size_t actual = fileWriteAt(file, buf, expected, position, &error);
+        PG_ASSERT_OK(error);
+        PG_ASSERT_EQ(actual, expected);
+    }
+
+    free(buf);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+/*
+ * Verify a file has the correct data, using positional reads in a random order.
+ */
+void verifyPositionalFile(IoStack *pipe, char *path, size_t fileSize, size_t blockSize)
+{
+    debug("verifyPositionalFile: path=%s\n", path);
+    size_t nrBlocks = (fileSize + blockSize - 1) / blockSize;
+    PG_ASSERT(nrBlocks == 0 || (nrBlocks % prime) != 0);
+
+    Error error = errorOK;
+    IoStack *file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    PG_ASSERT_OK(error);
+    Byte *buf = malloc(blockSize);
+
+    for (size_t idx = 0;  idx < nrBlocks; idx++)
+    {
+        /* Pick a pseudo-random block and read it in place */
+        size_t position = ((idx * prime) % nrBlocks) * blockSize;
+        size_t actual = fileReadAt(file, buf, blockSize, position, &error);
+        PG_ASSERT_OK(error);
+
+        /* Verify we read the correct data */
+        size_t expected = sizeMin(blockSize, fileSize-position);
+        PG_ASSERT_EQ(actual, expected);
+        PG_ASSERT(verifyBuffer(position, buf, actual));
+    }
+
+    free(buf);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+/* Run a positional I/O test on a single configuration determined by file size and block size */
+void singlePositionalTest(IoStack *pipe, char *nameFmt, size_t fileSize, size_t blockSize)
+{
+    char fileName[PATH_MAX];
+    snprintf(fileName, sizeof(fileName), nameFmt, fileSize, blockSize);
+    beginTest(fileName);
+
+    /* Fill the file with garbage, then overwrite it with positional writes */
+    allocateFile(pipe, fileName, fileSize, blockSize);
+    generatePositionalFile(pipe, fileName, fileSize, blockSize);
+    verifyFile(pipe, fileName, fileSize, blockSize);
+
+    /* Read it back with positional reads */
+    verifyPositionalFile(pipe, fileName, fileSize, blockSize);
+
+    /* Clean things up */
+    deleteFile(pipe, fileName);
+}
+
+
+/* run a matrix of positional tests. Block sizes are multiples of 1K so they suit any pipeline. */
+void positionalTest(IoStack *pipe, char *nameFmt)
+{
+    size_t fileSize[] = {1024, 0, 64, 1027, 1, 1024*1024, 16*1024*1024 + 127};
+    size_t blockSize[] = {1024, 4*1024};
+
+    for (int fileIdx = 0; fileIdx<countof(fileSize); fileIdx++)
+        for (int blockIdx = 0; blockIdx<countof(blockSize); blockIdx++)
+            singlePositionalTest(pipe, nameFmt, fileSize[fileIdx], blockSize[blockIdx]);
+}
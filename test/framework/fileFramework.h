@@ -14,6 +14,12 @@ void singleStreamTest(IoStack *pipe, char *nameFmt, size_t fileSize, size_t bufS
 void readSeekTest(IoStack *pipe, char *nameFmt);
 void singleReadSeekTest(IoStack *pipe, char *nameFmt, size_t fileSiae, size_t bufSize);
 
+void vectorTest(IoStack *pipe, char *nameFmt);
+void singleVectorTest(IoStack *pipe, char *nameFmt, size_t fileSize, size_t blockSize);
+
+void positionalTest(IoStack *pipe, char *nameFmt);
+void singlePositionalTest(IoStack *pipe, char *nameFmt, size_t fileSize, size_t blockSize);
+
 #include "framework/unitTestInternal.h"
 
 #endif //FILTER_FILEFRAMEWORK_H
@@ -0,0 +1,53 @@
+/*  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include "iostack.h"
+#include "file/ioUringBottom.h"
+#include "file/buffered.h"
+
+#include "framework/fileFramework.h"
+#include "framework/unitTest.h"
+
+/* Rewrite the same block while the first write is still queued. The second write must win. */
+static void rewriteTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte first[1024], second[1024], readBuf[1024];
+    memset(first, 'a', sizeof(first));
+    memset(second, 'b', sizeof(second));
+
+    IoStack *file = fileOpen(pipe, path, O_RDWR|O_CREAT|O_TRUNC, 0666, &error);
+    for (int idx = 0; idx < 100; idx++)
+    {
+        fileSeek(file, 0, &error);
+        fileWrite(file, first, sizeof(first), &error);
+        fileSeek(file, 0, &error);
+        fileWrite(file, second, sizeof(second), &error);
+    }
+
+    fileSeek(file, 0, &error);
+    size_t actual = fileRead(file, readBuf, sizeof(readBuf), &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(sizeof(readBuf), actual);
+    PG_ASSERT(memcmp(second, readBuf, sizeof(readBuf)) == 0);
+
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+void testMain()
+{
+    system("rm -rf " TEST_DIR "ioUring; mkdir -p " TEST_DIR "ioUring");
+
+    beginTestGroup("io_uring Files");
+    IoStack *stream = ioStackNew(ioUringBottomNew(4, 1024));
+    seekTest(stream, TEST_DIR "ioUring/testfile_%u_%u.dat");
+    rewriteTest(stream, TEST_DIR "ioUring/rewrite.dat");
+
+    beginTestGroup("Buffered io_uring Files");
+    IoStack *buffered = ioStackNew(bufferedNew(16*1024, ioUringBottomNew(0, 0)));
+    seekTest(buffered, TEST_DIR "ioUring/buffered_%u_%u.dat");
+}
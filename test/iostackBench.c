@@ -0,0 +1,334 @@
+/*
+ * Benchmark the standard pipelines from the README.
+ *
+ * Each pipeline runs sequential write, sequential read, random read and append workloads
+ * over a matrix of block sizes and file sizes. For each run we report throughput (MB/s and ops/s)
+ * along with the median and 99th percentile latency of the individual requests.
+ *
+ * Usage:  iostackBench [-j] [-q] [-d directory] [pipeline ...]
+ *     -j     report in JSON rather than CSV
+ *     -q     quick run with a smaller matrix
+ *     -d     directory in which to create a private directory for the benchmark files (default /tmp)
+ *  Naming pipelines limits the run to just those pipelines.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/fcntl.h>
+#include "iostack.h"
+#include "file/buffered.h"
+#include "file/fileSystemBottom.h"
+#include "encrypt/libcrypto/aead.h"
+#include "compress/lz4/lz4.h"
+#include "fileSplit/fileSplit.h"
+
+static Byte *key = (Byte *)"0123456789ABCDEF0123456789ABCDEF";
+
+/* The pipelines pictured in the README. */
+static IoStack *rawPipeline() {
+    return ioStackNew(fileSystemBottomNew());
+}
+static IoStack *bufferedPipeline() {
+    return ioStackNew(bufferedNew(16*1024, fileSystemBottomNew()));
+}
+static IoStack *encryptedPipeline() {
+    return ioStackNew(bufferedNew(16*1024, aeadFilterNew("AES-256-GCM", 16*1024, key, 32, fileSystemBottomNew())));
+}
+/* Small records, where the per-record cost of setting up the cipher shows. */
+static IoStack *encryptedSmallPipeline() {
+    return ioStackNew(bufferedNew(16*1024, aeadFilterNew("AES-256-GCM", 1024, key, 32, fileSystemBottomNew())));
+}
+static IoStack *compressedPipeline() {
+    return ioStackNew(bufferedNew(16*1024, lz4CompressNew(16*1024, fileSystemBottomNew())));
+}
+static IoStack *splitPipeline() {
+    return ioStackNew(bufferedNew(16*1024, fileSplitNew(64*1024*1024, formatPath, "%s-%06d.seg", fileSystemBottomNew())));
+}
+static IoStack *kitchenSinkPipeline() {
+    return ioStackNew(
+        bufferedNew(16*1024,
+            lz4CompressNew(16*1024,
+                bufferedNew(16*1024,
+                    aeadFilterNew("AES-256-GCM", 16*1024, key, 32,
+                        fileSplitNew(64*1024*1024, formatPath, "%s-%06d.seg",
+                            fileSystemBottomNew()))))));
+}
+
+typedef struct Pipeline {
+    char *name;
+    IoStack *(*create)(void);
+} Pipeline;
+
+static Pipeline pipelines[] = {
+    {"raw", rawPipeline},
+    {"buffered", bufferedPipeline},
+    {"encrypted", encryptedPipeline},
+    {"encrypted1k", encryptedSmallPipeline},
+    {"compressed", compressedPipeline},
+    {"split", splitPipeline},
+    {"kitchenSink", kitchenSinkPipeline},
+};
+
+/* The matrix of block sizes and file sizes. */
+static size_t blockSizes[] = {1024, 16*1024, 256*1024};
+static size_t fileSizes[] = {1024*1024, 64*1024*1024};
+static size_t quickBlockSizes[] = {16*1024};
+static size_t quickFileSizes[] = {4*1024*1024};
+
+/* Measurements from one workload. */
+typedef struct Result {
+    size_t ops;
+    size_t bytes;
+    double seconds;
+    double *latency;   /* Latency of each request in microseconds */
+    Error error;
+} Result;
+
+static bool json = false;
+static bool firstRow = true;
+
+
+/* Current time in seconds, from a clock which doesn't jump. */
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time one request, keeping its latency. */
+#define TIMED(result, stmt) do {                                          \
+        double _start = now();                                            \
+        stmt;                                                             \
+        (result)->latency[(result)->ops++] = (now() - _start) * 1e6;      \
+    } while (0)
+
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Pick the given percentile from a sorted array of latencies. */
+static double percentile(double *sorted, size_t count, double pct)
+{
+    if (count == 0)
+        return 0;
+    size_t idx = (size_t)(pct / 100 * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+
+/* Write a file sequentially, one block at a time. */
+static void seqWrite(IoStack *pipe, char *path, size_t fileSize, size_t blockSize, Byte *buf, Result *result)
+{
+    double start = now();
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &result->error);
+    for (size_t position = 0; position < fileSize && errorIsOK(result->error); position += blockSize)
+    {
+        size_t size = sizeMin(blockSize, fileSize - position);
+        TIMED(result, fileWrite(file, buf, size, &result->error));
+        result->bytes += size;
+    }
+    fileClose(file, &result->error);
+    result->seconds = now() - start;
+}
+
+/* Read a file sequentially until EOF. */
+static void seqRead(IoStack *pipe, char *path, size_t fileSize, size_t blockSize, Byte *buf, Result *result)
+{
+    double start = now();
+    IoStack *file = fileOpen(pipe, path, O_RDONLY, 0, &result->error);
+    while (errorIsOK(result->error))
+    {
+        size_t actual;
+        TIMED(result, actual = fileRead(file, buf, blockSize, &result->error));
+        result->bytes += actual;
+    }
+    if (errorIsEOF(result->error))
+        result->error = errorOK;
+    fileClose(file, &result->error);
+    result->seconds = now() - start;
+}
+
+/* Read blocks from random, block aligned positions. As many reads as there are blocks in the file. */
+static void randomRead(IoStack *pipe, char *path, size_t fileSize, size_t blockSize, Byte *buf, Result *result)
+{
+    size_t nrBlocks = sizeRoundUp(fileSize, blockSize) / blockSize;
+    srandom(1);
+
+    double start = now();
+    IoStack *file = fileOpen(pipe, path, O_RDONLY, 0, &result->error);
+    for (size_t i = 0; i < nrBlocks && errorIsOK(result->error); i++)
+    {
+        off_t offset = (off_t)(random() % nrBlocks) * blockSize;
+        size_t actual;
+        TIMED(result, actual = fileReadAt(file, buf, blockSize, offset, &result->error));
+        result->bytes += actual;
+    }
+    fileClose(file, &result->error);
+    result->seconds = now() - start;
+}
+
+/* Reopen an existing file and append a quarter of its size to the end. */
+static void append(IoStack *pipe, char *path, size_t fileSize, size_t blockSize, Byte *buf, Result *result)
+{
+    size_t appendSize = sizeMax(fileSize / 4, blockSize);
+
+    double start = now();
+    IoStack *file = fileOpen(pipe, path, O_RDWR, 0, &result->error);
+    fileSeek(file, FILE_END_POSITION, &result->error);
+    for (size_t position = 0; position < appendSize && errorIsOK(result->error); position += blockSize)
+    {
+        size_t size = sizeMin(blockSize, appendSize - position);
+        TIMED(result, fileWrite(file, buf, size, &result->error));
+        result->bytes += size;
+    }
+    fileClose(file, &result->error);
+    result->seconds = now() - start;
+}
+
+
+/* Output one row of results. */
+static void report(char *pipeline, char *workload, size_t blockSize, size_t fileSize, Result *result)
+{
+    qsort(result->latency, result->ops, sizeof(double), compareDouble);
+    double seconds = (result->seconds > 0)? result->seconds: 1e-9;
+    double mbps = result->bytes / seconds / (1024*1024);
+    double opsps = result->ops / seconds;
+    double p50 = percentile(result->latency, result->ops, 50);
+    double p99 = percentile(result->latency, result->ops, 99);
+    const char *status = errorIsOK(result->error)? "ok": result->error.msg;
+
+    if (json)
+        printf("%s\n  {\"pipeline\": \"%s\", \"workload\": \"%s\", \"blockSize\": %zu, \"fileSize\": %zu, "
+               "\"bytes\": %zu, \"ops\": %zu, \"seconds\": %.6f, \"MBps\": %.2f, \"opsps\": %.1f, "
+               "\"p50us\": %.2f, \"p99us\": %.2f, \"status\": \"%s\"}",
+               firstRow? "": ",", pipeline, workload, blockSize, fileSize,
+               result->bytes, result->ops, result->seconds, mbps, opsps, p50, p99, status);
+    else
+        printf("%s,%s,%zu,%zu,%zu,%zu,%.6f,%.2f,%.1f,%.2f,%.2f,%s\n",
+               pipeline, workload, blockSize, fileSize,
+               result->bytes, result->ops, result->seconds, mbps, opsps, p50, p99, status);
+
+    firstRow = false;
+    fflush(stdout);
+}
+
+
+typedef void (*Workload)(IoStack *pipe, char *path, size_t fileSize, size_t blockSize, Byte *buf, Result *result);
+
+/* Run one workload, reporting the results. */
+static void runWorkload(Pipeline *pipeline, IoStack *pipe, char *workloadName, Workload workload,
+                        char *path, size_t fileSize, size_t blockSize, Byte *buf)
+{
+    /* Allow room for appending as well as the file itself. */
+    size_t maxOps = 2 * sizeRoundUp(fileSize, blockSize) / blockSize + 2;
+    Result result = (Result){.latency = malloc(maxOps * sizeof(double)), .error = errorOK};
+
+    workload(pipe, path, fileSize, blockSize, buf, &result);
+    report(pipeline->name, workloadName, blockSize, fileSize, &result);
+
+    free(result.latency);
+}
+
+
+static bool selected(char *name, int argc, char **argv)
+{
+    if (argc == 0)
+        return true;
+    for (int i = 0; i < argc; i++)
+        if (strcmp(name, argv[i]) == 0)
+            return true;
+    return false;
+}
+
+
+int main(int argc, char **argv)
+{
+    char *dir = "/tmp";
+    bool quick = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "jqd:")) != -1)
+        switch (opt)
+        {
+            case 'j': json = true; break;
+            case 'q': quick = true; break;
+            case 'd': dir = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-q] [-d directory] [pipeline ...]\n", argv[0]);
+                return 1;
+        }
+    argc -= optind;
+    argv += optind;
+
+    size_t *blocks = quick? quickBlockSizes: blockSizes;
+    size_t nrBlocks = quick? sizeof(quickBlockSizes)/sizeof(size_t): sizeof(blockSizes)/sizeof(size_t);
+    size_t *files = quick? quickFileSizes: fileSizes;
+    size_t nrFiles = quick? sizeof(quickFileSizes)/sizeof(size_t): sizeof(fileSizes)/sizeof(size_t);
+
+    /* Work in a directory of our own, so we never touch files we didn't create. */
+    char workDir[PATH_MAX];
+    if (snprintf(workDir, sizeof(workDir), "%s/iostackBench.XXXXXX", dir) >= (int)sizeof(workDir))
+    {
+        fprintf(stderr, "%s: directory name too long\n", dir);
+        return 1;
+    }
+    if (mkdtemp(workDir) == NULL)
+    {
+        perror(workDir);
+        return 1;
+    }
+
+    /* The data is a repeating line of text, so it is compressible, much like real spill files. */
+    static const char line[] = "The cat in the hat jumped over the quick brown fox while the dog ran away with the spoon.\n";
+    Byte *buf = malloc(blocks[nrBlocks-1]);
+    for (size_t i = 0; i < blocks[nrBlocks-1]; i++)
+        buf[i] = line[i % (sizeof(line) - 1)];
+
+    if (json)
+        printf("[");
+    else
+        printf("pipeline,workload,blockSize,fileSize,bytes,ops,seconds,MBps,opsps,p50us,p99us,status\n");
+
+    for (size_t p = 0; p < sizeof(pipelines)/sizeof(Pipeline); p++)
+    {
+        Pipeline *pipeline = &pipelines[p];
+        if (!selected(pipeline->name, argc, argv))
+            continue;
+        IoStack *pipe = pipeline->create();
+
+        for (size_t f = 0; f < nrFiles; f++)
+            for (size_t b = 0; b < nrBlocks; b++)
+            {
+                /* The work directory fit, but the file name might not. Skip the test rather than use a truncated name. */
+                char path[PATH_MAX];
+                if (snprintf(path, sizeof(path), "%s/%s_%zu_%zu.dat", workDir, pipeline->name, files[f], blocks[b]) >= (int)sizeof(path))
+                {
+                    fprintf(stderr, "%s: file name too long\n", workDir);
+                    continue;
+                }
+
+                runWorkload(pipeline, pipe, "seqWrite", seqWrite, path, files[f], blocks[b], buf);
+                runWorkload(pipeline, pipe, "seqRead", seqRead, path, files[f], blocks[b], buf);
+                runWorkload(pipeline, pipe, "randomRead", randomRead, path, files[f], blocks[b], buf);
+                runWorkload(pipeline, pipe, "append", append, path, files[f], blocks[b], buf);
+
+                /* Delete through the pipeline, so any index or split files go too. */
+                Error error = errorOK;
+                fileDelete(pipe, path, &error);
+            }
+    }
+
+    if (json)
+        printf("\n]\n");
+
+    rmdir(workDir);
+    free(buf);
+    return 0;
+}
@@ -1,5 +1,9 @@
 /*  */
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/fcntl.h>
 #include "common/filter.h"
 #include "iostack_error.h"
@@ -12,6 +16,156 @@
 #include "framework/unitTest.h"
 
 
+/* Write a file with an embedded index, append to it, and verify there is no separate index file. */
+static void embeddedTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[1000];
+    for (size_t idx = 0; idx < sizeof(buf); idx++)
+        buf[idx] = (Byte)idx;
+
+    /* Create a file with ten and a half blocks. */
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    for (int idx = 0; idx < 10; idx++)
+        fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    char indexPath[PATH_MAX];
+    snprintf(indexPath, sizeof(indexPath), "%s.idx", path);
+    PG_ASSERT_EQ(-1, access(indexPath, F_OK));
+
+    /* Append to it. */
+    file = fileOpen(pipe, path, O_WRONLY|O_APPEND, 0, &error);
+    fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    /* The size comes from the footer, and reading stops at the trailer. */
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    off_t size = fileSeek(file, FILE_END_POSITION, &error);
+    PG_ASSERT_EQ(11 * sizeof(buf), size);
+    fileSeek(file, 0, &error);
+
+    Byte readBuf[sizeof(buf)];
+    size_t total = 0;
+    while (!isError(error))
+    {
+        size_t actual = fileRead(file, readBuf, sizeof(readBuf), &error);
+        for (size_t idx = 0; idx < actual; idx++)
+            PG_ASSERT_EQ(buf[(total + idx) % sizeof(buf)], readBuf[idx]);
+        total += actual;
+    }
+    PG_ASSERT_EOF(error);
+    PG_ASSERT_EQ(11 * sizeof(buf), total);
+    error = errorOK;
+
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+/* Find the size of a file with a separate index. It comes from the index, without reading the compressed data. */
+static void endTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[1000] = {0};
+    FileStats stats[4];
+
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    for (int idx = 0; idx < 11; idx++)
+        fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    fileStatsEnable(true);
+    off_t size = fileSeek(file, FILE_END_POSITION, &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(11 * sizeof(buf), size);
+    PG_ASSERT_EQ(4, fileStats(file, stats, 4));
+    PG_ASSERT_EQ_STR("FileSystemBottom", stats[3].name);
+    PG_ASSERT_EQ(0, stats[3].bytesRead);
+    fileStatsEnable(false);
+
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
+/* Write the same random block over and over. Only a streaming filter can see the repetition. */
+static off_t repeatedBlockSize(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    Byte buf[1024];
+    srandom(42);
+    for (size_t idx = 0; idx < sizeof(buf); idx++)
+        buf[idx] = (Byte)random();
+
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    for (int idx = 0; idx < 64; idx++)
+        fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    struct stat st;
+    stat(path, &st);
+    return st.st_size;
+}
+
+static void streamingRatioTest(IoStack *independent, IoStack *streaming)
+{
+    off_t independentSize = repeatedBlockSize(independent, TEST_DIR "compressed/independent.lz4");
+    off_t streamingSize = repeatedBlockSize(streaming, TEST_DIR "compressed/streaming.lz4");
+    PG_ASSERT(streamingSize < independentSize / 2);
+}
+
+
+/*
+ * Write random blocks followed by text in a single request, so a parallel compressor sees both in one batch.
+ * The random blocks are stored raw, costing only their size prefix,
+ * and compressible blocks after a long run of raw ones still get compressed.
+ */
+static void incompressibleTest(IoStack *pipe, char *path)
+{
+    Error error = errorOK;
+    static Byte data[128][1024];
+    srandom(7);
+    for (size_t blockNr = 0; blockNr < 64; blockNr++)
+        for (size_t idx = 0; idx < sizeof(data[0]); idx++)
+            data[blockNr][idx] = (Byte)random();
+    for (size_t blockNr = 64; blockNr < 128; blockNr++)
+        for (size_t idx = 0; idx < sizeof(data[0]); idx++)
+            data[blockNr][idx] = "The quick brown fox jumps over the lazy dog. "[idx % 45];
+
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0666, &error);
+    fileWrite(file, (Byte *)data, sizeof(data), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    struct stat st;
+    stat(path, &st);
+    PG_ASSERT(st.st_size >= 64 * (1024 + 4));
+    PG_ASSERT(st.st_size < 64 * (1024 + 4) + 64 * 1024 / 2);
+
+    /* Both kinds of block read back intact. */
+    file = fileOpen(pipe, path, O_RDONLY, 0, &error);
+    Byte buf[1024];
+    for (int blockNr = 0; blockNr < 128; blockNr++)
+    {
+        size_t actual = fileRead(file, buf, sizeof(buf), &error);
+        PG_ASSERT_EQ(sizeof(buf), actual);
+        PG_ASSERT(memcmp(buf, data[blockNr], sizeof(buf)) == 0);
+    }
+    fileRead(file, buf, sizeof(buf), &error);
+    PG_ASSERT_EOF(error);
+    error = errorOK;
+
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+}
+
+
 void testMain()
 {
     system("rm -rf " TEST_DIR "compressed; mkdir -p " TEST_DIR "compressed");
@@ -26,5 +180,46 @@ void testMain()
 
     singleReadSeekTest(lz4, TEST_DIR "compressed/testfile_%u_%u.lz4", 1024, 64);
     readSeekTest(lz4, TEST_DIR "compressed/testfile_%u_%u.lz4");
+    incompressibleTest(lz4, TEST_DIR "compressed/incompressible.lz4");
+
+    beginTestGroup("LZ4 Parallel Compression");
+    IoStack *parallel =
+            ioStackNew(
+                bufferedNew(1024,
+                    lz4CompressParallelNew(1024, 4,
+                        bufferedNew(1024,
+                            fileSystemBottomNew()))));
+    readSeekTest(parallel, TEST_DIR "compressed/parallel_%u_%u.lz4");
+    incompressibleTest(parallel, TEST_DIR "compressed/incompressible_parallel.lz4");
+
+    beginTestGroup("LZ4 Compression with Vectored I/O");
+    IoStack *vector =
+            ioStackNew(
+                lz4CompressNew(1024,
+                    bufferedNew(1024,
+                        fileSystemBottomNew())));
+    vectorTest(vector, TEST_DIR "compressed/vector_%u_%u.lz4");
+
+    beginTestGroup("LZ4 Compression with Embedded Index");
+    IoStack *embedded =
+            ioStackNew(
+                bufferedNew(1024,
+                    lz4CompressEmbeddedNew(1024,
+                        bufferedNew(1024,
+                            fileSystemBottomNew()))));
+    embeddedTest(embedded, TEST_DIR "compressed/embedded.lz4");
+    readSeekTest(embedded, TEST_DIR "compressed/embedded_%u_%u.lz4");
+
+    beginTestGroup("LZ4 Streaming Compression");
+    IoStack *streaming =
+            ioStackNew(
+                bufferedNew(1024,
+                    lz4CompressStreamingNew(1024, 4,
+                        bufferedNew(1024,
+                            fileSystemBottomNew()))));
+    streamingRatioTest(lz4, streaming);
+    readSeekTest(streaming, TEST_DIR "compressed/streaming_%u_%u.lz4");
+    endTest(streaming, TEST_DIR "compressed/end.lz4");
+    incompressibleTest(streaming, TEST_DIR "compressed/incompressible_streaming.lz4");
 
 }
@@ -0,0 +1,24 @@
+/*  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/fcntl.h>
+#include "iostack.h"
+#include "file/mmapBottom.h"
+#include "file/buffered.h"
+
+#include "framework/fileFramework.h"
+#include "framework/unitTest.h"
+
+void testMain()
+{
+    system("rm -rf " TEST_DIR "mmap; mkdir -p " TEST_DIR "mmap");
+
+    beginTestGroup("Memory Mapped Files");
+    IoStack *stream = ioStackNew(mmapBottomNew());
+    seekTest(stream, TEST_DIR "mmap/testfile_%u_%u.dat");
+
+    beginTestGroup("Buffered Memory Mapped Files");
+    IoStack *buffered = ioStackNew(bufferedNew(16*1024, mmapBottomNew()));
+    seekTest(buffered, TEST_DIR "mmap/buffered_%u_%u.dat");
+    positionalTest(buffered, TEST_DIR "mmap/positional_%u_%u.dat");
+}
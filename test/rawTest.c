@@ -18,6 +18,12 @@ void testMain()
     IoStack *stream = ioStackNew(fileSystemBottomNew());
     seekTest(stream, TEST_DIR "raw/testfile_%u_%u.dat");
 
+    beginTestGroup("Raw Files with Vectored I/O");
+    vectorTest(stream, TEST_DIR "raw/vector_%u_%u.dat");
+
+    beginTestGroup("Raw Files with Positional I/O");
+    positionalTest(stream, TEST_DIR "raw/positional_%u_%u.dat");
+
     // open/close/read/write errors.
 
 
@@ -0,0 +1,119 @@
+/*  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/fcntl.h>
+#include "iostack.h"
+#include "file/fileSystemBottom.h"
+#include "file/buffered.h"
+#include "file/mmapBottom.h"
+#include "encrypt/libcrypto/aead.h"
+#include "trace/traceFilter.h"
+
+#include "framework/fileFramework.h"
+#include "framework/unitTest.h"
+
+
+/* Trace a small write and verify the records which come out of each kind of dump. */
+static void dumpTest(char *dir)
+{
+    Error error = errorOK;
+    Byte buf[3000] = {0};
+    char path[PATH_MAX];
+    TraceRing *ring = traceRingNew(64);
+    IoStack *pipe = ioStackNew(bufferedNew(1024, traceFilterNew(ring, fileSystemBottomNew())));
+
+    /* Buffered writes the two full blocks directly, then the partial block on close: Open, Write, Write, Close. */
+    snprintf(path, sizeof(path), "%s/data.dat", dir);
+    IoStack *file = fileOpen(pipe, path, O_WRONLY|O_CREAT|O_TRUNC, 0, &error);
+    fileWrite(file, buf, sizeof(buf), &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(4, traceRingCount(ring));
+
+    /* The JSON dump is Chrome's trace format. */
+    snprintf(path, sizeof(path), "%s/trace.json", dir);
+    traceDumpJson(ring, path, &error);
+    PG_ASSERT_OK(error);
+    IoStack *raw = ioStackNew(fileSystemBottomNew());
+    file = fileOpen(raw, path, O_RDONLY, 0, &error);
+    char json[4096] = {0};
+    fileRead(file, (Byte *)json, sizeof(json) - 1, &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT(strncmp(json, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [", 42) == 0);
+    PG_ASSERT(strstr(json, "\"name\": \"Close\", \"cat\": \"FileSystemBottom\"") != NULL);
+
+    /* The binary dump starts with a header, then the Open record. */
+    snprintf(path, sizeof(path), "%s/trace.bin", dir);
+    traceDumpBinary(ring, path, &error);
+    PG_ASSERT_OK(error);
+    file = fileOpen(raw, path, O_RDONLY, 0, &error);
+    char magic[8];
+    fileRead(file, (Byte *)magic, sizeof(magic), &error);
+    PG_ASSERT(memcmp(magic, "IOTRACE1", 8) == 0);
+    uint64_t count = fileGet8(file, &error);
+    PG_ASSERT_EQ(4, count);
+
+    /* Skip the times, position and sizes, then check the error, event and stage. */
+    for (int idx = 0; idx < 5; idx++)
+        fileGet8(file, &error);
+    uint32_t code = fileGet4(file, &error);
+    fileGet4(file, &error);
+    uint8_t event = fileGet1(file, &error);
+    uint8_t stageLen = fileGet1(file, &error);
+    PG_ASSERT_EQ(0, code);
+    PG_ASSERT_EQ(0, event);                  /* Open */
+    PG_ASSERT_EQ(16, stageLen);              /* strlen("FileSystemBottom") */
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+
+    traceRingFree(ring);
+}
+
+
+/* Positional events pass through as they are, rather than becoming a Seek followed by a Read or Write. */
+static void tracePositionalTest(char *dir)
+{
+    Error error = errorOK;
+    Byte buf[1024] = {0};
+    char path[PATH_MAX];
+    TraceRing *ring = traceRingNew(64);
+    IoStack *pipe = ioStackNew(traceFilterNew(ring, fileSystemBottomNew()));
+
+    /* Open, Pwrite, Pread, Close. */
+    snprintf(path, sizeof(path), "%s/positional.dat", dir);
+    IoStack *file = fileOpen(pipe, path, O_RDWR|O_CREAT|O_TRUNC, 0, &error);
+    fileWriteAt(file, buf, sizeof(buf), 0, &error);
+    fileReadAt(file, buf, sizeof(buf), 0, &error);
+    fileClose(file, &error);
+    PG_ASSERT_OK(error);
+    PG_ASSERT_EQ(4, traceRingCount(ring));
+
+    traceRingFree(ring);
+}
+
+
+void testMain()
+{
+    system("rm -rf " TEST_DIR "trace; mkdir -p " TEST_DIR "trace");
+
+    beginTestGroup("Trace Dumps");
+    dumpTest(TEST_DIR "trace");
+    tracePositionalTest(TEST_DIR "trace");
+
+    beginTestGroup("Traced Buffered Files");
+    TraceRing *ring = traceRingNew(4096);
+    IoStack *stream = ioStackNew(bufferedNew(1024, traceFilterNew(ring, fileSystemBottomNew())));
+    seekTest(stream, TEST_DIR "trace/testfile_%u_%u.dat");
+    PG_ASSERT(traceRingCount(ring) > 4096);
+
+    /* The trace point sits between a borrower and a lender, so the borrowing must pass through it. */
+    beginTestGroup("Traced Encrypted Files Borrowing Buffers");
+    IoStack *mapped =
+        ioStackNew(
+            bufferedNew(1024,
+                aeadFilterNew("AES-256-GCM", 1024, (Byte *)"0123456789ABCDEF0123456789ABCDEF", 32,
+                    traceFilterNew(ring, mmapBottomNew()))));
+    seekTest(mapped, TEST_DIR "trace/mapped_%u_%u.dat");
+}
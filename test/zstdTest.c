@@ -0,0 +1,41 @@
+/*  */
+#include <stdio.h>
+#include <sys/fcntl.h>
+#include "common/filter.h"
+#include "iostack_error.h"
+#include "file/fileSystemBottom.h"
+#include "file/buffered.h"
+#include "compress/zstd/zstd.h"
+#include "iostack.h"
+
+#include "framework/fileFramework.h"
+#include "framework/unitTest.h"
+
+
+void testMain()
+{
+    system("rm -rf " TEST_DIR "zstd; mkdir -p " TEST_DIR "zstd");
+
+    beginTestGroup("Zstd Compression");
+    IoStack *zstd =
+            ioStackNew(
+                bufferedNew(1024,
+                    zstdCompressNew(1024, 3,
+                        bufferedNew(1024,
+                            fileSystemBottomNew()))));
+    readSeekTest(zstd, TEST_DIR "zstd/testfile_%u_%u.zst");
+
+    /* A raw content dictionary, similar to the data we will be compressing. */
+    static const char dictionary[] = "The cat in the hat jumped over the quick brown fox while the dog ran away with the spoon.\n";
+
+    beginTestGroup("Zstd Compression with Options");
+    IoStack *tuned =
+            ioStackNew(
+                bufferedNew(16*1024,
+                    zstdCompressOptionsNew(16*1024,
+                        &(ZstdOptions){.level = 19, .nrThreads = 2, .longDistance = true,
+                                       .dictionary = (const Byte *)dictionary, .dictionarySize = sizeof(dictionary) - 1},
+                        bufferedNew(1024,
+                            fileSystemBottomNew()))));
+    readSeekTest(tuned, TEST_DIR "zstd/tuned_%u_%u.zst");
+}